@@ -8,6 +8,19 @@
 #include "imageBW.h"
 #include "instrumentation.h"
 
+// Imprime uma linha CSV com o tempo calibrado e os acessos (pixmem)
+// medidos no scope name desde o último InstrReset
+// (ou nada, se o scope nunca foi medido)
+static void printScope(const char* name, uint32_t size) {
+    int s = InstrFind(name);
+    if (s < 0) {
+        fprintf(stderr, "scope %s não encontrado\n", name);
+        return;
+    }
+    const InstrScope* scope = &InstrScopes[s];
+    printf("%u,%.6f,%lu\n", size, scope->cpu / InstrCTU, scope->count[0]);
+}
+
 int main(int argc, char* argv[]) {
     uint32_t sizes[] = {10, 20, 50, 100,120, 150, 200}; // Diferentes tamanhos de imagem
     
@@ -15,9 +28,6 @@ int main(int argc, char* argv[]) {
     // Inicializa os contadores de operações
     ImageInit();
 
-    // Calibrar o tempo de execução
-    InstrCalibrate();
-
     // Iniciar a instrumentação 
     
     double start_time = cpu_time();
@@ -36,8 +46,11 @@ int main(int argc, char* argv[]) {
 
     //printf("Branca com Preta");
         InstrReset();
-        ImageAND(white_image, black_image);
-        printAND(size);
+        Image result = ImageAND(white_image, black_image);
+        printScope("ImageAND", size);
+        ImageDestroy(&result);
+        ImageDestroy(&white_image);
+        ImageDestroy(&black_image);
         
         
     }
@@ -51,8 +64,11 @@ int main(int argc, char* argv[]) {
 
         //printf("Xadrez com Preta");
         InstrReset();
-        ImageAND(image_chess, black_image);
-        printAND(size);
+        Image result = ImageAND(image_chess, black_image);
+        printScope("ImageAND", size);
+        ImageDestroy(&result);
+        ImageDestroy(&image_chess);
+        ImageDestroy(&black_image);
         
        
     }
@@ -8,10 +8,8 @@
 #include "instrumentation.h" 
 
 int main() {
-    // Nomear os contadores que serão usados
-    InstrName[0] = "runs";
-    InstrName[1] = "memory_bytes";
-    InstrCalibrate();  
+    // Os contadores (bytes e runs) são nomeados por ImageInit
+    ImageInit();
 
 
     FILE* csv_file = fopen("chessboard_results.csv", "w");
@@ -44,7 +42,7 @@ int main() {
 
             // Escrever os resultados no CSV
             fprintf(csv_file, "%u,%u,%lu,%lu\n", size, square_edge,
-                    InstrCount[0], InstrCount[1]);
+                    InstrCount[2], InstrCount[1]);
 
             // Liberar a imagem usando ImageDestroy
             ImageDestroy(&img);
@@ -24,18 +24,62 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "instrumentation.h"
 
 // The data structure
 //
-// A BW image is stored in a structure containing 3 fields:
+// A BW image is stored in a structure containing these fields:
 // Two integers store the image width and height.
-// The other field is a pointer to an array that stores the pointers
-// to the RLE compressed image rows.
+// The RLE compressed arrays of the image rows are stored back to back in
+// a few large run buffers (usually just one, or one per work unit when
+// rows are built in parallel), instead of one allocation per row.
+// The row table has one entry per image row, the row header, with the
+// run buffer and offset of the row, its stored size and the color of
+// its first pixel, so that finding a row or its length is O(1).
+//
+// Rows use a compact RLE form: each run length is a 16-bit element,
+// and the first pixel color lives in the row header, not in the array.
+// A run longer than MAX_RUN pixels is escaped by splitting it with
+// zero-length runs of the other color: a run of 70000 pixels is stored
+// as 65535, 0, 4465.  Readers coalesce the pieces back into one run.
+//
+// Rows with many runs (halftones, fine chessboards) would be larger in
+// RLE than as plain bits, so, like the containers of Roaring bitmaps,
+// each row picks its container when it is built: it is stored as a
+// packed bitmap of 64-bit words instead, whenever its RLE form would take
+// more bytes (see UseBitmap).  Bitmap words hold 64 pixels each, with the
+// first pixel in the most significant bit, as in PBM files.  Padding
+// bits after the last pixel are always 0.  Bitmap rows start at 8-byte
+// aligned offsets of the run buffer.  This bounds any row to about
+// width/8 bytes.
+//
+// Rows are always kept in canonical form (the container is chosen by
+// UseBitmap, adjacent runs have different colors and long runs are split
+// as above), so equal rows are stored as equal arrays.
+//
+// Rows are never modified once built, so images may share them: run
+// buffers are reference counted, and operations that only reorder or
+// reuse rows (hmirror, repb, and neg for RLE rows, whose first color is
+// in the row header) copy row headers and share the run buffers, instead
+// of copying the rows.  New rows are always appended to a buffer that
+// is not shared.
+//
+// An image takes few, large allocations: the header, the row table and
+// the first few run buffer pointers share one block, and each run buffer
+// holds its elements in the same block as its header (a mapped buffer,
+// see LoadNative, only has the header).  So building an image allocates
+// a handful of blocks, and ImageDestroy frees them at once.  All of them
+// come from the allocator set by ImageSetAllocator.
 //
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
@@ -44,13 +88,57 @@
 // Constant value --- Use them throughout your code
 // const uint8 BLACK = 1;  // Black pixel value, defined on .h
 // const uint8 WHITE = 0;  // White pixel value, defined on .h
-const int EOR = -1;  // Stored as the last element of a RLE row
+const int EOR = -1;  // Printed as the last element of a RLE row
+
+// Longest run length that fits in a single run element
+#define MAX_RUN 0xFFFF
+
+// Row containers
+enum RowKind {
+  ROW_RLE,   // compact RLE run elements
+  ROW_BITS,  // packed bitmap words
+};
+
+// Row header: where the runs of a row are stored in the run buffer
+struct rowentry {
+  size_t offset;  // index of the first element of the row in runs
+  uint32 size;    // number of run elements (RLE) or 64-bit words (BITS)
+  uint8 color;    // the color of the first pixel of the row
+  uint8 kind;     // the row container (enum RowKind)
+  uint16 buf;     // the run buffer holding the row
+};
+
+// Run buffer: a block holding the elements of some rows, back to back.
+// Run buffers are shared by all images using their rows (see
+// ShareRunBuffers) and freed when the last of those images is destroyed.
+struct runbuf {
+  uint16* runs;       // the elements of the rows
+  size_t num_elems;   // number of elements in use in runs
+  size_t capacity;    // number of elements allocated for runs
+  atomic_uint refs;   // number of images using the buffer
+  uint64* interned;   // hashes of the rows of the intern table stored here
+  uint32 num_interned;
+  void* map;          // the file mapping holding runs, or NULL if allocated
+  size_t map_size;
+  // The elements follow, unless the buffer is mapped
+};
+
+// Number of run buffer pointers allocated along with the image
+#define IMAGE_BUFS 4
 
 // Internal structure for storing RLE BW images
 struct image {
   uint32 width;
   uint32 height;
-  int** row;  // pointer to an array of pointers referencing the compressed rows
+  struct rowentry* row;   // the row table, with one entry per image row
+  struct runbuf** buf;    // the run buffers (new rows go to the last one)
+  uint32 num_bufs;        // number of run buffers
+  uint32 max_bufs;        // number of run buffers that fit in buf
+  _Atomic(uint64*) row_hash;  // cached hashes, or NULL (see GetRowHashes)
+  _Atomic(size_t*) run_first;  // pixel position index, or NULL (see
+                               // GetRunStarts)
+  struct runbuf* own_buf[IMAGE_BUFS];  // buf, until more are needed
+  // The row table follows
 };
 
 // This module follows "design-by-contract" principles.
@@ -75,404 +163,1756 @@ static void check(int condition, const char* failmsg) {
   }
 }
 
+/// Memory allocation
+
+// The allocator of image memory (see ImageSetAllocator)
+static void* DefaultAlloc(size_t size, void* ctx) {
+  (void)ctx;
+  return malloc(size);
+}
+
+static void* DefaultRealloc(void* ptr, size_t old_size, size_t size,
+                            void* ctx) {
+  (void)old_size, (void)ctx;
+  return realloc(ptr, size);
+}
+
+static void DefaultFree(void* ptr, size_t size, void* ctx) {
+  (void)size, (void)ctx;
+  free(ptr);
+}
+
+static ImageAllocator allocator = {DefaultAlloc, DefaultRealloc,
+                                   DefaultFree, NULL};
+
+/// Set the allocator of image memory (NULL for the default one)
+void ImageSetAllocator(const ImageAllocator* a) {  ///
+  if (a == NULL) {
+    allocator = (ImageAllocator){DefaultAlloc, DefaultRealloc, DefaultFree,
+                                 NULL};
+  } else {
+    assert(a->alloc != NULL && a->realloc != NULL && a->free != NULL);
+    allocator = *a;
+  }
+}
+
+/// Allocate size bytes of image memory (fails if out of memory)
+static void* Allocate(size_t size) {
+  void* ptr = allocator.alloc(size, allocator.ctx);
+  check(ptr != NULL, "malloc");
+  return ptr;
+}
+
+/// Resize a block of image memory (fails if out of memory)
+static void* Reallocate(void* ptr, size_t old_size, size_t size) {
+  ptr = allocator.realloc(ptr, old_size, size, allocator.ctx);
+  check(ptr != NULL, "realloc");
+  return ptr;
+}
+
+/// Free a block of size bytes of image memory (ptr may be NULL)
+static void Deallocate(void* ptr, size_t size) {
+  if (ptr != NULL) allocator.free(ptr, size, allocator.ctx);
+}
+
+// Words of the scratch space that row builders keep on the stack
+// (enough for a bitmap row of 32768 pixels)
+#define STACK_WORDS 512
+
+/// Get scratch space for nwords words: stack (STACK_WORDS words on the
+/// stack of the caller) if they fit there, else image memory, so that
+/// building a row does not take a heap round-trip for common widths.
+static uint64* GetScratch(uint64* stack, size_t nwords) {
+  if (nwords <= STACK_WORDS) return stack;
+  return Allocate(nwords * sizeof(uint64));
+}
+
+/// Release the scratch space got with GetScratch(stack, nwords)
+static void PutScratch(uint64* scratch, uint64* stack, size_t nwords) {
+  if (scratch != stack) Deallocate(scratch, nwords * sizeof(uint64));
+}
+
 /// Init Image library.  (Call once!)
 /// Currently, simply calibrate instrumentation and set names of counters.
 void ImageInit(void) {  ///
   InstrCalibrate();
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
+  InstrName[1] = "bytes";   // bytes allocated for images and run buffers
+  InstrName[2] = "runs";    // run elements of the RLE rows built
+  InstrName[3] = "pixels";  // pixels of the rows built
   // Name other counters here...
 }
 
 // Macros to simplify accessing instrumentation counters:
-#define PIXMEM InstrCount[0]
+// (they go through a per-thread pointer, see RunUnit)
+static _Thread_local unsigned long* counters = InstrCount;
+#define PIXMEM (counters[0])
+#define BYTES (counters[1])
+#define RUNS (counters[2])
+#define PIXELS (counters[3])
 // Add more macros here...
 
+// Each public image operation is measured in a scope named after it
+// (see InstrBegin), so nested operations show up as nested scopes.
+
 // TIP: Search for PIXMEM or InstrCount to see where it is incremented!
 
 /// Auxiliary (static) functions
 
+// Elements after the run buffer header keep the alignment of bitmap rows
+static_assert(sizeof(struct runbuf) % sizeof(uint64) == 0,
+              "run buffer header breaks row alignment");
+
+/// Size of the block of a run buffer for capacity elements
+static inline size_t RunBufferSize(size_t capacity) {
+  return sizeof(struct runbuf) + capacity * sizeof(uint16);
+}
+
+/// Allocate a run buffer for capacity elements (at least one),
+/// used by a single image.
+static struct runbuf* NewRunBuffer(size_t capacity) {
+  if (capacity < 1) capacity = 1;
+  struct runbuf* b = Allocate(RunBufferSize(capacity));
+  b->runs = (uint16*)(b + 1);
+  BYTES += RunBufferSize(capacity);
+  b->num_elems = 0;
+  b->capacity = capacity;
+  atomic_init(&b->refs, 1);
+  b->interned = NULL;
+  b->num_interned = 0;
+  b->map = NULL;
+  b->map_size = 0;
+  return b;
+}
+
+static void UninternRunBuffer(struct runbuf* b);
+
+/// Drop a reference to a run buffer, freeing it if it was the last one
+static void ReleaseRunBuffer(struct runbuf* b) {
+  if (b != NULL && atomic_fetch_sub(&b->refs, 1) == 1) {
+    if (b->interned != NULL) UninternRunBuffer(b);
+    if (b->map != NULL) {
+      munmap(b->map, b->map_size);
+      Deallocate(b, sizeof(struct runbuf));
+    } else {
+      Deallocate(b, RunBufferSize(b->capacity));
+    }
+  }
+}
+
+/// Free the array of run buffer pointers of img, unless it is own_buf
+static void FreeRunBufferArray(Image img) {
+  if (img->buf != img->own_buf) {
+    Deallocate(img->buf, img->max_bufs * sizeof(struct runbuf*));
+  }
+}
+
+/// Add n run buffers to img, with no storage allocated yet.
+/// Returns the index of the first new buffer.
+static uint32 AddRunBuffers(Image img, uint32 n) {
+  uint32 first = img->num_bufs;
+  assert(first + n <= UINT16_MAX + 1);  // see rowentry.buf
+  if (first + n > img->max_bufs) {
+    uint32 max_bufs = 2 * img->max_bufs;
+    if (max_bufs < first + n) max_bufs = first + n;
+    struct runbuf** buf = Allocate(max_bufs * sizeof(struct runbuf*));
+    memcpy(buf, img->buf, first * sizeof(struct runbuf*));
+    FreeRunBufferArray(img);
+    img->buf = buf;
+    img->max_bufs = max_bufs;
+  }
+  memset(img->buf + first, 0, n * sizeof(struct runbuf*));
+  img->num_bufs = first + n;
+  return first;
+}
+
 /// Create the header of an image data structure
-/// And allocate the array of pointers to RLE rows
-static Image AllocateImageHeader(uint32 width, uint32 height) {
+/// And allocate the row table and a run buffer for capacity elements
+/// (or no run buffer at all, if capacity is 0)
+static Image AllocateImageHeader(uint32 width, uint32 height,
+                                 size_t capacity) {
   assert(width > 0 && height > 0);
-  Image newHeader = malloc(sizeof(struct image));
-  check(newHeader != NULL, "malloc");
+  // The header and the row table, in a single block
+  size_t size = sizeof(struct image) + height * sizeof(struct rowentry);
+  Image newHeader = Allocate(size);
+  BYTES += size;
 
   newHeader->width = width;
   newHeader->height = height;
-
-  // Allocating the array of pointers to RLE rows
-  newHeader->row = malloc(height * sizeof(int*));
-  check(newHeader->row != NULL, "malloc");
+  newHeader->row = (struct rowentry*)(newHeader + 1);
+
+  // Allocating the run buffer
+  newHeader->buf = newHeader->own_buf;
+  newHeader->num_bufs = 0;
+  newHeader->max_bufs = IMAGE_BUFS;
+  atomic_init(&newHeader->row_hash, NULL);
+  atomic_init(&newHeader->run_first, NULL);
+  if (capacity > 0) {
+    AddRunBuffers(newHeader, 1);
+    newHeader->buf[0] = NewRunBuffer(capacity);
+  }
 
   return newHeader;
 }
 
-/// Allocate an array to store a RLE row with n elements
-static int* AllocateRLERowArray(uint32 n) {
-  assert(n > 2);
-  int* newArray = malloc(n * sizeof(int));
-  check(newArray != NULL, "malloc");
+/// Get the total number of elements in the run buffers of img
+static size_t GetNumElems(const Image img) {
+  size_t num_elems = 0;
+  for (uint32 b = 0; b < img->num_bufs; b++) {
+    num_elems += img->buf[b]->num_elems;
+  }
+  return num_elems;
+}
 
-  return newArray;
+/// Share the run buffers of src with img, so that the rows of src
+/// can be used by img without copying them.
+/// Buffers already used by img are not added again.
+/// Stores in index[b] the index in img of buffer b of src, to be used in
+/// the buf field of the row entries copied from src.
+static void ShareRunBuffers(Image img, const Image src, uint32* index) {
+  for (uint32 b = 0; b < src->num_bufs; b++) {
+    uint32 k = 0;
+    while (k < img->num_bufs && img->buf[k] != src->buf[b]) k++;
+    if (k == img->num_bufs) {
+      AddRunBuffers(img, 1);
+      img->buf[k] = src->buf[b];
+      atomic_fetch_add(&src->buf[b]->refs, 1);
+    }
+    index[b] = k;
+  }
 }
 
-/// Compute the number of runs of a non-compressed (RAW) image row
-static uint32 GetNumRunsInRAWRow(uint32 image_width, const uint8* RAW_row) {
-  assert(image_width > 0);
-  assert(RAW_row != NULL);
+/// Copy rows first..first+n-1 of the row table of src to row dst of img,
+/// sharing their run buffers.
+static void ShareRows(Image img, uint32 dst, const Image src, uint32 first,
+                      uint32 n) {
+  uint32 index[src->num_bufs];
+  ShareRunBuffers(img, src, index);
+  for (uint32 i = 0; i < n; i++) {
+    img->row[dst + i] = src->row[first + i];
+    img->row[dst + i].buf = (uint16)index[src->row[first + i].buf];
+  }
+}
 
-  // How many runs?
-  uint32 num_runs = 1;
-  for (uint32 i = 1; i < image_width; i++) {
-    if (RAW_row[i] != RAW_row[i - 1]) {
-      num_runs++;
+/// Get the index of a row among the previous two rows of img that is
+/// stored in the same place as row i (a shared row), or i if none is
+static inline uint32 RepeatedRow(const Image img, uint32 i) {
+  for (uint32 j = (i >= 2) ? i - 2 : 0; j < i; j++) {
+    if (img->row[j].buf == img->row[i].buf &&
+        img->row[j].offset == img->row[i].offset &&
+        img->row[j].kind == img->row[i].kind) {
+      return j;
     }
   }
+  return i;
+}
 
-  return num_runs;
+/// Get the run elements of row i of an image
+static inline uint16* RowArray(const Image img, uint32 i) {
+  return img->buf[img->row[i].buf]->runs + img->row[i].offset;
 }
 
-/// Get the number of runs of a compressed RLE image row
-static uint32 GetNumRunsInRLERow(const int* RLE_row) {
-  assert(RLE_row != NULL);
+/// Get the bitmap words of row i of an image (a ROW_BITS row)
+static inline uint64* RowWords(const Image img, uint32 i) {
+  assert(img->row[i].kind == ROW_BITS);
+  return (uint64*)RowArray(img, i);
+}
 
-  // Go through the RLE_row until EOR is found
-  // Discard RLE_row[0], since it is a pixel color
+/// Get the number of bytes taken by row i of an image
+static inline size_t RowBytes(const Image img, uint32 i) {
+  if (img->row[i].kind == ROW_BITS) return img->row[i].size * sizeof(uint64);
+  return img->row[i].size * sizeof(uint16);
+}
 
-  uint32 num_runs = 0;
-  uint32 i = 1;
-  while (RLE_row[i] != EOR) {
-    num_runs++;
-    i++;
-  }
+/// Number of 64-bit words in a bitmap row with width pixels
+static inline uint32 NumWords(uint32 width) {
+  return (width + 63) / 64;
+}
+
+/// Should a row with width pixels and num_runs runs be stored as a bitmap?
+/// Yes, if its RLE elements would take more bytes than its bitmap words.
+static inline int UseBitmap(uint32 width, uint32 num_runs) {
+  return num_runs > 4 * NumWords(width);
+}
 
-  return num_runs;
+/// Upper bound on the number of elements needed to store a row
+/// with width pixels and at most num_runs runs (escapes included)
+static inline uint32 MaxRowSize(uint32 width, uint32 num_runs) {
+  return num_runs + 2 * (width / MAX_RUN);
 }
 
-/// Get the number of elements of an array storing a compressed RLE image row
-static uint32 GetSizeRLERowArray(const int* RLE_row) {
-  assert(RLE_row != NULL);
+/// Get the run buffer where new rows of img are written: the last one,
+/// which must not be shared with other images (nor mapped from a file).
+static inline struct runbuf* WriteBuffer(const Image img) {
+  assert(img->num_bufs > 0 && atomic_load(&img->buf[img->num_bufs - 1]->refs) == 1);
+  assert(img->buf[img->num_bufs - 1]->map == NULL);
+  return img->buf[img->num_bufs - 1];
+}
 
-  // Go through the array until EOR is found
-  uint32 i = 0;
-  while (RLE_row[i] != EOR) {
-    i++;
+/// Reserve space for a row of up to n run elements
+/// at the end of the last run buffer of img.
+/// Returns where the row elements should be written.
+/// The pointer is only valid until the next call to BeginRow.
+static uint16* BeginRow(Image img, uint32 n) {
+  assert(n > 0);
+  struct runbuf* b = WriteBuffer(img);
+  size_t needed = b->num_elems + n;
+  if (needed > b->capacity) {
+    // Grow geometrically, so appending rows is amortized O(1) per element.
+    // The buffer may move: it is only known to this image (see WriteBuffer)
+    size_t capacity = 2 * b->capacity;
+    if (capacity < needed) capacity = needed;
+    assert(b->interned == NULL);
+    b = Reallocate(b, RunBufferSize(b->capacity), RunBufferSize(capacity));
+    BYTES += (capacity - b->capacity) * sizeof(uint16);
+    b->runs = (uint16*)(b + 1);
+    b->capacity = capacity;
+    img->buf[img->num_bufs - 1] = b;
   }
+  return b->runs + b->num_elems;
+}
 
-  return (i + 1);
+/// Get where the next row of img will be written (see BeginRow)
+static inline uint16* RowTail(const Image img) {
+  struct runbuf* b = WriteBuffer(img);
+  return b->runs + b->num_elems;
 }
 
-/// Compress into RLE format a RAW image row
-/// Allocates and returns the array storing the image row in RLE format
-static int* CompressRow(uint32 image_width, const uint8* RAW_row) {
-  assert(image_width > 0);
-  assert(RAW_row != NULL);
+/// Commit the n elements written at the end of the last run buffer
+/// as row i of img, a RLE row with first pixel color.
+static void CommitRow(Image img, uint32 i, uint8 color, uint32 n) {
+  struct runbuf* b = WriteBuffer(img);
+  assert(n > 0 && b->num_elems + n <= b->capacity);
+  img->row[i].offset = b->num_elems;
+  img->row[i].size = n;
+  img->row[i].color = color;
+  img->row[i].kind = ROW_RLE;
+  img->row[i].buf = (uint16)(img->num_bufs - 1);
+  b->num_elems += n;
+  PIXELS += img->width;
+}
+
+/// Commit the n run elements written after BeginRow as row i of img,
+/// with first pixel color.
+static void EndRow(Image img, uint32 i, uint8 color, uint32 n) {
+  CommitRow(img, i, color, n);
+  RUNS += n;
+}
+
+/// Reserve space for a bitmap row of nwords words
+/// at the end of the last run buffer of img (aligned to 8 bytes).
+/// The pointer is only valid until the next call to BeginRow.
+static uint64* BeginBitsRow(Image img, uint32 nwords) {
+  // Each word takes 4 elements; skip elements to align the row
+  struct runbuf* b = WriteBuffer(img);
+  b->num_elems = (b->num_elems + 3) & ~(size_t)3;
+  return (uint64*)BeginRow(img, 4 * nwords);
+}
 
-  // How many runs?
-  uint32 num_runs = GetNumRunsInRAWRow(image_width, RAW_row);
+/// Commit the bitmap words written after BeginBitsRow as row i of img
+static void EndBitsRow(Image img, uint32 i, uint32 nwords) {
+  CommitRow(img, i, 0, 4 * nwords);
+  img->row[i].size = nwords;
+  img->row[i].kind = ROW_BITS;
+  img->row[i].color = (uint8)(RowWords(img, i)[0] >> 63);
+}
 
-  // Allocate the RLE row array
-  int* RLE_row = malloc((num_runs + 2) * sizeof(int));
-  check(RLE_row != NULL, "malloc");
+/// Get pixel x of a bitmap row
+static inline uint8 GetBit(const uint64* words, uint32 x) {
+  return (uint8)((words[x >> 6] >> (63 - (x & 63))) & 1);
+}
 
-  // Go through the RAW_row
-  RLE_row[0] = (int)RAW_row[0];  // Initial pixel value
-  uint32 index = 1;
-  int num_pixels = 1;
-  for (uint32 i = 1; i < image_width; i++) {
-    if (RAW_row[i] != RAW_row[i - 1]) {
-      RLE_row[index++] = num_pixels;
-      num_pixels = 0;
+/// Ways of updating a range of pixels of a bitmap row
+enum RangeOp { RANGE_CLEAR, RANGE_SET, RANGE_FLIP };
+
+/// Clear, set or flip pixels x0..x1-1 of a bitmap row
+static void ApplyRange(uint64* words, uint32 x0, uint32 x1,
+                       enum RangeOp op) {
+  if (x0 >= x1) return;
+  uint32 k0 = x0 >> 6;
+  uint32 k1 = (x1 - 1) >> 6;
+  for (uint32 k = k0; k <= k1; k++) {
+    uint64 mask = ~(uint64)0;
+    if (k == k0) mask &= ~(uint64)0 >> (x0 & 63);
+    if (k == k1) mask &= ~(uint64)0 << (63 - ((x1 - 1) & 63));
+    switch (op) {
+      case RANGE_CLEAR:
+        words[k] &= ~mask;
+        break;
+      case RANGE_SET:
+        words[k] |= mask;
+        break;
+      default:
+        words[k] ^= mask;
     }
-    num_pixels++;
   }
-  RLE_row[index++] = num_pixels;
-  RLE_row[index] = EOR;  // Reached the end of the row
+}
 
-  return RLE_row;
+/// Count the runs of a bitmap row with width pixels
+static uint32 GetNumRunsInBits(uint32 width, const uint64* words) {
+  uint32 nwords = NumWords(width);
+  uint32 transitions = 0;
+  uint64 carry = words[0] >> 63;  // the pixel before each word
+  for (uint32 k = 0; k < nwords; k++) {
+    // Bit for pixel x is 1 if pixel x differs from pixel x-1
+    uint64 diff = words[k] ^ ((words[k] >> 1) | (carry << 63));
+    if (k == nwords - 1 && (width & 63) != 0) {
+      diff &= ~(uint64)0 << (64 - (width & 63));  // ignore padding
+    }
+    transitions += (uint32)__builtin_popcountll(diff);
+    carry = words[k] & 1;
+  }
+  return transitions + 1;
 }
 
-static uint8* UncompressRow(uint32 image_width, const int* RLE_row) {
-  assert(image_width > 0);
-  assert(RLE_row != NULL);
+/// Invert the pixels of a bitmap row, keeping padding bits at 0
+static void InvertBits(uint32 width, uint64* words) {
+  uint32 nwords = NumWords(width);
+  for (uint32 k = 0; k < nwords; k++) {
+    words[k] = ~words[k];
+  }
+  if ((width & 63) != 0) {
+    words[nwords - 1] &= ~(uint64)0 << (64 - (width & 63));
+  }
+}
 
-  // The uncompressed row
-  uint8* row = (uint8*)malloc(image_width * sizeof(uint8));
-  check(row != NULL, "malloc");
+/// Reverse the order of the bits of a word
+static inline uint64 ReverseBits(uint64 x) {
+  x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+  x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+  x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+  return __builtin_bswap64(x);
+}
 
-  // Go through the RLE_row until EOR is found
-  int pixel_value = RLE_row[0];
-  uint32 i = 1;
-  uint32 dest_i = 0;
-  while (RLE_row[i] != EOR) {
-    // For each run
-    for (int aux = 0; aux < RLE_row[i]; aux++) {
-      row[dest_i++] = (uint8)pixel_value;
+/// Mirror a bitmap row left-right, from words into out.
+/// The words are reversed in order and in their bits, which moves the
+/// padding bits to the start of the row, so the result is then shifted
+/// left by the padding length.
+static void ReverseBitsRow(uint32 width, const uint64* words, uint64* out) {
+  uint32 nwords = NumWords(width);
+  uint32 pad = 64 * nwords - width;
+  for (uint32 k = 0; k < nwords; k++) {
+    out[k] = ReverseBits(words[nwords - 1 - k]);
+  }
+  if (pad > 0) {
+    for (uint32 k = 0; k + 1 < nwords; k++) {
+      out[k] = (out[k] << pad) | (out[k + 1] >> (64 - pad));
     }
-    // Next run
-    i++;
-    pixel_value ^= 1;
+    out[nwords - 1] <<= pad;
   }
+}
 
-  return row;
+/// Mix a 64-bit word into hash h
+static inline uint64 HashMix(uint64 h, uint64 k) {
+  h = (h ^ k) * 0x9E3779B97F4A7C15ULL;
+  return h ^ (h >> 32);
 }
 
-// Add your auxiliary functions here...
+/// Hash row i of img, from its header and its elements.
+/// Rows are canonical, so equal rows have equal hashes.
+static uint64 HashRow(const Image img, uint32 i) {
+  const struct rowentry* row = &img->row[i];
+  uint64 h = HashMix(0, ((uint64)row->size << 16) | (row->kind << 8) | row->color);
+  const uint8* bytes = (const uint8*)RowArray(img, i);
+  size_t nbytes = RowBytes(img, i);
+  size_t k = 0;
+  for (; k + 8 <= nbytes; k += 8) {
+    uint64 word;
+    memcpy(&word, bytes + k, 8);
+    h = HashMix(h, word);
+  }
+  if (k < nbytes) {
+    uint64 word = 0;
+    memcpy(&word, bytes + k, nbytes - k);
+    h = HashMix(h, word);
+  }
+  PIXMEM += (nbytes + 7) / 8;
+  return h;
+}
 
-/// Image management functions
+/// Get the hashes of all rows of img, computing them on first use,
+/// followed by the image hash (at index height).
+/// (Images are never modified once built, so the hashes stay valid.)
+/// Threads that compute them at once all publish their block with a
+/// compare-and-swap: the first one is kept, and the others freed.
+static const uint64* GetRowHashes(const Image img) {
+  uint64* cached = atomic_load(&img->row_hash);
+  if (cached != NULL) return cached;
+  uint64* row_hash = Allocate((img->height + 1) * sizeof(uint64));
+  uint64 h = HashMix(img->width, img->height);
+  for (uint32 i = 0; i < img->height; i++) {
+    uint32 j = RepeatedRow(img, i);
+    row_hash[i] = (j != i) ? row_hash[j] : HashRow(img, i);
+    h = HashMix(h, row_hash[i]);
+  }
+  row_hash[img->height] = h;
+  if (!atomic_compare_exchange_strong(&img->row_hash, &cached, row_hash)) {
+    Deallocate(row_hash, (img->height + 1) * sizeof(uint64));
+    return cached;  // another thread's block
+  }
+  return row_hash;
+}
 
-/// Create a new BW image, either BLACK or WHITE.
-///   width, height : the dimensions of the new image.
-///   val: the pixel color (BLACK or WHITE).
-/// Requires: width and height must be non-negative, val is either BLACK or
-/// WHITE.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageCreate(uint32 width, uint32 height, uint8 val) {
-  assert(width > 0 && height > 0);
-  assert(val == WHITE || val == BLACK);
+/// Paste the width pixels of a bitmap row at pixel x0 of the bitmap row
+/// out, with nwords words.  The pixels of out from x0 on must be 0.
+static void OrBitsAt(uint64* out, uint32 nwords, uint32 x0,
+                     const uint64* words, uint32 width) {
+  uint32 base = x0 >> 6;
+  uint32 shift = x0 & 63;
+  for (uint32 k = 0; k < NumWords(width); k++) {
+    out[base + k] |= words[k] >> shift;
+    if (shift > 0 && base + k + 1 < nwords) {
+      out[base + k + 1] |= words[k] << (64 - shift);
+    }
+  }
+}
 
-  Image newImage = AllocateImageHeader(width, height);
+/// Reader of the runs of a row, in either container
+struct rowreader {
+  const uint16* next;     // RLE: the next run element
+  const uint16* end;      // RLE: one past the last run element
+  const uint64* words;  // BITS: the bitmap words (NULL for RLE rows)
+  uint32 x;               // BITS: the first pixel of the next run
+  uint32 width;           // BITS: the number of pixels of the row
+  uint8 value;            // RLE: color of the next run
+};
 
-  // All image pixels have the same value
-  int pixel_value = (int)val;
+/// Start reading n RLE run elements, with first run color
+static inline void ReaderInitRuns(struct rowreader* r, const uint16* runs,
+                                  uint32 n, uint8 color) {
+  r->next = runs;
+  r->end = runs + n;
+  r->words = NULL;
+  r->value = color;
+}
 
-  // Creating the image rows, each row has just 1 run of pixels
-  // Each row is represented by an array of 3 elements [value,length,EOR]
-  for (uint32 i = 0; i < height; i++) {
-    newImage->row[i] = AllocateRLERowArray(3);
-    newImage->row[i][0] = pixel_value;
-    newImage->row[i][1] = (int)width;
-    newImage->row[i][2] = EOR;
+/// Start reading a bitmap row with width pixels
+static inline void ReaderInitBits(struct rowreader* r, const uint64* words,
+                                  uint32 width) {
+  r->words = words;
+  r->x = 0;
+  r->width = width;
+}
+
+/// Start reading row i of img
+static inline void ReaderInit(struct rowreader* r, const Image img,
+                              uint32 i) {
+  if (img->row[i].kind == ROW_BITS) {
+    ReaderInitBits(r, RowWords(img, i), img->width);
+  } else {
+    ReaderInitRuns(r, RowArray(img, i), img->row[i].size, img->row[i].color);
   }
+}
 
-  return newImage;
+/// Find the run starting at r->x in a bitmap row.
+/// Skips whole words that have no color change, and uses count leading
+/// zeros to find the change inside a word.
+static uint32 NextBitsRun(struct rowreader* r, uint8* value) {
+  uint32 x = r->x;
+  if (x >= r->width) return 0;
+  uint32 nwords = NumWords(r->width);
+  uint32 k = x >> 6;
+  // Pixels of the same color as pixel x become 0 bits
+  uint64 flip = GetBit(r->words, x) ? ~(uint64)0 : 0;
+  uint64 diff = (r->words[k] ^ flip) << (x & 63);
+  uint32 end;
+  if (diff != 0) {
+    end = x + (uint32)__builtin_clzll(diff);
+  } else {
+    for (k++; k < nwords && r->words[k] == flip; k++) {
+    }
+    end = (k < nwords) ? (k << 6) + (uint32)__builtin_clzll(r->words[k] ^ flip)
+                       : r->width;
+  }
+  if (end > r->width) end = r->width;  // a BLACK run ends at the padding
+  *value = (uint8)(flip & 1);
+  r->x = end;
+  return end - x;
 }
 
-/// Create a new BW image, with a perfect CHESSBOARD pattern.
-///   width, height : the dimensions of the new image.
-///   square_edge : the lenght of the edges of the sqares making up the
-///   chessboard pattern.
-///   first_value: the pixel color (BLACK or WHITE) of the
-///   first image pixel.
-/// Requires: width and height must be non-negative, val is either BLACK or
-/// WHITE.
-/// Requires: for the squares, width and height must be multiples of the
-/// edge lenght of the squares
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageCreateChessboard(uint32 width, uint32 height, uint32 square_edge,
-                            uint8 first_value) {
-    assert(width > 0 && height > 0);
-    assert(square_edge > 0);
-    assert(first_value == WHITE || first_value == BLACK);
+/// Read the next run of a row, coalescing escaped pieces.
+/// Stores its color in *value and returns its length,
+/// or returns 0 at the end of the row.
+static inline uint32 NextRun(struct rowreader* r, uint8* value) {
+  if (r->words != NULL) return NextBitsRun(r, value);
+  if (r->next == r->end) return 0;
+  uint32 length = *r->next++;
+  // An escape is a zero-length run followed by the rest of the run
+  while (r->next + 1 < r->end && r->next[0] == 0) {
+    length += r->next[1];
+    r->next += 2;
+  }
+  *value = r->value;
+  r->value ^= 1;
+  return length;
+}
 
-    assert(width % square_edge == 0 && height % square_edge == 0); // Garantir a divisibilidade
+/// Writer of rows in canonical compact RLE form.
+/// Runs are appended in order with PutRun and may have any length,
+/// including 0: adjacent runs of the same color are merged
+/// and long runs are split with escapes.
+/// When finished, rows with too many runs are turned into bitmap rows.
+struct rowwriter {
+  uint16* out;      // where the run elements are written (see BeginRow)
+  uint32 n;         // number of run elements written so far
+  uint32 num_runs;  // number of runs, not counting escapes
+  uint32 pending;   // length of the last run, not written yet
+  uint8 color;      // color of the first run
+  uint8 value;      // color of the last run
+};
 
-    Image newImage = AllocateImageHeader(width, height);
+/// Start writing a row into out
+static inline void WriterInit(struct rowwriter* w, uint16* out) {
+  w->out = out;
+  w->n = 0;
+  w->num_runs = 0;
+  w->pending = 0;
+  w->color = WHITE;
+  w->value = WHITE;
+}
 
-    // Adicionar a memória usada pelo ImageStruct e ponteiros de linha
-    InstrCount[1] += sizeof(struct image) + height * sizeof(int*);
+/// Write out the pending run, splitting it if too long
+static inline void FlushRun(struct rowwriter* w) {
+  uint32 length = w->pending;
+  while (length > MAX_RUN) {
+    w->out[w->n++] = MAX_RUN;
+    w->out[w->n++] = 0;  // escape: empty run of the other color
+    length -= MAX_RUN;
+  }
+  w->out[w->n++] = (uint16)length;
+  w->pending = 0;
+}
 
-    uint32 squares_per_row = width / square_edge;
+/// Append a run of length pixels of color value
+static inline void PutRun(struct rowwriter* w, uint8 value, uint32 length) {
+  if (length == 0) return;
+  if (w->num_runs == 0) {
+    // First run of the row
+    w->color = value;
+    w->value = value;
+    w->num_runs = 1;
+  } else if (value != w->value) {
+    FlushRun(w);
+    w->value = value;
+    w->num_runs++;
+  }
+  w->pending += length;
+}
 
-    for (uint32 i = 0; i < height; i++) {
-        // Determinar a cor inicial para esta linha
-        uint8 row_start_color = first_value;
-        if ((i / square_edge) % 2 != 0) {
-            row_start_color ^= 1;  // Alternar a cor inicial
-        }
+/// Fill a bitmap row from the runs read by r
+static void RunsToBits(uint32 width, struct rowreader* r, uint64* words) {
+  memset(words, 0, NumWords(width) * sizeof(uint64));
+  uint8 value;
+  uint32 length;
+  uint32 x = 0;
+  while ((length = NextRun(r, &value)) > 0) {
+    if (value == BLACK) ApplyRange(words, x, x + length, RANGE_SET);
+    x += length;
+  }
+}
 
-        // Criar uma linha RAW com o padrão xadrez
-        uint8* raw_row = malloc(width * sizeof(uint8));
-        check(raw_row != NULL, "malloc");
+/// Finish the row being written by w and commit it as row i of img
+static void EndRowWriter(Image img, uint32 i, struct rowwriter* w) {
+  assert(w->pending > 0);  // rows are never empty
+  FlushRun(w);
+  if (!UseBitmap(img->width, w->num_runs)) {
+    EndRow(img, i, w->color, w->n);
+    return;
+  }
+  // Too many runs: store the row as a bitmap instead.
+  // The runs are converted through a scratch bitmap, since the bitmap
+  // row overwrites them at the end of the run buffer.
+  uint32 nwords = NumWords(img->width);
+  uint64 stack[STACK_WORDS];
+  uint64* scratch = GetScratch(stack, nwords);
+  struct rowreader r;
+  ReaderInitRuns(&r, w->out, w->n, w->color);
+  RunsToBits(img->width, &r, scratch);
+  memcpy(BeginBitsRow(img, nwords), scratch, nwords * sizeof(uint64));
+  EndBitsRow(img, i, nwords);
+  PutScratch(scratch, stack, nwords);
+}
 
-        uint8 current_color = row_start_color;
+/// Commit the bitmap words written after BeginBitsRow as row i of img,
+/// turning them into a RLE row if that is the canonical container.
+static void EndWordsRow(Image img, uint32 i) {
+  uint32 nwords = NumWords(img->width);
+  uint64* words = (uint64*)RowTail(img);
+  uint32 num_runs = GetNumRunsInBits(img->width, words);
+  if (UseBitmap(img->width, num_runs)) {
+    EndBitsRow(img, i, nwords);
+    return;
+  }
+  // Few runs: store the row in RLE form instead
+  uint64 stack[STACK_WORDS];
+  uint64* scratch = GetScratch(stack, nwords);
+  memcpy(scratch, words, nwords * sizeof(uint64));
+  struct rowreader r;
+  ReaderInitBits(&r, scratch, img->width);
+  struct rowwriter w;
+  WriterInit(&w, BeginRow(img, MaxRowSize(img->width, num_runs)));
+  uint8 value;
+  uint32 length;
+  while ((length = NextRun(&r, &value)) > 0) {
+    PutRun(&w, value, length);
+  }
+  EndRowWriter(img, i, &w);
+  PutScratch(scratch, stack, nwords);
+}
 
-        for (uint32 j = 0; j < width; j++) {
-            raw_row[j] = current_color;
-            // Alternar a cor a cada 'square_edge' pixels
-            if ((j + 1) % square_edge == 0) {
-                current_color ^= 1;  // Alternar a cor
-            }
-        }
+/// Store a bitmap row (with padding bits cleared) as row i of img,
+/// in its canonical container.
+/// Color changes are found a word at a time: XOR-ing a word with a copy
+/// of itself shifted by one pixel leaves a 1 bit at each pixel that
+/// differs from the previous one, and count leading zeros gives the
+/// position of each change, which ends a run.  There is no separate pass
+/// to count the runs: once there are too many for a RLE row, the words
+/// are just copied as a bitmap row.
+/// (The words must not be in the run buffer of img.)
+static void StoreBitsRow(Image img, uint32 i, const uint64* words) {
+  uint32 width = img->width;
+  uint32 nwords = NumWords(width);
+  uint32 max_runs = 4 * nwords;  // more than this, and UseBitmap holds
+
+  struct rowwriter w;
+  WriterInit(&w, BeginRow(img, MaxRowSize(width, max_runs + 1)));
+
+  uint8 value = (uint8)(words[0] >> 63);  // color of the current run
+  uint32 start = 0;                        // first pixel of the current run
+  uint64 carry = value;                    // the pixel before each word
+  for (uint32 k = 0; k < nwords; k++) {
+    uint64 diff = words[k] ^ ((words[k] >> 1) | (carry << 63));
+    carry = words[k] & 1;
+    while (diff != 0) {
+      uint32 bit = (uint32)__builtin_clzll(diff);
+      uint32 x = (k << 6) + bit;
+      if (x >= width) break;  // change to the padding after a BLACK pixel
+      PutRun(&w, value, x - start);
+      if (w.num_runs > max_runs) {
+        // Store the words as they are
+        memcpy(BeginBitsRow(img, nwords), words, nwords * sizeof(uint64));
+        EndBitsRow(img, i, nwords);
+        return;
+      }
+      value ^= 1;
+      start = x;
+      diff ^= (uint64)1 << (63 - bit);
+    }
+    PIXMEM += 1;
+  }
+  PutRun(&w, value, width - start);
 
-        // Comprimir a linha RAW
-        int* RLE_row = CompressRow(width, raw_row);
-        // Adicionar a memória usada pela linha RLE
-        uint32 num_elems = GetSizeRLERowArray(RLE_row);
-        InstrCount[1] += num_elems * sizeof(int);
-        // Contar o número de runs
-        uint32 num_runs = GetNumRunsInRLERow(RLE_row);
-        InstrCount[0] += num_runs;
+  EndRowWriter(img, i, &w);
+}
 
-        newImage->row[i] = RLE_row;
+/// Get the number of run elements of row i of an image
+/// (an escaped long run counts as several elements).
+/// The count is stored in the row table, so this is O(1).
+/// Requires: row i is a RLE row.
+static uint32 GetNumRunsInRLERow(const Image img, uint32 i) {
+  assert(img->row[i].kind == ROW_RLE);
+  return img->row[i].size;
+}
 
-        free(raw_row);
-    }
+// Add your auxiliary functions here...
 
-    return newImage;
+/// Row interning
+
+// When interning is enabled (see ImageSetInterning), every image built
+// by the module has its rows deduplicated against the rows of all live
+// images, through a global intern table keyed by the row hash (see
+// HashRow).  A row equal to an interned row shares its storage: the
+// image takes a reference to the run buffer holding it.  The other rows
+// are copied into a new, exact run buffer, and inserted in the table.
+// Each such buffer lists the hashes of its rows, to remove them from the
+// table when the buffer is freed, so the table never keeps rows alive.
+// The table is an open-addressing hash table with linear probing.
+
+// Entry of the intern table (buf == NULL for an empty slot)
+struct internentry {
+  uint64 hash;
+  struct runbuf* buf;
+  size_t offset;
+  uint32 size;
+  uint8 color;
+  uint8 kind;
+  uint32 row;  // while an image is interned, the row that inserted it
+};
+
+// The intern table
+static struct {
+  atomic_int enabled;  // read without the lock, by every new image
+  pthread_mutex_t lock;
+  struct internentry* slot;
+  size_t num_slots;          // a power of 2 (or 0)
+  size_t num_entries;
+  uint64 rows_interned;      // rows inserted in the table, ever
+  uint64 rows_deduplicated;  // rows that shared an interned row, ever
+  uint64 bytes_saved;        // bytes of those rows
+} intern = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/// Enable or disable row interning for the images built from now on.
+/// Rows interned before stay shared (and in the table) while they live.
+void ImageSetInterning(int enabled) {  ///
+  atomic_store(&intern.enabled, enabled != 0);
 }
 
+/// Print statistics on row interning
+void ImageInternPrint(void) {  ///
+  pthread_mutex_lock(&intern.lock);
+  printf("# intern: %zu rows in table, %" PRIu64 " rows interned, %" PRIu64
+         " rows deduplicated, %" PRIu64 " bytes saved\n",
+         intern.num_entries, intern.rows_interned, intern.rows_deduplicated,
+         intern.bytes_saved);
+  pthread_mutex_unlock(&intern.lock);
+}
 
-/// Destroy the image pointed to by (*imgp).
-///   imgp : address of an Image variable.
-/// If (*imgp)==NULL, no operation is performed.
-/// Ensures: (*imgp)==NULL.
-/// Should never fail.
-void ImageDestroy(Image* imgp) {
-  assert(imgp != NULL);
+/// Get the slot of the entry for a row, or the empty slot where
+/// it should be inserted.  The entry matches if it has the same hash and
+/// either buf (if buf is not NULL) or the same header and elements.
+static size_t FindInternSlot(uint64 hash, const struct runbuf* buf,
+                             const struct rowentry* row, const uint16* runs,
+                             size_t nbytes) {
+  size_t mask = intern.num_slots - 1;
+  for (size_t s = hash & mask;; s = (s + 1) & mask) {
+    const struct internentry* e = &intern.slot[s];
+    if (e->buf == NULL) return s;
+    if (e->hash != hash) continue;
+    if (buf != NULL) {
+      if (e->buf == buf) return s;
+    } else if (e->size == row->size && e->kind == row->kind &&
+               e->color == row->color &&
+               memcmp(e->buf->runs + e->offset, runs, nbytes) == 0) {
+      return s;
+    }
+  }
+}
 
-  Image img = *imgp;
+/// Grow the intern table, if needed, so that it can take n more entries
+static void ReserveInternSlots(size_t n) {
+  if (2 * (intern.num_entries + n) <= intern.num_slots) return;
+  size_t num_slots = intern.num_slots ? intern.num_slots : 1024;
+  while (2 * (intern.num_entries + n) > num_slots) num_slots *= 2;
+  struct internentry* old = intern.slot;
+  size_t old_slots = intern.num_slots;
+  intern.slot = Allocate(num_slots * sizeof(struct internentry));
+  memset(intern.slot, 0, num_slots * sizeof(struct internentry));
+  intern.num_slots = num_slots;
+  size_t mask = num_slots - 1;
+  for (size_t s = 0; s < old_slots; s++) {
+    if (old[s].buf == NULL) continue;
+    size_t t = old[s].hash & mask;
+    while (intern.slot[t].buf != NULL) t = (t + 1) & mask;
+    intern.slot[t] = old[s];
+  }
+  Deallocate(old, old_slots * sizeof(struct internentry));
+}
 
-  for (uint32 i = 0; i < img->height; i++) {
-    free(img->row[i]);
+/// Remove the entry in slot s of the intern table.
+/// The entries after it in its probe sequence are shifted back,
+/// so that no tombstones are needed.
+static void RemoveInternSlot(size_t s) {
+  size_t mask = intern.num_slots - 1;
+  size_t hole = s;
+  for (size_t t = (s + 1) & mask; intern.slot[t].buf != NULL;
+       t = (t + 1) & mask) {
+    size_t home = intern.slot[t].hash & mask;
+    // Move the entry of slot t to the hole, if the hole is in its probe
+    // sequence, from home to t
+    if (((t - home) & mask) >= ((t - hole) & mask)) {
+      intern.slot[hole] = intern.slot[t];
+      hole = t;
+    }
   }
-  free(img->row);
-  free(img);
+  intern.slot[hole].buf = NULL;
+  intern.num_entries--;
+}
 
-  *imgp = NULL;
+/// Remove the rows of a run buffer, about to be freed, from the intern table.
+/// The table itself is freed along with its last entry, so no image memory
+/// is left once all images are destroyed (see ImageSetAllocator).
+static void UninternRunBuffer(struct runbuf* b) {
+  pthread_mutex_lock(&intern.lock);
+  for (uint32 k = 0; k < b->num_interned; k++) {
+    size_t s = FindInternSlot(b->interned[k], b, NULL, NULL, 0);
+    if (intern.slot[s].buf == b) RemoveInternSlot(s);
+  }
+  if (intern.num_entries == 0 && intern.slot != NULL) {
+    Deallocate(intern.slot, intern.num_slots * sizeof(struct internentry));
+    intern.slot = NULL;
+    intern.num_slots = 0;
+  }
+  pthread_mutex_unlock(&intern.lock);
+  Deallocate(b->interned,
+             (b->num_interned > 0 ? b->num_interned : 1) * sizeof(uint64));
 }
 
-/// Printing on the console
+/// Take a reference to a run buffer found in the intern table.
+/// Fails if the buffer is being freed (its count already dropped to 0).
+static int AcquireRunBuffer(struct runbuf* b) {
+  unsigned refs = atomic_load(&b->refs);
+  while (refs > 0) {
+    if (atomic_compare_exchange_weak(&b->refs, &refs, refs + 1)) return 1;
+  }
+  return 0;
+}
 
-/// Output the raw BW image
-void ImageRAWPrint(const Image img) {
-  assert(img != NULL);
+/// Get the index of run buffer b among the run buffers of img,
+/// adding it (with a new reference) if needed.
+/// Returns img->num_bufs if b cannot be added.
+static uint32 UseRunBuffer(Image img, struct runbuf* b) {
+  for (uint32 k = img->num_bufs; k-- > 0;) {  // most recent first
+    if (img->buf[k] == b) return k;
+  }
+  if (img->num_bufs > UINT16_MAX || !AcquireRunBuffer(b)) return img->num_bufs;
+  uint32 k = AddRunBuffers(img, 1);
+  img->buf[k] = b;
+  return k;
+}
 
-  printf("width = %d height = %d\n", img->width, img->height);
-  printf("RAW image:\n");
+/// Intern the rows of a newly built image, if interning is enabled.
+/// Rows already stored in interned run buffers are kept as they are, and
+/// so are rows of mapped native files: they take no heap memory, and
+/// copying them would undo the zero-copy load (see LoadNative).
+static void InternRows(Image img) {
+  if (!atomic_load(&intern.enabled)) return;
+  const uint64* hash = GetRowHashes(img);
+  uint32 height = img->height;
 
-  // Print the pixels of each image row
-  for (uint32 i = 0; i < img->height; i++) {
-    // The value of the first pixel in the current row
-    int pixel_value = img->row[i][0];
-    for (uint32 j = 1; img->row[i][j] != EOR; j++) {
-      // Print the current run of pixels
-      for (int k = 0; k < img->row[i][j]; k++) {
-        printf("%d", pixel_value);
+  // The old run buffers are replaced by interned ones and a new one
+  uint32 old_num_bufs = img->num_bufs;
+  struct runbuf** old_buf = Allocate(old_num_bufs * sizeof(struct runbuf*));
+  memcpy(old_buf, img->buf, old_num_bufs * sizeof(struct runbuf*));
+  img->num_bufs = 0;
+  AddRunBuffers(img, 1);  // buffer 0 will hold the new rows
+
+  // source[i] is -1 for a row sharing an interned row, or the row to copy:
+  // i itself for a new row, or an earlier row of img with the same contents.
+  // slot[i] is the table entry of a new row (or SIZE_MAX if none).
+  int64_t* source = Allocate(height * sizeof(int64_t));
+  size_t* slot = Allocate(height * sizeof(size_t));
+  size_t num_elems = 0;
+  uint32 num_new = 0;
+
+  // First pass: share the rows found in the table, and insert the others
+  // with their old place (no slot moves until the lock is released)
+  pthread_mutex_lock(&intern.lock);
+  ReserveInternSlots(height);
+  for (uint32 i = 0; i < height; i++) {
+    struct rowentry* row = &img->row[i];
+    struct runbuf* b = old_buf[row->buf];
+    const uint16* runs = b->runs + row->offset;
+    size_t nbytes = RowBytes(img, i);
+    uint32 k;
+    source[i] = -1;
+    slot[i] = SIZE_MAX;
+    if ((b->interned != NULL || b->map != NULL) &&
+        (k = UseRunBuffer(img, b)) < img->num_bufs) {
+      row->buf = (uint16)k;  // already interned, or mapped
+      continue;
+    }
+    size_t s = FindInternSlot(hash[i], NULL, row, runs, nbytes);
+    struct internentry* e = &intern.slot[s];
+    if (e->buf != NULL && e->buf->interned == NULL) {
+      // Inserted by an earlier row of img
+      source[i] = e->row;
+    } else if (e->buf != NULL && (k = UseRunBuffer(img, e->buf)) < img->num_bufs) {
+      row->buf = (uint16)k;
+      row->offset = e->offset;
+    } else {
+      // A new row (or one whose interned copy cannot be used)
+      if (e->buf == NULL) {
+        *e = (struct internentry){hash[i], b, row->offset, row->size,
+                                  row->color, row->kind, i};
+        intern.num_entries++;
+        slot[i] = s;
+        num_new++;
       }
-      // Switch (XOR) to the pixel value for the next run, if any
-      pixel_value ^= 1;
+      source[i] = i;
+      num_elems += (nbytes / sizeof(uint16)) + 3;
+      continue;
     }
-    // At current row end
-    printf("\n");
+    intern.rows_deduplicated++;
+    intern.bytes_saved += nbytes;
   }
-  printf("\n");
+
+  // Second pass: copy the new rows into buffer 0, and point their
+  // table entries to it
+  struct runbuf* nb = NewRunBuffer(num_elems);
+  img->buf[0] = nb;
+  nb->interned = Allocate((num_new > 0 ? num_new : 1) * sizeof(uint64));
+  for (uint32 i = 0; i < height; i++) {
+    struct rowentry* row = &img->row[i];
+    if (source[i] < 0) continue;
+    if (source[i] != i) {
+      *row = img->row[source[i]];  // already copied
+      continue;
+    }
+    size_t n = RowBytes(img, i) / sizeof(uint16);
+    if (row->kind == ROW_BITS) nb->num_elems = (nb->num_elems + 3) & ~(size_t)3;
+    memcpy(nb->runs + nb->num_elems, old_buf[row->buf]->runs + row->offset,
+           n * sizeof(uint16));
+    row->buf = 0;
+    row->offset = nb->num_elems;
+    nb->num_elems += n;
+    if (slot[i] != SIZE_MAX) {
+      intern.slot[slot[i]].buf = nb;
+      intern.slot[slot[i]].offset = row->offset;
+      nb->interned[nb->num_interned++] = hash[i];
+      intern.rows_interned++;
+    }
+  }
+  pthread_mutex_unlock(&intern.lock);
+
+  Deallocate(source, height * sizeof(int64_t));
+  Deallocate(slot, height * sizeof(size_t));
+  for (uint32 k = 0; k < old_num_bufs; k++) ReleaseRunBuffer(old_buf[k]);
+  Deallocate(old_buf, old_num_bufs * sizeof(struct runbuf*));
 }
 
-/// Output the compressed RLE image
-void ImageRLEPrint(const Image img) {
-  assert(img != NULL);
+/// Row-parallel execution
+
+// Every operation builds each row of its result independently of the
+// others, so rows can be split among threads.  ImageSetThreads sets how
+// many threads are used; the workers are kept in a pool and sleep
+// between operations.
+// Rows are grouped in work units: ranges of consecutive rows with about
+// the same weight, the number of input run elements, rather than the
+// same number of rows, since scanned pages mix blank rows with dense
+// text bands.  Each unit builds its rows into a run buffer of its own,
+// so threads never share a buffer, and the result does not depend on
+// which thread runs which unit: it is the same as the serial result.
+
+#define MAX_THREADS 64
+
+// The thread pool
+static struct {
+  uint32 num_threads;              // threads used by operations (1 = serial)
+  pthread_t workers[MAX_THREADS];  // the num_threads - 1 worker threads
+  pthread_mutex_t lock;
+  pthread_cond_t start;            // broadcast when a job is posted
+  pthread_cond_t finish;           // signaled when all units are done
+  void (*run)(void* job, uint32 unit);  // the current job
+  void* job;
+  uint32 num_units;                // number of units of the current job
+  uint32 next_unit;                // the next unit to be taken
+  uint32 pending;                  // units not finished yet
+  unsigned long generation;        // incremented for each job
+  int quit;                        // tells the workers to exit
+} pool = {
+    .num_threads = 1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .finish = PTHREAD_COND_INITIALIZER,
+};
 
-  printf("width = %d height = %d\n", img->width, img->height);
-  printf("RLE encoding:\n");
+/// Take and run units of the current job, until there are none left.
+/// Must be called holding pool.lock.
+static void RunUnit(void) {
+  while (pool.next_unit < pool.num_units) {
+    uint32 unit = pool.next_unit++;
+    void (*run)(void*, uint32) = pool.run;
+    void* job = pool.job;
+    pthread_mutex_unlock(&pool.lock);
+
+    // Count locally, so threads do not race on the counters
+    unsigned long count[NUMCOUNTERS] = {0};
+    unsigned long* shared = counters;
+    counters = count;
+    run(job, unit);
+    counters = shared;
+
+    pthread_mutex_lock(&pool.lock);
+    for (int c = 0; c < NUMCOUNTERS; c++) counters[c] += count[c];
+    if (--pool.pending == 0) pthread_cond_signal(&pool.finish);
+  }
+}
 
-  // Print the compressed rows information
-  for (uint32 i = 0; i < img->height; i++) {
-    uint32 j;
-    for (j = 0; img->row[i][j] != EOR; j++) {
-      printf("%d ", img->row[i][j]);
+/// Worker thread: run units of each job posted
+static void* Worker(void* arg) {
+  (void)arg;
+  pthread_mutex_lock(&pool.lock);
+  unsigned long seen = pool.generation;
+  for (;;) {
+    while (!pool.quit && pool.generation == seen) {
+      pthread_cond_wait(&pool.start, &pool.lock);
     }
-    printf("%d\n", img->row[i][j]);
+    if (pool.quit) break;
+    seen = pool.generation;
+    RunUnit();
   }
-  printf("\n");
+  pthread_mutex_unlock(&pool.lock);
+  return NULL;
 }
 
-/// PBM BW file operations
+/// Run run(job, unit) for each unit in 0..num_units-1,
+/// using all pool threads, including the caller.
+static void RunUnits(void (*run)(void*, uint32), void* job,
+                     uint32 num_units) {
+  pthread_mutex_lock(&pool.lock);
+  pool.run = run;
+  pool.job = job;
+  pool.num_units = num_units;
+  pool.next_unit = 0;
+  pool.pending = num_units;
+  pool.generation++;
+  pthread_cond_broadcast(&pool.start);
+  RunUnit();
+  while (pool.pending > 0) {
+    pthread_cond_wait(&pool.finish, &pool.lock);
+  }
+  pthread_mutex_unlock(&pool.lock);
+}
 
-// See PBM format specification: http://netpbm.sourceforge.net/doc/pbm.html
+/// Set the number of threads used by image operations.
+/// Stops the current workers and starts n - 1 new ones.
+void ImageSetThreads(int n) {  ///
+  if (n < 1) n = 1;
+  if (n > MAX_THREADS) n = MAX_THREADS;
+
+  pthread_mutex_lock(&pool.lock);
+  pool.quit = 1;
+  pthread_cond_broadcast(&pool.start);
+  pthread_mutex_unlock(&pool.lock);
+  for (uint32 t = 0; t + 1 < pool.num_threads; t++) {
+    pthread_join(pool.workers[t], NULL);
+  }
 
-// Auxiliary function
-static void unpackBits(int nbytes, const uint8 bytes[], uint8 raw_row[]) {
-  // bitmask starts at top bit
-  int offset = 0;
-  uint8 mask = 1 << (7 - offset);
-  while (offset < 8) {  // or (mask > 0)
-    for (int b = 0; b < nbytes; b++) {
-      raw_row[8 * b + offset] = (bytes[b] & mask) != 0;
-    }
-    mask >>= 1;
-    offset++;
+  pool.quit = 0;
+  pool.num_threads = (uint32)n;
+  for (uint32 t = 0; t + 1 < pool.num_threads; t++) {
+    errno = pthread_create(&pool.workers[t], NULL, Worker, NULL);
+    check(errno == 0, "pthread_create");
   }
 }
 
-// Auxiliary function
-static void packBits(int nbytes, uint8 bytes[], const uint8 raw_row[]) {
-  // bitmask starts at top bit
-  int offset = 0;
-  uint8 mask = 1 << (7 - offset);
-  while (offset < 8) {  // or (mask > 0)
-    for (int b = 0; b < nbytes; b++) {
-      if (offset == 0) bytes[b] = 0;
-      bytes[b] |= raw_row[8 * b + offset] ? mask : 0;
+/// Function that builds row i of img, given scratch space of its work
+/// unit (see BuildRows)
+typedef void (*RowBuilder)(Image img, uint32 i, const void* args,
+                           void* scratch);
+
+/// Function that estimates the cost of building row i (see BuildRows)
+typedef uint32 (*RowWeight)(const void* args, uint32 i);
+
+/// Function that finds an earlier row j < i that row i repeats, because
+/// it is built from the same input rows (see RepeatedRow), or returns i
+typedef uint32 (*RowRepeat)(const void* args, uint32 i);
+
+// A BuildRows job
+struct buildjob {
+  Image img;
+  RowBuilder build;
+  RowRepeat repeat;
+  const void* args;
+  const uint32* first;      // first[u] is the first row of unit u
+  const uint64* weight;     // weight[u] is the weight of unit u
+  uint64 total;             // total weight
+  size_t capacity;          // estimate of the elements needed for all rows
+  size_t scratch_size;      // bytes of scratch space for each unit
+};
+
+/// Build the rows of a work unit into run buffer u of the image,
+/// through a partial image that shares its row table.
+static void BuildUnit(void* arg, uint32 u) {
+  const struct buildjob* job = arg;
+  Image img = job->img;
+  struct image part = *img;
+  part.buf = &img->buf[u];
+  part.num_bufs = 1;
+  img->buf[u] = NewRunBuffer(job->capacity * job->weight[u] / job->total);
+  void* scratch = (job->scratch_size > 0) ? Allocate(job->scratch_size) : NULL;
+  for (uint32 i = job->first[u]; i < job->first[u + 1]; i++) {
+    uint32 j = (job->repeat != NULL) ? job->repeat(job->args, i) : i;
+    if (j != i && j >= job->first[u]) {
+      img->row[i] = img->row[j];  // a row of this unit: share it
+      continue;
     }
-    mask >>= 1;
-    offset++;
+    job->build(&part, i, job->args, scratch);
+    img->row[i].buf = (uint16)u;
   }
+  Deallocate(scratch, job->scratch_size);
 }
 
-// Match and skip 0 or more comment lines in file f.
-// Comments start with a # and continue until the end-of-line, inclusive.
-// Returns the number of comments skipped.
-static int skipComments(FILE* f) {
-  char c;
-  int i = 0;
-  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n') {
-    i++;
+/// Build all rows of img with build(img, i, args, scratch).
+/// When more than one thread is enabled, the rows are split in work units
+/// of about the same weight, where weight(args, i) is the estimated cost
+/// of building row i (e.g., its number of input run elements).
+/// If repeat is not NULL, a row that repeat(args, i) finds to be a repeat
+/// of an earlier row is not built again: it shares that row instead
+/// (unless it was built by another thread).
+/// If scratch_size > 0, each unit (or the serial path) allocates
+/// scratch_size bytes of image memory once, and passes them to build for
+/// each of its rows; otherwise scratch is NULL.
+/// Requires: img was allocated with a single run buffer, still empty,
+/// whose capacity is the estimate of the elements needed for all rows.
+static void BuildRows(Image img, RowBuilder build, const void* args,
+                      RowWeight weight, RowRepeat repeat,
+                      size_t scratch_size) {
+  uint32 height = img->height;
+  uint32 num_units = 2 * pool.num_threads;  // a few units per thread
+  if (num_units > height) num_units = height;
+  if (pool.num_threads < 2 || num_units < 2) {
+    // Serial path
+    void* scratch = (scratch_size > 0) ? Allocate(scratch_size) : NULL;
+    for (uint32 i = 0; i < height; i++) {
+      uint32 j = (repeat != NULL) ? repeat(args, i) : i;
+      if (j != i) {
+        img->row[i] = img->row[j];
+      } else {
+        build(img, i, args, scratch);
+      }
+    }
+    Deallocate(scratch, scratch_size);
+    return;
   }
-  return i;
+
+  // Split the rows in units of about the same weight
+  uint64 total = 0;
+  for (uint32 i = 0; i < height; i++) {
+    total += (uint64)weight(args, i) + 1;
+  }
+  uint32 first[num_units + 1];
+  uint64 unit_weight[num_units];
+  uint32 u = 0;
+  uint64 sum = 0;  // weight of the rows before row i
+  first[0] = 0;
+  unit_weight[0] = 0;
+  for (uint32 i = 0; i < height; i++) {
+    uint64 w = (uint64)weight(args, i) + 1;
+    if (u + 1 < num_units && sum * num_units >= (u + 1) * total) {
+      first[++u] = i;
+      unit_weight[u] = 0;
+    }
+    unit_weight[u] += w;
+    sum += w;
+  }
+  while (u + 1 < num_units) {  // trailing units may be left empty
+    first[++u] = height;
+    unit_weight[u] = 0;
+  }
+  first[num_units] = height;
+
+  // One run buffer per unit (replacing the single one)
+  size_t capacity = img->buf[0]->capacity;
+  ReleaseRunBuffer(img->buf[0]);
+  img->num_bufs = 0;
+  AddRunBuffers(img, num_units);
+
+  struct buildjob job = {img,   build,       repeat, args,    first,
+                         unit_weight, total, capacity, scratch_size};
+  RunUnits(BuildUnit, &job, num_units);
 }
 
-/// Load a raw PBM file.
-/// Only binary PBM files are accepted.
+/// Boolean operations supported by the run-merging kernel
+enum BoolOp { OP_AND, OP_OR, OP_XOR };
+
+/// Apply a boolean operation to two pixel values
+static inline uint8 ApplyOp(enum BoolOp op, uint8 a, uint8 b) {
+  switch (op) {
+    case OP_AND:
+      return a & b;
+    case OP_OR:
+      return a | b;
+    default:
+      return a ^ b;
+  }
+}
+
+/// Combine two RLE rows of the same width, pixel by pixel, with op.
+/// Walks both run lists in step, without uncompressing them: each step
+/// consumes the shorter of the two current runs, so the cost is
+/// O(runs1 + runs2) instead of O(width).
+/// Adjacent output runs with the same color are merged, so the result is
+/// in the same canonical form produced by the row writer.
+/// Stores the result row in RLE format as row i of img
+static void MergeRunRows(Image img, uint32 i, const Image img1, uint32 i1,
+                         const Image img2, uint32 i2, enum BoolOp op) {
+  // The result has at most one run per run boundary of the operands
+  uint32 max_runs =
+      GetNumRunsInRLERow(img1, i1) + GetNumRunsInRLERow(img2, i2);
+  struct rowwriter w;
+  WriterInit(&w, BeginRow(img, MaxRowSize(img->width, max_runs)));
+
+  struct rowreader r1, r2;
+  ReaderInit(&r1, img1, i1);
+  ReaderInit(&r2, img2, i2);
+  uint8 val1 = WHITE, val2 = WHITE;
+  uint32 left1 = NextRun(&r1, &val1);  // Pixels left in the current run of row1
+  uint32 left2 = NextRun(&r2, &val2);  // Pixels left in the current run of row2
+
+  while (left1 > 0) {
+    uint32 step = (left1 < left2) ? left1 : left2;
+    PutRun(&w, ApplyOp(op, val1, val2), step);
+    PIXMEM += 1;
+
+    // Advance whichever runs were fully consumed
+    left1 -= step;
+    left2 -= step;
+    if (left1 == 0) left1 = NextRun(&r1, &val1);
+    if (left2 == 0) left2 = NextRun(&r2, &val2);
+  }
+  assert(left2 == 0);  // Rows must have the same width
+
+  EndRowWriter(img, i, &w);
+}
+
+/// Combine two bitmap rows of the same width, word by word, with op.
+/// The loops are simple enough for the compiler to vectorize.
+static void MergeBitsRows(Image img, uint32 i, const Image img1, uint32 i1,
+                          const Image img2, uint32 i2, enum BoolOp op) {
+  uint32 nwords = NumWords(img->width);
+  uint64* out = BeginBitsRow(img, nwords);
+  const uint64* words1 = RowWords(img1, i1);
+  const uint64* words2 = RowWords(img2, i2);
+  switch (op) {
+    case OP_AND:
+      for (uint32 k = 0; k < nwords; k++) out[k] = words1[k] & words2[k];
+      break;
+    case OP_OR:
+      for (uint32 k = 0; k < nwords; k++) out[k] = words1[k] | words2[k];
+      break;
+    default:
+      for (uint32 k = 0; k < nwords; k++) out[k] = words1[k] ^ words2[k];
+  }
+  PIXMEM += nwords;
+  EndWordsRow(img, i);
+}
+
+/// Combine a bitmap row of img1 and a RLE row of img2 with op.
+/// The bitmap is copied and then each run of the RLE row clears,
+/// sets or flips a range of it (or leaves the range unchanged).
+static void MergeMixedRows(Image img, uint32 i, const Image img1, uint32 i1,
+                           const Image img2, uint32 i2, enum BoolOp op) {
+  uint32 nwords = NumWords(img->width);
+  uint64* out = BeginBitsRow(img, nwords);
+  memcpy(out, RowWords(img1, i1), nwords * sizeof(uint64));
+
+  struct rowreader r;
+  ReaderInit(&r, img2, i2);
+  uint8 value;
+  uint32 length;
+  uint32 x = 0;
+  while ((length = NextRun(&r, &value)) > 0) {
+    if (op == OP_AND && value == WHITE) {
+      ApplyRange(out, x, x + length, RANGE_CLEAR);
+    } else if (op == OP_OR && value == BLACK) {
+      ApplyRange(out, x, x + length, RANGE_SET);
+    } else if (op == OP_XOR && value == BLACK) {
+      ApplyRange(out, x, x + length, RANGE_FLIP);
+    }
+    x += length;
+    PIXMEM += 1;
+  }
+  EndWordsRow(img, i);
+}
+
+/// Combine row i1 of img1 and row i2 of img2 with op into row i of img,
+/// dispatching on the containers of the two rows.
+/// The operands may be rows of img itself, built before row i.
+static void MergeRows(Image img, uint32 i, const Image img1, uint32 i1,
+                      const Image img2, uint32 i2, enum BoolOp op) {
+  uint8 kind1 = img1->row[i1].kind;
+  uint8 kind2 = img2->row[i2].kind;
+  if (kind1 == ROW_RLE && kind2 == ROW_RLE) {
+    MergeRunRows(img, i, img1, i1, img2, i2, op);
+  } else if (kind1 == ROW_BITS && kind2 == ROW_BITS) {
+    MergeBitsRows(img, i, img1, i1, img2, i2, op);
+  } else if (kind1 == ROW_BITS) {
+    MergeMixedRows(img, i, img1, i1, img2, i2, op);
+  } else {
+    // All operations are commutative
+    MergeMixedRows(img, i, img2, i2, img1, i1, op);
+  }
+}
+
+// Operands of MergeImages
+struct mergeargs {
+  Image img1;
+  Image img2;
+  enum BoolOp op;
+};
+
+/// RowBuilder for MergeImages
+static void BuildMergedRow(Image img, uint32 i, const void* args,
+                           void* scratch) {
+  (void)scratch;
+  const struct mergeargs* a = args;
+  MergeRows(img, i, a->img1, i, a->img2, i, a->op);
+}
+
+/// RowWeight for operations with a single source image (passed as args)
+static uint32 SourceRowWeight(const void* args, uint32 i) {
+  const Image img = (const Image)args;
+  return img->row[i].size;
+}
+
+/// RowWeight for MergeImages
+static uint32 MergedRowWeight(const void* args, uint32 i) {
+  const struct mergeargs* a = args;
+  return a->img1->row[i].size + a->img2->row[i].size;
+}
+
+/// RowRepeat for operations with a single source image (passed as args)
+static uint32 SourceRowRepeat(const void* args, uint32 i) {
+  return RepeatedRow((const Image)args, i);
+}
+
+/// RowRepeat for MergeImages
+static uint32 MergedRowRepeat(const void* args, uint32 i) {
+  const struct mergeargs* a = args;
+  uint32 j = RepeatedRow(a->img1, i);
+  return (j != i && RepeatedRow(a->img2, i) == j) ? j : i;
+}
+
+/// Combine two images of the same size, row by row, with op.
+static Image MergeImages(const Image img1, const Image img2, enum BoolOp op) {
+  // Start with room for the larger operand; the buffer grows if needed
+  size_t num_elems1 = GetNumElems(img1);
+  size_t num_elems2 = GetNumElems(img2);
+  size_t capacity = num_elems1 > num_elems2 ? num_elems1 : num_elems2;
+  Image newImage = AllocateImageHeader(img1->width, img1->height, capacity);
+
+  struct mergeargs args = {img1, img2, op};
+  BuildRows(newImage, BuildMergedRow, &args, MergedRowWeight, MergedRowRepeat,
+            0);
+
+  InternRows(newImage);
+  return newImage;
+}
+
+/// Image management functions
+
+/// Create a new BW image, either BLACK or WHITE.
+///   width, height : the dimensions of the new image.
+///   val: the pixel color (BLACK or WHITE).
+/// Requires: width and height must be non-negative, val is either BLACK or
+/// WHITE.
+///
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
-Image ImageLoad(const char* filename) {  ///
-  int w, h;
+Image ImageCreate(uint32 width, uint32 height, uint8 val) {
+  assert(width > 0 && height > 0);
+  assert(val == WHITE || val == BLACK);
+  InstrBegin("ImageCreate");
+
+  uint32 row_size = MaxRowSize(width, 1);
+  Image newImage = AllocateImageHeader(width, height, row_size);
+
+  // Creating the first row, with just 1 run of pixels
+  // (stored as a single element, unless width exceeds MAX_RUN)
+  struct rowwriter w;
+  WriterInit(&w, BeginRow(newImage, row_size));
+  PutRun(&w, val, width);
+  EndRowWriter(newImage, 0, &w);
+
+  // All the other rows share it
+  for (uint32 i = 1; i < height; i++) {
+    newImage->row[i] = newImage->row[0];
+  }
+
+  InternRows(newImage);
+  InstrEnd();
+  return newImage;
+}
+
+/// Create a new BW image, with a perfect CHESSBOARD pattern.
+///   width, height : the dimensions of the new image.
+///   square_edge : the lenght of the edges of the sqares making up the
+///   chessboard pattern.
+///   first_value: the pixel color (BLACK or WHITE) of the
+///   first image pixel.
+/// Requires: width and height must be non-negative, val is either BLACK or
+/// WHITE.
+/// Requires: for the squares, width and height must be multiples of the
+/// edge lenght of the squares
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageCreateChessboard(uint32 width, uint32 height, uint32 square_edge,
+                            uint8 first_value) {
+    assert(width > 0 && height > 0);
+    assert(square_edge > 0);
+    assert(first_value == WHITE || first_value == BLACK);
+
+    assert(width % square_edge == 0 && height % square_edge == 0); // Garantir a divisibilidade
+    InstrBegin("ImageCreateChessboard");
+
+    uint32 squares_per_row = width / square_edge;
+
+    // There are only two distinct rows: they are built once, from their
+    // runs, and every other row shares one of them
+    // (room for both rows, as RLE or as aligned bitmaps)
+    uint32 row_size = MaxRowSize(width, squares_per_row) + 3;
+    Image newImage = AllocateImageHeader(width, height, 2 * (size_t)row_size);
+
+    for (uint32 i = 0; i < height; i++) {
+        // As linhas da faixa i / square_edge repetem a primeira linha
+        // das faixas 0 ou 1, com cores iniciais alternadas
+        uint32 band = (i / square_edge) % 2;
+        uint32 src_row = band * square_edge;
+        if (i != src_row) {
+            newImage->row[i] = newImage->row[src_row];
+        } else {
+            // Escrever os runs diretamente, um por quadrado
+            uint8 row_start_color = first_value ^ (uint8)band;
+            struct rowwriter w;
+            WriterInit(&w, BeginRow(newImage, MaxRowSize(width, squares_per_row)));
+            for (uint32 s = 0; s < squares_per_row; s++) {
+                PutRun(&w, row_start_color ^ (uint8)(s & 1), square_edge);
+            }
+            EndRowWriter(newImage, i, &w);
+        }
+    }
+
+    InternRows(newImage);
+    InstrEnd();
+    return newImage;
+}
+
+
+/// Destroy the image pointed to by (*imgp).
+///   imgp : address of an Image variable.
+/// If (*imgp)==NULL, no operation is performed.
+/// Ensures: (*imgp)==NULL.
+/// Should never fail.
+void ImageDestroy(Image* imgp) {
+  assert(imgp != NULL);
+
+  Image img = *imgp;
+  if (img == NULL) return;
+
+  // All rows live in the run buffers, so there is no per-row cleanup;
+  // the buffers are freed once no other image shares them
+  for (uint32 b = 0; b < img->num_bufs; b++) {
+    ReleaseRunBuffer(img->buf[b]);
+  }
+  FreeRunBufferArray(img);
+  Deallocate(atomic_load(&img->row_hash), (img->height + 1) * sizeof(uint64));
+  size_t* run_first = atomic_load(&img->run_first);
+  if (run_first != NULL) {
+    Deallocate(run_first, (img->height + 1) * sizeof(size_t) +
+                              run_first[img->height] * sizeof(uint32));
+  }
+  Deallocate(img, sizeof(struct image) + img->height * sizeof(struct rowentry));
+
+  *imgp = NULL;
+}
+
+/// Printing on the console
+
+/// Output the raw BW image
+void ImageRAWPrint(const Image img) {
+  assert(img != NULL);
+
+  printf("width = %d height = %d\n", img->width, img->height);
+  printf("RAW image:\n");
+
+  // Print the pixels of each image row
+  for (uint32 i = 0; i < img->height; i++) {
+    struct rowreader r;
+    ReaderInit(&r, img, i);
+    uint8 pixel_value;
+    uint32 length;
+    while ((length = NextRun(&r, &pixel_value)) > 0) {
+      // Print the current run of pixels
+      for (uint32 k = 0; k < length; k++) {
+        printf("%d", pixel_value);
+      }
+    }
+    // At current row end
+    printf("\n");
+  }
+  printf("\n");
+}
+
+/// Output the compressed RLE image
+void ImageRLEPrint(const Image img) {
+  assert(img != NULL);
+
+  printf("width = %d height = %d\n", img->width, img->height);
+  printf("RLE encoding:\n");
+
+  // Print the compressed rows information
+  // (in the same format as always: first pixel color, runs, EOR)
+  for (uint32 i = 0; i < img->height; i++) {
+    struct rowreader r;
+    ReaderInit(&r, img, i);
+    uint8 pixel_value;
+    uint32 length;
+    printf("%d ", img->row[i].color);
+    while ((length = NextRun(&r, &pixel_value)) > 0) {
+      printf("%u ", length);
+    }
+    printf("%d\n", EOR);
+  }
+  printf("\n");
+}
+
+/// PBM BW file operations
+
+// See PBM format specification: http://netpbm.sourceforge.net/doc/pbm.html
+
+// Auxiliary function
+// Turn a row of PBM bytes, read into the words array, into bitmap words.
+// PBM stores the first pixel in the top bit of each byte, so each word
+// is just 8 bytes taken in big-endian order.  Padding bits are cleared.
+static void bytesToWords(uint32 width, uint64 words[]) {
+  uint32 nwords = NumWords(width);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  for (uint32 k = 0; k < nwords; k++) {
+    words[k] = __builtin_bswap64(words[k]);
+  }
+#endif
+  if ((width & 63) != 0) {
+    words[nwords - 1] &= ~(uint64)0 << (64 - (width & 63));
+  }
+}
+
+// Auxiliary function
+// Turn bitmap words back into a row of PBM bytes, in place.
+// (The inverse of bytesToWords.)
+static void wordsToBytes(uint32 width, uint64 words[]) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint32 nwords = NumWords(width);
+  for (uint32 k = 0; k < nwords; k++) {
+    words[k] = __builtin_bswap64(words[k]);
+  }
+#else
+  (void)width;
+  (void)words;
+#endif
+}
+
+// Size of the output buffer of ImageSave (rows are written in chunks)
+#define SAVE_CHUNK (1 << 20)
+
+// Match and skip 0 or more comment lines in file f.
+// Comments start with a # and continue until the end-of-line, inclusive.
+// Returns the number of comments skipped.
+static int skipComments(FILE* f) {
   char c;
-  FILE* f = NULL;
-  Image img = NULL;
+  int i = 0;
+  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n') {
+    i++;
+  }
+  return i;
+}
 
-  check((f = fopen(filename, "rb")) != NULL, "Open failed");
-  // Parse PBM header
+/// Read the header of a PBM file, up to the pixels
+static void ReadPBMHeader(FILE* f, int* w, int* h) {
+  char c;
   check(fscanf(f, "P%c ", &c) == 1 && c == '4', "Invalid file format");
   skipComments(f);
-  check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width");
+  check(fscanf(f, "%d ", w) == 1 && *w >= 0, "Invalid width");
   skipComments(f);
-  check(fscanf(f, "%d", &h) == 1 && h >= 0, "Invalid height");
+  check(fscanf(f, "%d", h) == 1 && *h >= 0, "Invalid height");
   check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected");
+}
+
+/// RowBuilder for ImageLoad: decodes row i from the PBM pixel bytes
+static void BuildLoadedRow(Image img, uint32 i, const void* args,
+                           void* scratch) {
+  (void)scratch;
+  uint32 nbytes = (img->width + 8 - 1) / 8;
+  const uint8* pixels = (const uint8*)args + (size_t)i * nbytes;
+  uint32 nwords = NumWords(img->width);
+  uint64 stack[STACK_WORDS];
+  uint64* words = GetScratch(stack, nwords);
+  words[nwords - 1] = 0;  // the last word may be partially filled
+  memcpy(words, pixels, nbytes);
+  bytesToWords(img->width, words);
+  StoreBitsRow(img, i, words);
+  PutScratch(words, stack, nwords);
+}
+
+/// RowWeight for ImageLoad: the run counts are not known before decoding
+static uint32 UniformRowWeight(const void* args, uint32 i) {
+  (void)args;
+  (void)i;
+  return 0;
+}
+
+static Image LoadNative(const char* filename);
+
+/// Load a PBM or native file (see ImageLoad)
+static Image LoadImage(const char* filename) {
+  int w, h;
+  FILE* f = NULL;
+  Image img = NULL;
+
+  check((f = fopen(filename, "rb")) != NULL, "Open failed");
+  // Native files are mapped instead (see LoadNative)
+  int first = getc(f);
+  if (first != 'P') {
+    fclose(f);
+    return LoadNative(filename);
+  }
+  ungetc(first, f);
+  // Parse PBM header
+  ReadPBMHeader(f, &w, &h);
 
-  // Allocate image
-  img = AllocateImageHeader(w, h);
+  // Allocate image (with room for a few runs per row)
+  img = AllocateImageHeader(w, h, 8 * (size_t)h);
 
   // Read pixels
   int nbytes = (w + 8 - 1) / 8;  // number of bytes for each row
-  // using VLAs...
-  uint8 bytes[nbytes];
-  uint8 raw_row[nbytes * 8];
+  // The bytes of each row are read straight into bitmap words
+  // and the runs are found a word at a time (see StoreBitsRow).
+  // With more than one thread, all pixels are read at once
+  // and the rows are decoded in parallel.
+  if (pool.num_threads > 1) {
+    uint8* pixels = malloc((size_t)nbytes * h);
+    check(pixels != NULL, "malloc");
+    check(fread(pixels, sizeof(uint8), (size_t)nbytes * h, f) ==
+              (size_t)nbytes * h,
+          "Reading pixels");
+    BuildRows(img, BuildLoadedRow, pixels, UniformRowWeight, NULL, 0);
+    free(pixels);
+    fclose(f);
+    InternRows(img);
+    return img;
+  }
+  uint32 nwords = NumWords(w);
+  uint64 stack[STACK_WORDS];
+  uint64* words = GetScratch(stack, nwords);
   for (uint32 i = 0; i < img->height; i++) {
-    check(fread(bytes, sizeof(uint8), nbytes, f) == (size_t)nbytes,
+    words[nwords - 1] = 0;  // the last word may be partially read
+    check(fread(words, sizeof(uint8), nbytes, f) == (size_t)nbytes,
           "Reading pixels");
-    unpackBits(nbytes, bytes, raw_row);
-    img->row[i] = CompressRow(w, raw_row);
+    bytesToWords(w, words);
+    StoreBitsRow(img, i, words);
   }
+  PutScratch(words, stack, nwords);
 
   fclose(f);
+  InternRows(img);
   return img;
 }
 
-/// Save image to PBM file.
+/// Load a raw PBM file.
+/// Only binary PBM files are accepted.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageLoad(const char* filename) {  ///
+  InstrBegin("ImageLoad");
+  Image img = LoadImage(filename);
+  InstrEnd();
+  return img;
+}
+
+/// Get the image holding row i of the image being saved by SavePBM,
+/// and the index of the row in that image
+typedef Image RowSource(void* args, uint32 i, uint32* row);
+
+/// Save an image of width x height pixels to PBM file,
+/// getting each row from source.
 /// On success, returns nonzero.
-/// On failure, returns 0, and
-/// a partial and invalid file may be left in the system.
-int ImageSave(const Image img, const char* filename) {  ///
-  assert(img != NULL);
-  int w = img->width;
-  int h = img->height;
+static int SavePBM(const char* filename, uint32 width, uint32 height,
+                   RowSource* source, void* args) {
+  int w = width;
+  int h = height;
   FILE* f = NULL;
 
   check((f = fopen(filename, "wb")) != NULL, "Open failed");
@@ -480,446 +1920,2133 @@ int ImageSave(const Image img, const char* filename) {  ///
 
   // Write pixels
   int nbytes = (w + 8 - 1) / 8;  // number of bytes for each row
-  // using VLAs...
-  uint8 bytes[nbytes];
-  // unit8 raw_row[nbytes*8];
-  for (uint32 i = 0; i < img->height; i++) {
-    // UncompressRow...
-    uint8* raw_row = UncompressRow(nbytes * 8, img->row[i]);
-    // Fill padding pixels with WHITE
-    memset(raw_row + w, WHITE, nbytes * 8 - w);
-    packBits(nbytes, bytes, raw_row);
-    check(fwrite(bytes, sizeof(uint8), nbytes, f) == (size_t)nbytes,
-          "Writing pixels failed");
-    free(raw_row);
+  // Each row is encoded straight from its runs into bitmap words:
+  // whole words are filled at once, and only the words at run boundaries
+  // are masked (padding pixels stay WHITE).
+  // Encoded rows are collected in a large buffer, written once per chunk.
+  uint32 nwords = NumWords(w);
+  uint64 stack[STACK_WORDS];
+  uint64* words = GetScratch(stack, nwords);
+  size_t chunk_rows = SAVE_CHUNK / nbytes;
+  if (chunk_rows == 0) chunk_rows = 1;
+  if (chunk_rows > height) chunk_rows = height;
+  uint8* chunk = malloc(chunk_rows * nbytes);
+  check(chunk != NULL, "malloc");
+  size_t used = 0;  // bytes in chunk
+  for (uint32 i = 0; i < height; i++) {
+    uint32 j;
+    const Image img = source(args, i, &j);
+    if (img->row[j].kind == ROW_BITS) {
+      memcpy(words, RowWords(img, j), nwords * sizeof(uint64));
+    } else {
+      struct rowreader r;
+      ReaderInit(&r, img, j);
+      RunsToBits(w, &r, words);
+    }
+    wordsToBytes(w, words);
+    memcpy(chunk + used, words, nbytes);
+    used += nbytes;
+    if (used == chunk_rows * nbytes || i == height - 1) {
+      check(fwrite(chunk, sizeof(uint8), used, f) == used,
+            "Writing pixels failed");
+      used = 0;
+    }
   }
 
   // Cleanup
-  fclose(f);
-  return 0;
+  PutScratch(words, stack, nwords);
+  free(chunk);
+  check(fclose(f) == 0, "Writing pixels failed");
+  return 1;
 }
 
-/// Information queries
+/// RowSource for ImageSave: the rows of the image
+static Image ImageRowSource(void* args, uint32 i, uint32* row) {
+  *row = i;
+  return (Image)args;
+}
 
-/// Get image width
-int ImageWidth(const Image img) {
+/// Save image to PBM file.
+/// On success, returns nonzero.
+/// On failure, returns 0, and
+/// a partial and invalid file may be left in the system.
+int ImageSave(const Image img, const char* filename) {  ///
   assert(img != NULL);
-  return img->width;
+  InstrBegin("ImageSave");
+  int ok = SavePBM(filename, img->width, img->height, ImageRowSource, img);
+  InstrEnd();
+  return ok;
 }
 
-/// Get image height
-int ImageHeight(const Image img) {
-  assert(img != NULL);
-  return img->height;
+/// Native RLE format
+
+// Images may also be stored in a native format holding their row table
+// and run data as they are in memory, so that loading decodes nothing:
+// a native file is mapped (see LoadNative) and its run data is used in
+// place, copying nothing.  The rows are only checked to be canonical
+// (see ValidRow), which reads the run data once.
+// The same encoding is used for memory buffers (ImageEncode, ImageDecode).
+//
+// The encoding, in native byte order (checked when decoding), is:
+//   a header (struct nativeheader),
+//   the row index (height x struct nativerow),
+//   the run data: num_elems 16-bit elements, starting 8-byte aligned.
+// Rows stored in the same place (shared rows) are encoded once.
+// Row offsets are in elements from the start of the run data, and bitmap
+// rows start at 8-byte aligned offsets, as in run buffers.
+
+#define NATIVE_MAGIC "BWRLE\0\0"  // 8 bytes, with the final '\0'
+#define NATIVE_VERSION 1
+#define NATIVE_BYTE_ORDER 0x01020304u
+
+struct nativeheader {
+  char magic[8];
+  uint32 byte_order;  // NATIVE_BYTE_ORDER, as written by the encoder
+  uint32 version;
+  uint32 width;
+  uint32 height;
+  uint64 num_elems;   // number of elements of the run data
+};
+
+struct nativerow {
+  uint64 offset;    // index of the first element of the row in run data
+  uint32 size;      // as in struct rowentry
+  uint8 color;
+  uint8 kind;
+  uint16 reserved;  // 0
+};
+
+/// Get the offset of the run data in the encoding of an image
+static inline uint64 NativeDataOffset(uint32 height) {
+  return sizeof(struct nativeheader) +
+         (uint64)height * sizeof(struct nativerow);
+}
+
+/// Lay out the run data of the encoding of img, storing in offset[i]
+/// (if offset is not NULL) where row i goes.
+/// Returns the number of elements of the run data.
+static uint64 LayoutNativeRows(const Image img, uint64* offset) {
+  uint64 num_elems = 0;
+  for (uint32 i = 0; i < img->height; i++) {
+    uint32 j = RepeatedRow(img, i);
+    if (j < i) {  // a shared row, encoded once
+      if (offset != NULL) offset[i] = offset[j];
+      continue;
+    }
+    if (img->row[i].kind == ROW_BITS) num_elems = (num_elems + 3) & ~(uint64)3;
+    if (offset != NULL) offset[i] = num_elems;
+    num_elems += RowBytes(img, i) / sizeof(uint16);
+  }
+  return num_elems;
+}
+
+// Where an encoding is written: a file, or else a memory buffer
+struct nativesink {
+  FILE* f;
+  uint8* out;
+  size_t pos;  // bytes written
+};
+
+static void SinkWrite(struct nativesink* s, const void* data, size_t n) {
+  if (s->f != NULL) {
+    check(fwrite(data, 1, n, s->f) == n, "Writing failed");
+  } else {
+    memcpy(s->out + s->pos, data, n);
+  }
+  s->pos += n;
+}
+
+/// Write the native encoding of img to s
+static void EncodeImage(const Image img, struct nativesink* s) {
+  uint64* offset = malloc(img->height * sizeof(uint64));
+  check(offset != NULL, "malloc");
+
+  struct nativeheader header = {
+      .byte_order = NATIVE_BYTE_ORDER,
+      .version = NATIVE_VERSION,
+      .width = img->width,
+      .height = img->height,
+      .num_elems = LayoutNativeRows(img, offset),
+  };
+  memcpy(header.magic, NATIVE_MAGIC, sizeof(header.magic));
+  SinkWrite(s, &header, sizeof(header));
+
+  for (uint32 i = 0; i < img->height; i++) {
+    struct nativerow row = {offset[i], img->row[i].size, img->row[i].color,
+                            img->row[i].kind, 0};
+    SinkWrite(s, &row, sizeof(row));
+  }
+
+  static const uint16 padding[4];
+  uint64 pos = 0;  // elements of run data written
+  for (uint32 i = 0; i < img->height; i++) {
+    if (offset[i] < pos) continue;  // a shared row, already written
+    size_t nbytes = RowBytes(img, i);
+    SinkWrite(s, padding, (offset[i] - pos) * sizeof(uint16));
+    SinkWrite(s, RowArray(img, i), nbytes);
+    pos = offset[i] + nbytes / sizeof(uint16);
+  }
+  free(offset);
+}
+
+/// Is row i of img in canonical form (see the data structure)?
+/// RLE rows must be runs of at least 1 pixel, adding up to the width,
+/// long runs split only as MAX_RUN, 0, rest, with too few runs for a
+/// bitmap; bitmap rows must have too many runs for RLE, padding bits 0,
+/// and their first pixel color in the header.
+/// Rows from outside (native files and buffers) are checked with this
+/// before use, since readers and kernels rely on rows being canonical.
+static int ValidRow(const Image img, uint32 i) {
+  const struct rowentry* row = &img->row[i];
+  uint32 width = img->width;
+  if (row->kind == ROW_BITS) {
+    const uint64* words = RowWords(img, i);
+    uint32 nwords = NumWords(width);
+    if ((width & 63) != 0 &&
+        (words[nwords - 1] & (~(uint64)0 >> (width & 63))) != 0) {
+      return 0;  // stray padding bits
+    }
+    return row->color == GetBit(words, 0) &&
+           UseBitmap(width, GetNumRunsInBits(width, words));
+  }
+  const uint16* runs = RowArray(img, i);
+  uint32 n = row->size;
+  uint64 x = 0;
+  uint32 num_runs = 0;
+  for (uint32 p = 0; p < n;) {
+    uint32 piece = runs[p++];
+    if (piece == 0) return 0;  // an empty run, or a misplaced escape
+    x += piece;
+    // Escapes only follow full pieces, and the rest is not empty
+    while (piece == MAX_RUN && p < n && runs[p] == 0) {
+      if (p + 1 == n || runs[p + 1] == 0) return 0;
+      piece = runs[p + 1];
+      x += piece;
+      p += 2;
+    }
+    if (x > width) return 0;
+    num_runs++;
+  }
+  return x == width && !UseBitmap(width, num_runs);
+}
+
+/// Build an image from the native encoding in data (size bytes).
+/// The header and row index are checked, and so is every row (see
+/// ValidRow), so that a corrupt or hostile encoding is rejected instead
+/// of making kernels write out of bounds.
+/// If mapped, data is a file mapping, used in place as the run buffer of
+/// the image (and unmapped with it); else the run data is copied.
+static Image DecodeImage(const uint8* data, size_t size, int mapped) {
+  struct nativeheader header;
+  check(size >= sizeof(header), "Invalid file format");
+  memcpy(&header, data, sizeof(header));
+  check(memcmp(header.magic, NATIVE_MAGIC, sizeof(header.magic)) == 0,
+        "Invalid file format");
+  check(header.byte_order == NATIVE_BYTE_ORDER &&
+            header.version == NATIVE_VERSION,
+        "Unsupported file format");
+  check(header.width > 0 && header.height > 0, "Invalid size");
+  uint64 data_offset = NativeDataOffset(header.height);
+  uint64 num_elems = header.num_elems;
+  check(data_offset <= size &&
+            num_elems <= (size - data_offset) / sizeof(uint16),
+        "Truncated data");
+
+  Image img = AllocateImageHeader(header.width, header.height, 0);
+  const uint8* index = data + sizeof(header);
+  for (uint32 i = 0; i < img->height; i++) {
+    struct nativerow row;
+    memcpy(&row, index + (size_t)i * sizeof(row), sizeof(row));
+    uint64 n = row.size;  // number of elements
+    if (row.kind == ROW_BITS) {
+      check(row.size == NumWords(img->width) && row.offset % 4 == 0,
+            "Invalid row index");
+      n *= 4;
+    } else {
+      check(row.kind == ROW_RLE && row.size > 0, "Invalid row index");
+    }
+    check(row.color <= 1 && row.reserved == 0 && row.offset <= num_elems &&
+              n <= num_elems - row.offset,
+          "Invalid row index");
+    img->row[i] = (struct rowentry){row.offset, row.size, row.color,
+                                    row.kind, 0};
+  }
+
+  AddRunBuffers(img, 1);
+  struct runbuf* b;
+  if (mapped) {
+    b = Allocate(sizeof(struct runbuf));
+    b->runs = (uint16*)(data + data_offset);
+    b->capacity = num_elems;
+    atomic_init(&b->refs, 1);
+    b->interned = NULL;
+    b->num_interned = 0;
+    b->map = (void*)data;
+    b->map_size = size;
+  } else {
+    b = NewRunBuffer(num_elems);
+    memcpy(b->runs, data + data_offset, num_elems * sizeof(uint16));
+  }
+  b->num_elems = num_elems;
+  img->buf[0] = b;
+
+  // Shared rows are checked once
+  for (uint32 i = 0; i < img->height; i++) {
+    if (RepeatedRow(img, i) == i) check(ValidRow(img, i), "Invalid run data");
+  }
+  return img;
+}
+
+/// Load a native file, by mapping it (see DecodeImage)
+static Image LoadNative(const char* filename) {
+  int fd = open(filename, O_RDONLY);
+  check(fd >= 0, "Open failed");
+  struct stat st;
+  check(fstat(fd, &st) == 0, "Open failed");
+  check(st.st_size > 0, "Invalid file format");
+  void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  check(map != MAP_FAILED, "mmap");
+  close(fd);
+
+  // Not interned: its rows stay in the mapping (see InternRows)
+  return DecodeImage(map, st.st_size, 1);
+}
+
+/// Save image to a native file.
+/// On success, returns nonzero.
+/// On failure, returns 0, and
+/// a partial and invalid file may be left in the system.
+int ImageSaveNative(const Image img, const char* filename) {  ///
+  assert(img != NULL);
+  InstrBegin("ImageSaveNative");
+  struct nativesink s = {NULL, NULL, 0};
+  check((s.f = fopen(filename, "wb")) != NULL, "Open failed");
+  EncodeImage(img, &s);
+  check(fclose(s.f) == 0, "Writing failed");
+  InstrEnd();
+  return 1;
+}
+
+/// Encode img in the native format into buf, if it has room for it.
+/// Returns the size of the encoding, in bytes: if that is larger than
+/// size, nothing was written.
+size_t ImageEncode(const Image img, void* buf, size_t size) {  ///
+  assert(img != NULL);
+  size_t needed = NativeDataOffset(img->height) +
+                  LayoutNativeRows(img, NULL) * sizeof(uint16);
+  if (needed > size) return needed;
+  assert(buf != NULL);
+  InstrBegin("ImageEncode");
+  struct nativesink s = {NULL, buf, 0};
+  EncodeImage(img, &s);
+  InstrEnd();
+  assert(s.pos == needed);
+  return needed;
+}
+
+/// Decode an image from its native encoding in buf (size bytes).
+/// The buffer is not used after the call.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageDecode(const void* buf, size_t size) {  ///
+  assert(buf != NULL);
+  InstrBegin("ImageDecode");
+  Image img = DecodeImage(buf, size, 0);
+  InternRows(img);
+  InstrEnd();
+  return img;
+}
+
+/// Information queries
+
+/// Get image width
+int ImageWidth(const Image img) {
+  assert(img != NULL);
+  return img->width;
+}
+
+/// Get image height
+int ImageHeight(const Image img) {
+  assert(img != NULL);
+  return img->height;
+}
+
+/// Pixel queries
+
+// Pixel positions of a row being built (see RowRunStarts)
+#define RUN_STARTS_NONE UINT32_MAX
+#define RUN_STARTS_BUSY (UINT32_MAX - 1)
+
+/// Get the index of pixel positions of img, allocating it, with no row
+/// built yet, on first use.
+/// The index is a block of height + 1 size_t and then the entries: each
+/// RLE row i gets one entry per element, from entry run_first[i] on
+/// (rows shared within img share their entries), and run_first[height]
+/// is the number of entries.
+/// Threads that allocate it at once all publish their block with a
+/// compare-and-swap: the first one is kept, and the others freed.
+static size_t* GetRunStarts(const Image img) {
+  size_t* cached = atomic_load(&img->run_first);
+  if (cached != NULL) return cached;
+  size_t* run_first = Allocate((img->height + 1) * sizeof(size_t));
+  size_t num = 0;
+  for (uint32 i = 0; i < img->height; i++) {
+    uint32 j = RepeatedRow(img, i);
+    if (j != i) {
+      run_first[i] = run_first[j];
+    } else {
+      run_first[i] = num;
+      if (img->row[i].kind == ROW_RLE) num += img->row[i].size;
+    }
+  }
+  run_first[img->height] = num;
+  size_t size = (img->height + 1) * sizeof(size_t) + num * sizeof(uint32);
+  run_first = Reallocate(run_first, (img->height + 1) * sizeof(size_t), size);
+  BYTES += size;
+  uint32* start = (uint32*)(run_first + img->height + 1);
+  for (uint32 i = 0; i < img->height; i++) {
+    if (img->row[i].kind == ROW_RLE) start[run_first[i]] = RUN_STARTS_NONE;
+  }
+  if (!atomic_compare_exchange_strong(&img->run_first, &cached, run_first)) {
+    Deallocate(run_first, size);
+    return cached;  // another thread's block
+  }
+  return run_first;
+}
+
+/// Get the positions of the elements of RLE row i of img: element k
+/// starts at pixel start[k].  They are computed on the first query of
+/// the row, and then cached.
+/// (Images are never modified once built, so they stay valid.)
+/// The first entry of a row, always 0 once built, tells its state: a
+/// thread claims the row by swapping RUN_STARTS_NONE for RUN_STARTS_BUSY,
+/// writes the other entries, and then releases it by storing 0; threads
+/// that find it busy wait for that.  (These are GCC atomic builtins, since
+/// the entries are plain uint32.)
+static const uint32* RowRunStarts(const Image img, uint32 i) {
+  assert(img->row[i].kind == ROW_RLE);
+  size_t* run_first = GetRunStarts(img);
+  uint32* start = (uint32*)(run_first + img->height + 1) + run_first[i];
+  uint32 state = __atomic_load_n(&start[0], __ATOMIC_ACQUIRE);
+  if (state == 0) return start;
+  if (state == RUN_STARTS_NONE &&
+      __atomic_compare_exchange_n(&start[0], &state, RUN_STARTS_BUSY, 0,
+                                  __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+    const uint16* runs = RowArray(img, i);
+    uint32 x = runs[0];
+    for (uint32 k = 1; k < img->row[i].size; k++) {
+      start[k] = x;
+      x += runs[k];
+    }
+    PIXMEM += img->row[i].size;
+    __atomic_store_n(&start[0], 0, __ATOMIC_RELEASE);
+    return start;
+  }
+  while (__atomic_load_n(&start[0], __ATOMIC_ACQUIRE) != 0) {
+    // Another thread is building the row
+  }
+  return start;
+}
+
+/// Get the last element k in lo..hi-1 with start[k] <= x, by binary
+/// search.  Requires: start[lo] <= x.
+/// That is the element holding pixel x: the zero-length elements of
+/// escapes start where the next element starts, so they are skipped.
+static inline uint32 FindRun(const uint32* start, uint32 lo, uint32 hi,
+                             uint32 x) {
+  while (hi - lo > 1) {
+    uint32 mid = lo + (hi - lo) / 2;
+    if (start[mid] <= x) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/// Get the color of pixel (x, y) of img.
+/// (Not measured in a scope: entering one takes longer than the query.)
+uint8 ImageGetPixel(const Image img, uint32 x, uint32 y) {  ///
+  assert(img != NULL);
+  assert(x < img->width && y < img->height);
+  const struct rowentry* row = &img->row[y];
+  if (row->kind == ROW_BITS) return GetBit(RowWords(img, y), x);
+  uint32 k = FindRun(RowRunStarts(img, y), 0, row->size, x);
+  return row->color ^ (k & 1);
+}
+
+/// Get the colors of n pixels of img.
+/// A query further along the row of the previous one gallops from the
+/// element found by that one: it takes O(log d) steps, where d is the
+/// number of elements between the two, so a sweep of a row costs
+/// O(queries + runs).
+void ImageGetPixels(const Image img, const ImagePoint points[], uint32 n,
+                    uint8 colors[]) {  ///
+  assert(img != NULL);
+  assert(n == 0 || (points != NULL && colors != NULL));
+  InstrBegin("ImageGetPixels");
+  uint32 y = UINT32_MAX;  // the RLE row of the previous query
+  uint32 x = 0;           // its pixel
+  uint32 k = 0;           // and the element holding it
+  for (uint32 p = 0; p < n; p++) {
+    assert(points[p].x < img->width && points[p].y < img->height);
+    const struct rowentry* row = &img->row[points[p].y];
+    if (row->kind == ROW_BITS) {
+      colors[p] = GetBit(RowWords(img, points[p].y), points[p].x);
+      continue;
+    }
+    const uint32* start = RowRunStarts(img, points[p].y);
+    uint32 lo = 0;
+    uint32 hi = row->size;
+    if (points[p].y == y && points[p].x >= x) {
+      // Gallop: double the step until an element starts after the pixel
+      lo = k;
+      uint32 step = 1;
+      while (lo + step < row->size && start[lo + step] <= points[p].x) {
+        lo += step;
+        step *= 2;
+      }
+      if (lo + step < hi) hi = lo + step;
+    }
+    k = FindRun(start, lo, hi, points[p].x);
+    y = points[p].y;
+    x = points[p].x;
+    colors[p] = row->color ^ (k & 1);
+  }
+  InstrEnd();
+}
+
+/// Image comparison
+
+/// Get a hash of the contents of img.
+/// Equal images have equal hashes.
+/// The hash is computed on first use, in O(runs), and then cached.
+uint64 ImageHash(const Image img) {  ///
+  assert(img != NULL);
+  return GetRowHashes(img)[img->height];
+}
+
+/// Compare two images.
+/// Rows are canonical, so two rows are equal iff their headers and
+/// element arrays are equal.  The cached hashes let most unequal images
+/// be told apart in O(1), and equal images are compared in O(runs).
+static int CompareImages(const Image img1, const Image img2) {
+  // Verifica se as dimensões são diferentes
+  if (img1->width != img2->width || img1->height != img2->height) {
+    return 0; // Imagens não são iguais
+  }
+  if (img1 == img2) return 1;
+
+  const uint64* hash1 = GetRowHashes(img1);
+  const uint64* hash2 = GetRowHashes(img2);
+  if (hash1[img1->height] != hash2[img2->height]) return 0;
+
+  // Percorre os arrays RLE das duas imagens
+  // (as linhas estão em forma canónica: mesmo conteúdo, mesmo array)
+  for (uint32 y = 0; y < img1->height; y++) {
+    const struct rowentry* row1 = &img1->row[y];
+    const struct rowentry* row2 = &img2->row[y];
+    if (hash1[y] != hash2[y] || row1->kind != row2->kind ||
+        row1->color != row2->color || row1->size != row2->size) {
+      return 0; // Contentor, cor inicial ou número de runs diferente
+    }
+    const uint16* runs1 = RowArray(img1, y);
+    const uint16* runs2 = RowArray(img2, y);
+    if (runs1 == runs2) continue;  // a row shared by both images
+    if (memcmp(runs1, runs2, RowBytes(img1, y)) != 0) {
+      return 0; // Pixels diferentes encontrados
+    }
+    PIXMEM += (RowBytes(img1, y) + 7) / 8;
+  }
+
+  // Se passar por todas as linhas sem diferenças, as imagens são iguais
+  return 1;
+}
+
+/// Compare two images: nonzero iff they have the same size and pixels
+int ImageIsEqual(const Image img1, const Image img2) {  ///
+  assert(img1 != NULL && img2 != NULL);
+  InstrBegin("ImageIsEqual");
+  int equal = CompareImages(img1, img2);
+  InstrEnd();
+  return equal;
+}
+
+int ImageIsDifferent(const Image img1, const Image img2)
+{
+    assert(img1 != NULL && img2 != NULL);
+    return !ImageIsEqual(img1, img2);
+}
+
+/// Boolean Operations on image pixels
+
+/// These functions apply boolean operations to images,
+/// returning a new image as a result.
+///
+/// Operand images are left untouched and must be of the same size.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+
+Image ImageNEG(const Image img) {
+  assert(img != NULL);
+  InstrBegin("ImageNEG");
+
+  uint32 width = img->width;
+  uint32 height = img->height;
+
+  Image newImage = AllocateImageHeader(width, height, 0);
+
+  // Sharing the rows of img
+  // And changing the first pixel color in each row header
+
+  ShareRows(newImage, 0, img, 0, height);
+  size_t bits_elems = 0;  // elements needed for the inverted bitmap rows
+  for (uint32 i = 0; i < height; i++) {
+    newImage->row[i].color ^= 1;  // Just negate the value of the first pixel run
+    if (newImage->row[i].kind == ROW_BITS && RepeatedRow(img, i) == i) {
+      bits_elems += 4 * (size_t)newImage->row[i].size + 3;
+    }
+  }
+
+  // Bitmaps must be inverted, into a new run buffer
+  // (a row repeating one of the previous two is inverted only once)
+  if (bits_elems > 0) {
+    uint32 nwords = NumWords(width);
+    uint32 last = AddRunBuffers(newImage, 1);
+    newImage->buf[last] = NewRunBuffer(bits_elems);
+    for (uint32 i = 0; i < height; i++) {
+      if (img->row[i].kind != ROW_BITS) continue;
+      uint32 j = RepeatedRow(img, i);
+      if (j != i) {
+        newImage->row[i] = newImage->row[j];
+      } else {
+        uint64* words = BeginBitsRow(newImage, nwords);
+        memcpy(words, RowWords(img, i), nwords * sizeof(uint64));
+        InvertBits(width, words);
+        EndBitsRow(newImage, i, nwords);
+      }
+    }
+  }
+
+  InternRows(newImage);
+  InstrEnd();
+  return newImage;
+}
+
+
+Image ImageAND(const Image img1, const Image img2) {
+  assert(img1 != NULL && img2 != NULL);
+  assert(img1->width == img2->width && img1->height == img2->height);
+  InstrBegin("ImageAND");
+
+  Image newImage = MergeImages(img1, img2, OP_AND);
+  InstrEnd();
+  return newImage;
+}
+
+Image ImageOR(const Image img1, const Image img2) {
+  assert(img1 != NULL && img2 != NULL);
+  assert(img1->width == img2->width && img1->height == img2->height);
+  InstrBegin("ImageOR");
+
+  Image newImage = MergeImages(img1, img2, OP_OR);
+  InstrEnd();
+  return newImage;
+}
+
+Image ImageXOR(Image img1, Image img2) {
+  assert(img1 != NULL && img2 != NULL);
+  assert(img1->width == img2->width && img1->height == img2->height);
+  InstrBegin("ImageXOR");
+
+  Image newImage = MergeImages(img1, img2, OP_XOR);
+  InstrEnd();
+  return newImage;
+}
+
+// Operands of ReduceImages.
+// A pixel of the result is BLACK iff it is BLACK in at least k images
+// (AND is k = n, OR is k = 1), or in an odd number of them, for parity.
+struct reduceargs {
+  const Image* imgs;
+  uint32 n;
+  uint32 k;
+  int parity;
+};
+
+/// Restore the heap property of heap[0..size-1] from position p down,
+/// where heap holds image indices ordered by the end of their current run
+static inline void SiftDown(uint32* heap, uint32 size, const uint32* end,
+                            uint32 p) {
+  uint32 j = heap[p];
+  for (;;) {
+    uint32 c = 2 * p + 1;
+    if (c >= size) break;
+    if (c + 1 < size && end[heap[c + 1]] < end[heap[c]]) c++;
+    if (end[heap[c]] >= end[j]) break;
+    heap[p] = heap[c];
+    p = c;
+  }
+  heap[p] = j;
+}
+
+/// RowBuilder for ReduceImages.
+/// Sweeps the row from left to right over the run boundaries of the n
+/// rows, kept in a heap ordered by the end of the current run of each row,
+/// and counting how many rows are BLACK between boundaries.
+/// The cost is O(total runs * log n).
+/// The state of the n rows lives in scratch (see ReduceScratchSize).
+static void BuildReducedRow(Image img, uint32 i, const void* args,
+                            void* scratch) {
+  const struct reduceargs* a = args;
+  uint32 n = a->n;
+  uint32 width = img->width;
+
+  struct rowreader* reader = scratch;
+  uint32* end = (uint32*)(reader + n);  // end of the current run of each row
+  uint32* heap = end + n;
+  uint8* value = (uint8*)(heap + n);    // color of the current run of each row
+  uint32 count = 0;  // number of rows with a BLACK current run
+  uint64 max_runs = 0;
+  for (uint32 j = 0; j < n; j++) {
+    const Image src = a->imgs[j];
+    max_runs += (src->row[i].kind == ROW_BITS) ? width : src->row[i].size;
+    ReaderInit(&reader[j], src, i);
+    end[j] = NextRun(&reader[j], &value[j]);
+    count += value[j];
+    heap[j] = j;
+  }
+  for (uint32 p = n / 2; p-- > 0;) SiftDown(heap, n, end, p);
+
+  if (max_runs > width) max_runs = width;
+  struct rowwriter w;
+  WriterInit(&w, BeginRow(img, MaxRowSize(width, (uint32)max_runs)));
+  uint32 x = 0;
+  while (x < width) {
+    uint32 next = end[heap[0]];
+    uint8 black = a->parity ? (count & 1) : (count >= a->k);
+    PutRun(&w, black ? BLACK : WHITE, next - x);
+    // Advance all rows whose run ends at next
+    while (end[heap[0]] == next && next < width) {
+      uint32 j = heap[0];
+      count -= value[j];
+      end[j] += NextRun(&reader[j], &value[j]);
+      count += value[j];
+      SiftDown(heap, n, end, 0);
+      PIXMEM += 1;
+    }
+    x = next;
+  }
+  EndRowWriter(img, i, &w);
+}
+
+/// Bytes of scratch space for BuildReducedRow on n rows
+static size_t ReduceScratchSize(uint32 n) {
+  return n * (sizeof(struct rowreader) + 2 * sizeof(uint32) + sizeof(uint8));
+}
+
+/// RowWeight for ReduceImages
+static uint32 ReducedRowWeight(const void* args, uint32 i) {
+  const struct reduceargs* a = args;
+  uint32 weight = 0;
+  for (uint32 j = 0; j < a->n; j++) weight += a->imgs[j]->row[i].size;
+  return weight;
+}
+
+/// RowRepeat for ReduceImages
+static uint32 ReducedRowRepeat(const void* args, uint32 i) {
+  const struct reduceargs* a = args;
+  uint32 j = RepeatedRow(a->imgs[0], i);
+  for (uint32 k = 1; k < a->n && j != i; k++) {
+    if (RepeatedRow(a->imgs[k], i) != j) return i;
+  }
+  return j;
+}
+
+/// Combine n images of the same size, row by row (see reduceargs)
+static Image ReduceImages(const struct reduceargs* args) {
+  assert(args->n > 0);
+  const Image img1 = args->imgs[0];
+  size_t capacity = 0;
+  for (uint32 j = 0; j < args->n; j++) {
+    const Image img = args->imgs[j];
+    assert(img != NULL);
+    assert(img->width == img1->width && img->height == img1->height);
+    size_t num_elems = GetNumElems(img);
+    if (num_elems > capacity) capacity = num_elems;
+  }
+  Image newImage = AllocateImageHeader(img1->width, img1->height, capacity);
+  BuildRows(newImage, BuildReducedRow, args, ReducedRowWeight,
+            ReducedRowRepeat, ReduceScratchSize(args->n));
+  InternRows(newImage);
+  return newImage;
+}
+
+Image ImageReduce(int op, const Image imgs[], uint32 n) {  ///
+  assert(op == REDUCE_AND || op == REDUCE_OR || op == REDUCE_XOR);
+  InstrBegin("ImageReduce");
+  struct reduceargs args = {imgs, n, (op == REDUCE_AND) ? n : 1,
+                            op == REDUCE_XOR};
+  Image newImage = ReduceImages(&args);
+  InstrEnd();
+  return newImage;
+}
+
+Image ImageAtLeast(const Image imgs[], uint32 n, uint32 k) {  ///
+  InstrBegin("ImageAtLeast");
+  struct reduceargs args = {imgs, n, k, 0};
+  Image newImage = ReduceImages(&args);
+  InstrEnd();
+  return newImage;
+}
+
+/// Geometric transformations
+
+/// These functions apply geometric transformations to an image,
+/// returning a new image as a result.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+
+/// Mirror an image = flip top-bottom.
+/// Returns a mirrored version of the image.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageHorizontalMirror(const Image img) {
+  assert(img != NULL);
+  InstrBegin("ImageHorizontalMirror");
+
+  uint32 width = img->width;
+  uint32 height = img->height;
+
+  Image newImage = AllocateImageHeader(width, height, 0);
+
+  // partilha os buffers de runs da imagem original
+  uint32 index[img->num_bufs];
+  ShareRunBuffers(newImage, img, index);
+
+// a linha i aponta para a row do fundo da imagem original
+  for (uint32 i = 0; i < height; i++) {
+    uint32 src_row = height - 1 - i; // indice da linha original considerando o espelhamento
+    newImage->row[i] = img->row[src_row];
+    newImage->row[i].buf = (uint16)index[img->row[src_row].buf];
+  }
+
+  InternRows(newImage);
+  InstrEnd();
+  return newImage;
+}
+
+/// RowBuilder for ImageVerticalMirror.
+/// The mirror of a RLE row is its run list in reverse order, so the row
+/// is built from its run elements, last to first, in O(runs).
+/// The run count does not change, so neither does the container:
+/// bitmap rows are mirrored a word at a time.
+static void BuildMirroredRow(Image newImage, uint32 i, const void* args,
+                             void* scratch) {
+  (void)scratch;
+  const Image img = (const Image)args;
+  uint32 width = img->width;
+
+  if (img->row[i].kind == ROW_BITS) {
+    uint32 nwords = NumWords(width);
+    ReverseBitsRow(width, RowWords(img, i), BeginBitsRow(newImage, nwords));
+    PIXMEM += nwords;
+    EndBitsRow(newImage, i, nwords);
+    return;
+  }
+
+  // Element j has color (color ^ (j & 1)); escapes are empty runs,
+  // which PutRun skips, so long runs are merged and split again
+  const uint16* runs = RowArray(img, i);
+  uint32 n = img->row[i].size;
+  uint8 color = img->row[i].color;
+  struct rowwriter w;
+  WriterInit(&w, BeginRow(newImage, n));
+  for (uint32 j = n; j-- > 0;) {
+    PutRun(&w, color ^ (uint8)(j & 1), runs[j]);
+    PIXMEM += 1;
+  }
+  EndRowWriter(newImage, i, &w);
+}
+
+/// Mirror an image = flip left-right.
+/// Returns a mirrored version of the image.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageVerticalMirror(const Image img) {
+  assert(img != NULL);
+  InstrBegin("ImageVerticalMirror");
+
+  uint32 width = img->width;
+  uint32 height = img->height;
+
+  Image newImage = AllocateImageHeader(width, height, GetNumElems(img));
+  BuildRows(newImage, BuildMirroredRow, img, SourceRowWeight,
+            SourceRowRepeat, 0);
+
+  InternRows(newImage);
+  InstrEnd();
+  return newImage;
+}
+
+/// Replicate img2 at the bottom of imag1, creating a larger image
+/// Requires: the width of the two images must be the same.
+/// Returns the new larger image.
+/// Ensures: The original images are not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageReplicateAtBottom(const Image img1, const Image img2) {
+  assert(img1 != NULL && img2 != NULL);
+  //assert das dimensões
+  assert(img1->width == img2->width);
+  InstrBegin("ImageReplicateAtBottom");
+
+  uint32 new_width = img1->width;
+  uint32 new_height = img1->height + img2->height; //new_height é a soma das height originais de cada imagem
+
+  Image newImage = AllocateImageHeader(new_width, new_height, 0);
+// partilhar as rows da imagem 1, seguidas das rows da imagem 2
+  ShareRows(newImage, 0, img1, 0, img1->height);
+  ShareRows(newImage, img1->height, img2, 0, img2->height);
+
+  InternRows(newImage);
+  InstrEnd();
+  return newImage;
+}
+
+/// RowBuilder for ImageReplicateAtRight
+/// Append the runs of RLE row i of img to the row written by w.
+/// Escapes are empty runs, which PutRun skips, and a run of the same
+/// color as the last one written is merged with it.
+static void PutRowRuns(struct rowwriter* w, const Image img, uint32 i) {
+  const uint16* runs = RowArray(img, i);
+  uint32 n = img->row[i].size;
+  uint8 color = img->row[i].color;
+  for (uint32 j = 0; j < n; j++) {
+    PutRun(w, color ^ (uint8)(j & 1), runs[j]);
+  }
+  PIXMEM += n;
+}
+
+/// Paste row i of img at pixel x0 of the bitmap row out, with nwords words
+static void PutRowBits(uint64* out, uint32 nwords, uint32 x0, const Image img,
+                       uint32 i) {
+  if (img->row[i].kind == ROW_BITS) {
+    OrBitsAt(out, nwords, x0, RowWords(img, i), img->width);
+    PIXMEM += img->row[i].size;
+    return;
+  }
+  struct rowreader r;
+  ReaderInit(&r, img, i);
+  uint8 value;
+  uint32 length;
+  uint32 x = x0;
+  while ((length = NextRun(&r, &value)) > 0) {
+    if (value == BLACK) ApplyRange(out, x, x + length, RANGE_SET);
+    x += length;
+    PIXMEM += 1;
+  }
+}
+
+/// RowBuilder for ImageReplicateAtRight.
+/// Two RLE rows are joined by concatenating their run lists: the last run
+/// of row1 and the first run of row2 are merged if they have the same
+/// color.  If either row is a bitmap, the result is built as a bitmap
+/// (and turned back into RLE if it has few runs).
+static void BuildJoinedRow(Image newImage, uint32 i, const void* args,
+                           void* scratch) {
+  (void)scratch;
+  const struct mergeargs* a = args;
+  Image img1 = a->img1;
+  Image img2 = a->img2;
+  uint32 new_width = newImage->width;
+
+  if (img1->row[i].kind == ROW_RLE && img2->row[i].kind == ROW_RLE) {
+    // Merging runs at the seam may add escapes (see MaxRowSize)
+    uint32 n = img1->row[i].size + img2->row[i].size;
+    struct rowwriter w;
+    WriterInit(&w, BeginRow(newImage, MaxRowSize(new_width, n)));
+    PutRowRuns(&w, img1, i);
+    PutRowRuns(&w, img2, i);
+    EndRowWriter(newImage, i, &w);
+    return;
+  }
+
+  uint32 nwords = NumWords(new_width);
+  uint64* out = BeginBitsRow(newImage, nwords);
+  memset(out, 0, nwords * sizeof(uint64));
+  PutRowBits(out, nwords, 0, img1, i);
+  PutRowBits(out, nwords, img1->width, img2, i);
+  EndWordsRow(newImage, i);
+}
+
+/// Replicate img2 to the right of imag1, creating a larger image
+/// Requires: the height of the two images must be the same.
+/// Returns the new larger image.
+/// Ensures: The original images are not modified.
+///                
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageReplicateAtRight(const Image img1, const Image img2) {
+  assert(img1 != NULL && img2 != NULL);
+  assert(img1->height == img2->height);
+  InstrBegin("ImageReplicateAtRight");
+
+  uint32 new_width = img1->width + img2->width;
+  uint32 new_height = img1->height;
+
+  Image newImage = AllocateImageHeader(new_width, new_height,
+                                       GetNumElems(img1) + GetNumElems(img2));
+
+  struct mergeargs args = {img1, img2, OP_OR};  // op is not used
+  BuildRows(newImage, BuildJoinedRow, &args, MergedRowWeight,
+            MergedRowRepeat, 0);
+
+  InternRows(newImage);
+  InstrEnd();
+  return newImage;
 }
 
-/// Image comparison
+/// Morphology
+
+// Dilation and erosion by a w x h rectangle are separable: a horizontal
+// pass with a w x 1 element, then a vertical pass with a 1 x h element.
+// Horizontally, dilation grows every BLACK run by the extents of the
+// element on each side, and merges the runs that meet, in O(runs) time
+// whatever w is (see BuildGrownRow).  Bitmap rows, which have many short
+// runs, are grown a word at a time instead (see SpreadBits).
+// Vertically, row y of the result is the OR of a window of h rows around
+// row y.  Windows are combined with the van Herk / Gil-Werman algorithm:
+// rows are split in blocks of h rows, and the prefix and suffix ORs of
+// each block are accumulated, one row operation each.  A window spans at
+// most two blocks, so it is the OR of a suffix row and a prefix row:
+// about 3 row operations per row, whatever h is (see CombineWindows).
+// Erosion is the dual: WHITE runs are grown, and windows are ANDed.
+// Rows outside the image are left out of the windows, so they count as
+// WHITE for dilation and BLACK for erosion.
+
+/// Copy row j of src as row i of img (src may be img itself)
+static void CopyRow(Image img, uint32 i, const Image src, uint32 j) {
+  uint32 n = src->row[j].size;
+  if (src->row[j].kind == ROW_BITS) {
+    uint64* out = BeginBitsRow(img, n);
+    memcpy(out, RowWords(src, j), n * sizeof(uint64));
+    EndBitsRow(img, i, n);
+  } else {
+    uint16* out = BeginRow(img, n);
+    memcpy(out, RowArray(src, j), n * sizeof(uint16));
+    EndRow(img, i, src->row[j].color, n);
+  }
+  PIXMEM += n;
+}
 
-int ImageIsEqual(const Image img1, const Image img2) {
-  assert(img1 != NULL && img2 != NULL);
+// Operands of BuildGrownRow
+struct growargs {
+  Image img;
+  uint8 color;   // the color of the runs grown
+  uint32 left;   // pixels added before each run
+  uint32 right;  // pixels added after each run
+};
 
-  // Verifica se as dimensões são diferentes
-    if (img1->width != img2->width || img1->height != img2->height) {
-        return 0; // Imagens não são iguais
+/// OR into each pixel of a bitmap row the before pixels before it and
+/// the after pixels after it (those inside the row).
+/// Each pass ORs the row with a copy of itself shifted by the distance
+/// covered so far, doubling it: about log2(before) + log2(after) passes.
+static void SpreadBits(uint32 width, uint64* words, uint32 before,
+                       uint32 after) {
+  uint32 nwords = NumWords(width);
+  if (before > width) before = width;
+  if (after > width) after = width;
+  // Pixels p..p+span-1 are ORed into p; shift the row left
+  for (uint32 span = 1; span <= after;) {
+    uint32 d = (span <= after + 1 - span) ? span : after + 1 - span;
+    uint32 dw = d / 64;
+    uint32 db = d % 64;
+    for (uint32 k = 0; k + dw < nwords; k++) {
+      uint64 next = (k + dw + 1 < nwords) ? words[k + dw + 1] : 0;
+      words[k] |= (db == 0) ? words[k + dw]
+                            : (words[k + dw] << db) | (next >> (64 - db));
     }
-
-    // Percorre cada pixel das duas imagens
-    for (int y = 0; y < img1->height; y++) {
-        for (int x = 0; x < img1->width; x++) {
-            if (img1->row[y][x] != img2->row[y][x]) {
-                return 0; // Pixels diferentes encontrados
-            }
-        }
+    span += d;
+  }
+  // Pixels p-span+1..p are ORed into p; shift the row right
+  for (uint32 span = 1; span <= before;) {
+    uint32 d = (span <= before + 1 - span) ? span : before + 1 - span;
+    uint32 dw = d / 64;
+    uint32 db = d % 64;
+    for (uint32 k = nwords; k-- > dw;) {
+      uint64 prev = (k > dw) ? words[k - dw - 1] : 0;
+      words[k] |= (db == 0) ? words[k - dw]
+                            : (words[k - dw] >> db) | (prev << (64 - db));
     }
+    span += d;
+  }
+  if ((width & 63) != 0) {
+    words[nwords - 1] &= ~(uint64)0 << (64 - (width & 63));
+  }
+}
 
-    // Se passar por todos os pixels sem diferenças, as imagens são iguais
-    return 1;
+/// RowBuilder for the horizontal pass: the runs of a color are grown,
+/// clipped to the row, and merged with the grown runs they meet
+static void BuildGrownRow(Image img, uint32 i, const void* args,
+                          void* scratch) {
+  (void)scratch;
+  const struct growargs* a = args;
+  const Image src = a->img;
+  uint32 width = src->width;
+  uint8 other = a->color ^ 1;
+  if (src->row[i].kind == ROW_BITS) {
+    // Grow the BLACK pixels of the bitmap (or of its inverse)
+    uint32 nwords = NumWords(width);
+    uint64* out = BeginBitsRow(img, nwords);
+    memcpy(out, RowWords(src, i), nwords * sizeof(uint64));
+    if (a->color == WHITE) InvertBits(width, out);
+    SpreadBits(width, out, a->right, a->left);
+    if (a->color == WHITE) InvertBits(width, out);
+    PIXMEM += nwords;
+    EndWordsRow(img, i);
+    return;
+  }
+  // Growing runs can only merge them
+  struct rowwriter w;
+  WriterInit(&w, BeginRow(img, MaxRowSize(width, GetNumRunsInRLERow(src, i))));
+
+  struct rowreader r;
+  ReaderInit(&r, src, i);
+  uint8 value;
+  uint32 length;
+  uint32 x = 0;      // the first pixel of the next run read
+  uint32 done = 0;   // the pixels written
+  uint32 start = 0;  // the grown run not written yet: start..stop-1,
+  uint32 stop = 0;   // or none if stop == 0
+  while ((length = NextRun(&r, &value)) > 0) {
+    if (value == a->color) {
+      uint32 first = (x > a->left) ? x - a->left : 0;
+      uint32 end = x + length;
+      end = (width - end > a->right) ? end + a->right : width;
+      if (first > stop || stop == 0) {
+        // Does not meet the previous grown run: write that one
+        PutRun(&w, other, start - done);
+        PutRun(&w, a->color, stop - start);
+        done = stop;
+        start = first;
+      }
+      stop = end;
+    }
+    x += length;
+    PIXMEM += 1;
+  }
+  PutRun(&w, other, start - done);
+  PutRun(&w, a->color, stop - start);
+  done = stop;
+  PutRun(&w, other, width - done);
+  EndRowWriter(img, i, &w);
 }
 
+/// RowWeight for BuildGrownRow
+static uint32 GrownRowWeight(const void* args, uint32 i) {
+  return ((const struct growargs*)args)->img->row[i].size;
+}
 
-int ImageIsDifferent(const Image img1, const Image img2)
-{
-    assert(img1 != NULL && img2 != NULL);
-    return !ImageIsEqual(img1, img2);
+/// RowRepeat for BuildGrownRow
+static uint32 GrownRowRepeat(const void* args, uint32 i) {
+  return RepeatedRow(((const struct growargs*)args)->img, i);
 }
 
-/// Boolean Operations on image pixels
+// Operands of BuildWindowRow
+struct windowargs {
+  Image prefix;   // prefix[y]: op of rows of the block of y, up to y
+  Image suffix;   // suffix[y]: op of rows of the block of y, from y on
+  uint32 above;   // rows of the window above its row
+  uint32 below;   // rows of the window below its row
+  uint32 size;    // rows of a block (those of a whole window)
+  enum BoolOp op;
+};
 
-/// These functions apply boolean operations to images,
-/// returning a new image as a result.
-///
-/// Operand images are left untouched and must be of the same size.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
+/// RowBuilder for CombineWindows: row i is the op of a window of rows
+static void BuildWindowRow(Image img, uint32 i, const void* args,
+                           void* scratch) {
+  (void)scratch;
+  const struct windowargs* a = args;
+  uint32 height = img->height;
+  uint32 lo = (i > a->above) ? i - a->above : 0;
+  uint32 hi = (height - 1 - i > a->below) ? i + a->below : height - 1;
+  if (lo % a->size == 0) {
+    CopyRow(img, i, a->prefix, hi);  // lo..hi is a block prefix
+  } else if (lo / a->size == hi / a->size) {
+    CopyRow(img, i, a->suffix, lo);  // a suffix of the last block
+  } else {
+    MergeRows(img, i, a->suffix, lo, a->prefix, hi, a->op);
+  }
+}
 
-Image ImageNEG(const Image img) {
-  assert(img != NULL);
+/// RowWeight for BuildWindowRow
+static uint32 WindowRowWeight(const void* args, uint32 i) {
+  const struct windowargs* a = args;
+  return a->prefix->row[i].size + a->suffix->row[i].size;
+}
 
+/// Combine the rows of img with op (OP_OR or OP_AND) over windows:
+/// row y of the result is the op of rows y-above..y+below of img
+/// (those inside img).
+static Image CombineWindows(const Image img, uint32 above, uint32 below,
+                            enum BoolOp op) {
   uint32 width = img->width;
   uint32 height = img->height;
-
-  Image newImage = AllocateImageHeader(width, height);
-
-  // Directly copying the rows, one by one
-  // And changing the value of row[i][0]
-
-  for (uint32 i = 0; i < height; i++) {
-    uint32 num_elems = GetSizeRLERowArray(img->row[i]);
-    newImage->row[i] = AllocateRLERowArray(num_elems);
-    memcpy(newImage->row[i], img->row[i], num_elems * sizeof(int));
-    newImage->row[i][0] ^= 1;  // Just negate the value of the first pixel run
+  uint32 size = (above + below < height) ? above + below + 1 : height;
+  size_t capacity = GetNumElems(img);
+
+  // The prefixes and suffixes of the blocks, each built from the
+  // previous row of the block (so they are built serially)
+  Image prefix = AllocateImageHeader(width, height, capacity);
+  Image suffix = AllocateImageHeader(width, height, capacity);
+  for (uint32 y = 0; y < height; y++) {
+    if (y % size == 0) {
+      CopyRow(prefix, y, img, y);
+    } else {
+      MergeRows(prefix, y, prefix, y - 1, img, y, op);
+    }
+  }
+  for (uint32 y = height; y-- > 0;) {
+    if (y % size == size - 1 || y == height - 1) {
+      CopyRow(suffix, y, img, y);
+    } else {
+      MergeRows(suffix, y, suffix, y + 1, img, y, op);
+    }
   }
 
+  Image newImage = AllocateImageHeader(width, height, capacity);
+  struct windowargs args = {prefix, suffix, above, below, size, op};
+  BuildRows(newImage, BuildWindowRow, &args, WindowRowWeight, NULL, 0);
+  ImageDestroy(&prefix);
+  ImageDestroy(&suffix);
   return newImage;
 }
 
+/// Dilate (color BLACK) or erode (color WHITE) img with a w x h element
+static Image Morphology(const Image img, uint32 w, uint32 h, uint8 color) {
+  assert(w > 0 && h > 0);
+  // Dilation makes BLACK the pixels x with a BLACK pixel in
+  // x-(w-1-w/2)..x+w/2, erosion makes WHITE those with a WHITE pixel in
+  // x-w/2..x+(w-1-w/2), and likewise for rows
+  uint32 left = (color == BLACK) ? w / 2 : w - 1 - w / 2;
+  uint32 above = (color == BLACK) ? h - 1 - h / 2 : h / 2;
+  enum BoolOp op = (color == BLACK) ? OP_OR : OP_AND;
+
+  Image grown = NULL;
+  if (w > 1) {
+    grown = AllocateImageHeader(img->width, img->height, GetNumElems(img));
+    struct growargs args = {img, color, left, w - 1 - left};
+    BuildRows(grown, BuildGrownRow, &args, GrownRowWeight, GrownRowRepeat,
+              0);
+  }
+  const Image rows = (grown != NULL) ? grown : img;
+  if (h == 1 && grown != NULL) return grown;
+
+  Image newImage;
+  if (h > 1) {
+    newImage = CombineWindows(rows, above, h - 1 - above, op);
+  } else {
+    // A 1 x 1 element: a copy of img, sharing its rows
+    newImage = AllocateImageHeader(img->width, img->height, 0);
+    ShareRows(newImage, 0, img, 0, img->height);
+  }
+  ImageDestroy(&grown);
+  return newImage;
+}
 
-Image ImageAND(const Image img1, const Image img2) {
-  assert(img1 != NULL && img2 != NULL);
-
-  // COMPLETE THE CODE
-  // You might consider using the UncompressRow and CompressRow auxiliary files
-  // Or devise a more efficient alternative
-
-  //contador de operações para testar complexidade
-  int counter = 0;
-
-  //reset e configuração dos counters
-  InstrReset();
-  InstrName[0] = "oper";
-
-  //Garantir que as dimensões sejam iguais
-  assert(img1->width == img2->width && img1->height == img2->height);
-
-  // Criar um cabeçalho novo para a imagem resultante
-  Image result = AllocateImageHeader(img1->width, img1->height);
+/// Dilate img with a w x h rectangle
+Image ImageDilate(const Image img, uint32 w, uint32 h) {  ///
+  assert(img != NULL);
+  assert(w > 0 && h > 0);
+  InstrBegin("ImageDilate");
+  Image newImage = Morphology(img, w, h, BLACK);
+  InternRows(newImage);
+  InstrEnd();
+  return newImage;
+}
 
-  // Processar cada linha das imagens
-  for (uint32 y = 0; y < img1->height; y++) {
+/// Erode img with a w x h rectangle
+Image ImageErode(const Image img, uint32 w, uint32 h) {  ///
+  assert(img != NULL);
+  assert(w > 0 && h > 0);
+  InstrBegin("ImageErode");
+  Image newImage = Morphology(img, w, h, WHITE);
+  InternRows(newImage);
+  InstrEnd();
+  return newImage;
+}
 
-    const int* rle_row1 = img1->row[y];
-    const int* rle_row2 = img2->row[y];
+/// Open img with a w x h rectangle: erode, then dilate
+Image ImageOpen(const Image img, uint32 w, uint32 h) {  ///
+  assert(img != NULL);
+  assert(w > 0 && h > 0);
+  InstrBegin("ImageOpen");
+  Image eroded = Morphology(img, w, h, WHITE);
+  Image newImage = Morphology(eroded, w, h, BLACK);
+  ImageDestroy(&eroded);
+  InternRows(newImage);
+  InstrEnd();
+  return newImage;
+}
 
-    // Criar uma linha RAW para armazenar os resultados da operação AND
-    uint8* raw_row1 = UncompressRow(img1->width, rle_row1);
-    uint8* raw_row2 = UncompressRow(img2->width, rle_row2);
-    uint8* raw_result = malloc(img1->width * sizeof(uint8));
-    check(raw_result != NULL, "malloc");
+/// Close img with a w x h rectangle: dilate, then erode
+Image ImageClose(const Image img, uint32 w, uint32 h) {  ///
+  assert(img != NULL);
+  assert(w > 0 && h > 0);
+  InstrBegin("ImageClose");
+  Image dilated = Morphology(img, w, h, BLACK);
+  Image newImage = Morphology(dilated, w, h, WHITE);
+  ImageDestroy(&dilated);
+  InternRows(newImage);
+  InstrEnd();
+  return newImage;
+}
 
-    // Realizar a operação AND entre as linhas raw
-    for (uint32 x = 0; x < img1->width; x++) {
-        raw_result[x] = raw_row1[x] & raw_row2[x];
-        InstrCount[0]++; //incrementa o contador a cada operação
-    }
+/// Connected components
 
-    // Comprimir a linha de resultado para o formato de compressão rle
-    result->row[y] = CompressRow(img1->width, raw_result);
+// Components are found in the run domain: a component is a set of BLACK
+// runs, and two runs of adjacent rows are in the same component if they
+// touch, that is, if they overlap (4-connectivity) or at least meet at a
+// corner (8-connectivity).  The runs of two adjacent rows are matched
+// in a single merge-like pass, and joined with union-find, so the cost
+// is nearly linear in the number of runs.
 
-    // free às linhas RAW temporárias
-    free(raw_row1);
-    free(raw_row2);
-    free(raw_result);
+/// Find the root of the set of run r, halving the path to it
+static inline uint32 FindRoot(uint32* parent, uint32 r) {
+  while (parent[r] != r) {
+    parent[r] = parent[parent[r]];
+    r = parent[r];
   }
-  return result;
+  return r;
 }
-/**
-Image ImageAND(const Image img1, const Image img2) {
-    // Verifica se as imagens não são nulas e têm as mesmas dimensões
-    assert(img1 != NULL && img2 != NULL);
-    assert(ImageWidth(img1) == ImageWidth(img2) && ImageHeight(img1) == ImageHeight(img2));
-
-    // Reset dos contadores de operações
-    InstrReset();
-    InstrName[0] = "Operações AND";
-
-    // Aloca uma nova imagem para armazenar o resultado
-    Image result = AllocateImageHeader(ImageWidth(img1), ImageHeight(img1));
-    assert(result != NULL);
-
-    // Itera sobre cada linha da imagem
-    for (uint32 y = 0; y < ImageHeight(img1); y++) {
-        const int* rle_row1 = img1->row[y];
-        const int* rle_row2 = img2->row[y];
-        int* rle_result = AllocateRLERowArray(ImageWidth(img1));
-
-        int idx1 = 1, idx2 = 1, idx_res = 0;
-        int len1_rest = rle_row1[idx1]; // Comprimento restante do run em rle_row1
-        int len2_rest = rle_row2[idx2]; // Comprimento restante do run em rle_row2
-
-        int current_value = rle_row1[0] & rle_row2[0]; // Valor inicial do resultado
-        rle_result[idx_res++] = current_value;
-
-        while (len1_rest > 0 && len2_rest > 0) {
-            int min_len = (len1_rest < len2_rest) ? len1_rest : len2_rest;
-
-            // Obtém os valores dos runs e realiza a operação AND
-            int val1 = (idx1 == 1) ? rle_row1[0] : (rle_row1[0] ^ 1);
-            int val2 = (idx2 == 1) ? rle_row2[0] : (rle_row2[0] ^ 1);
-            int and_value = val1 & val2;
-
-            if (and_value == current_value) {
-                rle_result[idx_res - 1] += min_len; // Incrementa o comprimento do run atual
-            } else {
-                rle_result[idx_res++] = min_len;
-                rle_result[idx_res++] = and_value;
-                current_value = and_value;
-            }
-
-            // Incrementa o contador de operações
-            InstrCount[0] += min_len;
 
-            // Atualiza os comprimentos restantes e avança os índices, se necessário
-            len1_rest -= min_len;
-            len2_rest -= min_len;
+/// Join the sets of runs r and s, attaching the smaller set to the other
+static inline void JoinRuns(uint32* parent, uint32* size, uint32 r,
+                            uint32 s) {
+  r = FindRoot(parent, r);
+  s = FindRoot(parent, s);
+  if (r == s) return;
+  if (size[r] < size[s]) {
+    uint32 t = r;
+    r = s;
+    s = t;
+  }
+  parent[s] = r;
+  size[r] += size[s];
+}
 
-            if (len1_rest == 0 && rle_row1[idx1 + 1] != EOR) {
-                idx1 += 2;
-                len1_rest = rle_row1[idx1];
-            }
-            if (len2_rest == 0 && rle_row2[idx2 + 1] != EOR) {
-                idx2 += 2;
-                len2_rest = rle_row2[idx2];
-            }
+/// Label the connected components of the BLACK pixels of img
+ImageLabels* ImageLabelComponents(const Image img, int connectivity) {  ///
+  assert(img != NULL);
+  assert(connectivity == 4 || connectivity == 8);
+  InstrBegin("ImageLabelComponents");
+  uint32 gap = (connectivity == 8) ? 1 : 0;  // runs this far apart touch
+
+  // The BLACK runs of all rows, in row order: those of row y are
+  // run[first[y]..first[y+1]-1]
+  size_t capacity = (size_t)img->height + 1;
+  ImageRun* run = malloc(capacity * sizeof(ImageRun));
+  uint32* first = malloc(((size_t)img->height + 1) * sizeof(uint32));
+  check(run != NULL && first != NULL, "malloc");
+  uint32 num_runs = 0;
+  for (uint32 y = 0; y < img->height; y++) {
+    first[y] = num_runs;
+    struct rowreader r;
+    ReaderInit(&r, img, y);
+    uint32 x = 0;
+    uint32 length;
+    uint8 value;
+    while ((length = NextRun(&r, &value)) > 0) {
+      if (value == BLACK) {
+        if (num_runs == capacity) {
+          capacity *= 2;
+          run = realloc(run, capacity * sizeof(ImageRun));
+          check(run != NULL, "realloc");
         }
-
-        // Marca o fim da linha resultante
-        rle_result[idx_res++] = EOR;
-        result->row[y] = rle_result;
+        check(num_runs < UINT32_MAX, "Too many runs");
+        run[num_runs++] = (ImageRun){y, x, x + length - 1};
+      }
+      x += length;
     }
+  }
+  first[img->height] = num_runs;
+  PIXMEM += num_runs;
+
+  // Join the runs of each row with the touching runs of the row above
+  uint32* parent = malloc(((size_t)num_runs + 1) * sizeof(uint32));
+  uint32* size = malloc(((size_t)num_runs + 1) * sizeof(uint32));
+  check(parent != NULL && size != NULL, "malloc");
+  for (uint32 k = 0; k < num_runs; k++) {
+    parent[k] = k;
+    size[k] = 1;
+  }
+  for (uint32 y = 1; y < img->height; y++) {
+    uint32 i = first[y - 1];  // run of the row above
+    uint32 j = first[y];      // run of row y
+    while (i < first[y] && j < first[y + 1]) {
+      if (run[i].x0 <= run[j].x1 + gap && run[j].x0 <= run[i].x1 + gap) {
+        JoinRuns(parent, size, i, j);
+      }
+      // The run that ends first touches no later run of the other row
+      if (run[i].x1 < run[j].x1) {
+        i++;
+      } else {
+        j++;
+      }
+    }
+  }
 
+  // Number the components in the order of their first run, which is the
+  // order of their first pixel: label[root] is the component of a set,
+  // and then size[k] is the component of run k
+  uint32* label = malloc(((size_t)num_runs + 1) * sizeof(uint32));
+  check(label != NULL, "malloc");
+  for (uint32 k = 0; k < num_runs; k++) label[k] = UINT32_MAX;
+  uint32 num_components = 0;
+  for (uint32 k = 0; k < num_runs; k++) {
+    uint32 root = FindRoot(parent, k);
+    if (label[root] == UINT32_MAX) label[root] = num_components++;
+    size[k] = label[root];
+  }
 
-    return result;
-}
-
-***/
-Image ImageOR(const Image img1, const Image img2) {
-  assert(img1 != NULL && img2 != NULL);
+  // The labels, with their components and runs, in a single block
+  ImageLabels* labels =
+      malloc(sizeof(ImageLabels) + num_components * sizeof(ImageComponent) +
+             num_runs * sizeof(ImageRun));
+  check(labels != NULL, "malloc");
+  labels->num_components = num_components;
+  labels->components = (ImageComponent*)(labels + 1);
+  labels->num_runs = num_runs;
+  labels->runs = (ImageRun*)(labels->components + num_components);
+
+  for (uint32 c = 0; c < num_components; c++) {
+    labels->components[c] =
+        (ImageComponent){0, UINT32_MAX, UINT32_MAX, 0, 0, 0, 0};
+  }
+  for (uint32 k = 0; k < num_runs; k++) {
+    ImageComponent* c = &labels->components[size[k]];
+    c->area += run[k].x1 - run[k].x0 + 1;
+    if (run[k].x0 < c->x0) c->x0 = run[k].x0;
+    if (run[k].x1 > c->x1) c->x1 = run[k].x1;
+    if (c->num_runs == 0) c->y0 = run[k].y;
+    c->y1 = run[k].y;
+    c->num_runs++;
+  }
 
-  // COMPLETE THE CODE
-  // You might consider using the UncompressRow and CompressRow auxiliary files
-  // Or devise a more efficient alternative
+  // Group the runs by component (keeping their order), with label[c] as
+  // the place of the next run of component c
+  uint32 next = 0;
+  for (uint32 c = 0; c < num_components; c++) {
+    labels->components[c].first_run = next;
+    label[c] = next;
+    next += labels->components[c].num_runs;
+  }
+  for (uint32 k = 0; k < num_runs; k++) {
+    labels->runs[label[size[k]]++] = run[k];
+  }
 
-  // assert das dimensões das imagens
-  assert(img1->width == img2->width && img1->height == img2->height);
+  free(run);
+  free(first);
+  free(parent);
+  free(size);
+  free(label);
+  InstrEnd();
+  return labels;
+}
 
-  uint32 width = img1->width;
-  uint32 height = img1->height;
+/// Destroy the labels pointed to by (*lp).
+void ImageLabelsDestroy(ImageLabels** lp) {  ///
+  assert(lp != NULL);
+  free(*lp);
+  *lp = NULL;
+}
 
-  Image newImage = AllocateImageHeader(width, height); //alocar um novo cabeçalho
+/// Lazy image expressions
+
+// An expression is a DAG of NEG/AND/OR/XOR nodes over images.
+// Nothing is computed when an expression is built: ImageExprImage
+// evaluates a whole chain of operations in one row-by-row pass over the
+// input images, so no intermediate images are created.
+// Each row is computed in the run domain, by pulling runs through the
+// expression (see StepNextRun), or in the bitmap domain, a word at a time,
+// if any input row is a bitmap (see StepWords).
+// The result is cached in the node, which then becomes an image node.
+
+// Kinds of expression nodes
+enum ExprKind {
+  EXPR_IMAGE,  // an image (given, or the cached result of the expression)
+  EXPR_NEG,    // NEG of expression a
+  EXPR_OP,     // op of expressions a and b
+};
 
-  for (uint32 i = 0; i < height; i++) {
-    // descomprimir as linhas 
-    uint8* row1 = UncompressRow(width, img1->row[i]);
-    uint8* row2 = UncompressRow(width, img2->row[i]);
+// Expression node
+struct imageexpr {
+  uint32 refs;          // number of references (from clients and nodes)
+  uint8 kind;           // enum ExprKind
+  uint8 op;             // enum BoolOp, for EXPR_OP nodes
+  ImageExpr a, b;       // operands
+  Image img;            // the image, for EXPR_IMAGE nodes
+  uint32 width;
+  uint32 height;
+  uint32 stamp;         // last traversal that visited the node
+  uint32 uses;          // number of uses found in that traversal
+};
 
-    
-    uint8* result_row = malloc(width * sizeof(uint8));
-    check(result_row != NULL, "malloc"); // comfirmar alocação
-    
-    // bitwise or
-    for (uint32 j = 0; j < width; j++) {
-      result_row[j] = row1[j] | row2[j];
-    }
+// Step of an evaluation plan: a node of the expression, as a tree.
+// Steps are stored in post-order, so the root is the last step.
+struct exprstep {
+  uint8 kind;           // enum ExprKind
+  uint8 op;             // enum BoolOp, for EXPR_OP steps
+  uint32 a, b;          // steps of the operands
+  Image img;            // for EXPR_IMAGE steps
+  uint32 depth;         // bitmap rows of scratch needed (see StepWords)
+};
 
-    // comprimir a linha
-    newImage->row[i] = CompressRow(width, result_row);
+// Evaluation plan
+struct exprplan {
+  struct exprstep* step;
+  uint32 num_steps;
+};
 
-    // free às linhas
-    free(row1);
-    free(row2);
-    free(result_row);
-  }
+// State of a step while a row is evaluated
+struct exprcursor {
+  struct rowreader r;   // for EXPR_IMAGE steps
+  uint32 left1, left2;  // pixels left in the current runs of a and b
+  uint8 val1, val2;     // colors of the current runs of a and b
+};
 
-  return newImage;
+// Traversal counter (see struct imageexpr)
+static uint32 expr_stamp = 0;
+
+/// Create an expression node
+static ImageExpr NewExpr(uint8 kind, uint32 width, uint32 height) {
+  ImageExpr e = malloc(sizeof(struct imageexpr));
+  check(e != NULL, "malloc");
+  e->refs = 1;
+  e->kind = kind;
+  e->op = 0;
+  e->a = e->b = NULL;
+  e->img = NULL;
+  e->width = width;
+  e->height = height;
+  e->stamp = 0;
+  e->uses = 0;
+  return e;
 }
 
+/// Wrap an image in an expression.
+/// The expression takes ownership of img.
+ImageExpr ImageExprLeaf(Image img) {  ///
+  assert(img != NULL);
+  ImageExpr e = NewExpr(EXPR_IMAGE, img->width, img->height);
+  e->img = img;
+  return e;
+}
 
-Image ImageXOR(Image img1, Image img2) {
-  assert(img1 != NULL && img2 != NULL);
+/// Build the NEG of expression a
+ImageExpr ImageExprNEG(ImageExpr a) {  ///
+  assert(a != NULL);
+  ImageExpr e = NewExpr(EXPR_NEG, a->width, a->height);
+  e->a = a;
+  a->refs++;
+  return e;
+}
 
-  // COMPLETE THE CODE
-  // You might consider using the UncompressRow and CompressRow auxiliary files
-  // Or devise a more efficient alternative
+/// Build op of expressions a and b
+static ImageExpr NewExprOp(enum BoolOp op, ImageExpr a, ImageExpr b) {
+  assert(a != NULL && b != NULL);
+  assert(a->width == b->width && a->height == b->height);
+  ImageExpr e = NewExpr(EXPR_OP, a->width, a->height);
+  e->op = op;
+  e->a = a;
+  e->b = b;
+  a->refs++;
+  b->refs++;
+  return e;
+}
 
-  // assert das dimensões da imagem
-  assert(img1->width == img2->width && img1->height == img2->height);
+ImageExpr ImageExprAND(ImageExpr a, ImageExpr b) {  ///
+  return NewExprOp(OP_AND, a, b);
+}
 
-  uint32 width =  img1->width;
-  uint32 height = img1->height;
+ImageExpr ImageExprOR(ImageExpr a, ImageExpr b) {  ///
+  return NewExprOp(OP_OR, a, b);
+}
 
-  Image newImage = AllocateImageHeader(width, height);
+ImageExpr ImageExprXOR(ImageExpr a, ImageExpr b) {  ///
+  return NewExprOp(OP_XOR, a, b);
+}
 
-  for (uint32 i = 0; i < height; i++) {
+/// Drop a reference to an expression, freeing it if it was the last one
+static void ReleaseExpr(ImageExpr e) {
+  if (e == NULL || --e->refs > 0) return;
+  ReleaseExpr(e->a);
+  ReleaseExpr(e->b);
+  ImageDestroy(&e->img);
+  free(e);
+}
 
-    // descomprimir as linahs de cada uma das duas imagens
-    uint8* row1 = UncompressRow(width, img1->row[i]);
-    uint8* row2 = UncompressRow(width, img2->row[i]);
+/// Destroy the expression pointed to by (*ep).
+/// The nodes (and images) it shares with other expressions are kept
+/// until those are destroyed too.
+/// If (*ep)==NULL, no operation is performed.
+/// Ensures: (*ep)==NULL.
+void ImageExprDestroy(ImageExpr* ep) {  ///
+  assert(ep != NULL);
+  ReleaseExpr(*ep);
+  *ep = NULL;
+}
 
+/// Count the uses of the nodes of e that are not images yet,
+/// in traversal expr_stamp.
+static void CountExprUses(ImageExpr e) {
+  if (e->kind == EXPR_IMAGE) return;
+  if (e->stamp == expr_stamp) {
+    e->uses++;
+    return;
+  }
+  e->stamp = expr_stamp;
+  e->uses = 1;
+  CountExprUses(e->a);
+  if (e->b != NULL) CountExprUses(e->b);
+}
 
-    uint8* result_row = malloc(width * sizeof(uint8));
-    check(result_row != NULL, "malloc"); // comfirmar alocação
-    //bitwise xor
-    for (uint32 j = 0; j < width; j++) {
-      result_row[j] = row1[j] ^ row2[j];
-    }
+static void EvalExpr(ImageExpr e);
 
-    // comprimir as rows
-    newImage->row[i] = CompressRow(width, result_row);
+/// Evaluate the nodes of e used more than once (see CountExprUses),
+/// operands first, so that the plan for e is a tree.
+static void EvalSharedExprs(ImageExpr e, ImageExpr root) {
+  if (e->kind == EXPR_IMAGE) return;
+  EvalSharedExprs(e->a, root);
+  if (e->b != NULL) EvalSharedExprs(e->b, root);
+  if (e != root && e->kind != EXPR_IMAGE && e->uses > 1) EvalExpr(e);
+}
 
-    // free às rows
-    free(row1);
-    free(row2);
-    free(result_row);
+/// Add the steps of e to plan, in post-order.
+/// Returns the index of the step of e.
+static uint32 AddExprSteps(struct exprplan* plan, ImageExpr e) {
+  struct exprstep s = {e->kind, e->op, 0, 0, e->img, 0};
+  if (e->kind == EXPR_NEG) {
+    s.a = AddExprSteps(plan, e->a);
+    s.depth = plan->step[s.a].depth;
+  } else if (e->kind == EXPR_OP) {
+    s.a = AddExprSteps(plan, e->a);
+    s.b = AddExprSteps(plan, e->b);
+    // b is computed into scratch, after a
+    s.depth = plan->step[s.a].depth;
+    if (plan->step[s.b].depth + 1 > s.depth) s.depth = plan->step[s.b].depth + 1;
   }
-
-  return newImage;
+  plan->step[plan->num_steps] = s;
+  return plan->num_steps++;
 }
 
-/// Geometric transformations
+/// Count the nodes of a tree
+static uint32 CountExprNodes(ImageExpr e) {
+  if (e->kind == EXPR_IMAGE) return 1;
+  if (e->kind == EXPR_NEG) return 1 + CountExprNodes(e->a);
+  return 1 + CountExprNodes(e->a) + CountExprNodes(e->b);
+}
 
-/// These functions apply geometric transformations to an image,
-/// returning a new image as a result.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
+/// Get the next run of step k of a plan, for the current row.
+/// Runs are pulled from the operands, so nothing is stored between steps.
+/// Runs may be shorter than the maximal runs of the result.
+static uint32 StepNextRun(const struct exprplan* plan,
+                          struct exprcursor* cursor, uint32 k, uint8* value) {
+  const struct exprstep* s = &plan->step[k];
+  struct exprcursor* c = &cursor[k];
+  switch (s->kind) {
+    case EXPR_IMAGE:
+      return NextRun(&c->r, value);
+    case EXPR_NEG: {
+      uint32 length = StepNextRun(plan, cursor, s->a, value);
+      *value ^= 1;
+      return length;
+    }
+    default: {
+      if (c->left1 == 0) c->left1 = StepNextRun(plan, cursor, s->a, &c->val1);
+      if (c->left2 == 0) c->left2 = StepNextRun(plan, cursor, s->b, &c->val2);
+      if (c->left1 == 0) {
+        assert(c->left2 == 0);  // Rows must have the same width
+        return 0;
+      }
+      uint32 step = (c->left1 < c->left2) ? c->left1 : c->left2;
+      c->left1 -= step;
+      c->left2 -= step;
+      *value = ApplyOp(s->op, c->val1, c->val2);
+      PIXMEM += 1;
+      return step;
+    }
+  }
+}
 
-/// Mirror an image = flip top-bottom.
-/// Returns a mirrored version of the image.
-/// Ensures: The original img is not modified.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageHorizontalMirror(const Image img) {
-  assert(img != NULL);
+/// Compute row i of step k of a plan into the bitmap words out.
+/// scratch has room for the depth of the step, in bitmap rows.
+static void StepWords(const struct exprplan* plan, uint32 k, uint32 i,
+                      uint32 width, uint64* out, uint64* scratch) {
+  const struct exprstep* s = &plan->step[k];
+  uint32 nwords = NumWords(width);
+  if (s->kind == EXPR_IMAGE) {
+    if (s->img->row[i].kind == ROW_BITS) {
+      memcpy(out, RowWords(s->img, i), nwords * sizeof(uint64));
+    } else {
+      struct rowreader r;
+      ReaderInit(&r, s->img, i);
+      RunsToBits(width, &r, out);
+    }
+  } else if (s->kind == EXPR_NEG) {
+    StepWords(plan, s->a, i, width, out, scratch);
+    InvertBits(width, out);
+  } else {
+    StepWords(plan, s->a, i, width, out, scratch);
+    StepWords(plan, s->b, i, width, scratch, scratch + nwords);
+    switch (s->op) {
+      case OP_AND:
+        for (uint32 j = 0; j < nwords; j++) out[j] &= scratch[j];
+        break;
+      case OP_OR:
+        for (uint32 j = 0; j < nwords; j++) out[j] |= scratch[j];
+        break;
+      default:
+        for (uint32 j = 0; j < nwords; j++) out[j] ^= scratch[j];
+    }
+  }
+  PIXMEM += nwords;
+}
 
+/// RowBuilder for EvalExpr
+static void BuildExprRow(Image img, uint32 i, const void* args,
+                         void* scratch) {
+  (void)scratch;
+  const struct exprplan* plan = args;
   uint32 width = img->width;
-  uint32 height = img->height;
-
-  Image newImage = AllocateImageHeader(width, height);
-
-// copiar a row do fundo da imagem original 
-  for (uint32 i = 0; i < height; i++) {
-    uint32 src_row = height - 1 - i; // indice da linha original considerando o espelhamento
-    uint32 num_elems = GetSizeRLERowArray(img->row[src_row]); //nº de elementos da linha
-    newImage->row[i] = AllocateRLERowArray(num_elems); //alocar espaço na memória
+  uint32 root = plan->num_steps - 1;
+
+  // Bound the runs of the result by the runs of the input rows
+  uint32 max_runs = 0;
+  int bits = 0;
+  for (uint32 k = 0; k < plan->num_steps; k++) {
+    const struct exprstep* s = &plan->step[k];
+    if (s->kind != EXPR_IMAGE) continue;
+    if (s->img->row[i].kind == ROW_BITS) {
+      bits = 1;
+    } else {
+      max_runs += s->img->row[i].size;
+    }
+  }
 
-    // copia o conteúdo da linha comprimida da imagem original para uma nova linha
-    memcpy(newImage->row[i], img->row[src_row], num_elems * sizeof(int)); 
+  if (bits) {
+    // Compute the row a word at a time (and turn it back into RLE
+    // if it has few runs)
+    uint32 nwords = NumWords(width);
+    uint32 depth = plan->step[root].depth;
+    uint64 stack[STACK_WORDS];
+    uint64* scratch = GetScratch(stack, (size_t)depth * nwords);
+    StepWords(plan, root, i, width, BeginBitsRow(img, nwords), scratch);
+    PutScratch(scratch, stack, (size_t)depth * nwords);
+    EndWordsRow(img, i);
+    return;
   }
 
-  return newImage;
+  struct exprcursor cursor[plan->num_steps];
+  for (uint32 k = 0; k < plan->num_steps; k++) {
+    if (plan->step[k].kind == EXPR_IMAGE) {
+      ReaderInit(&cursor[k].r, plan->step[k].img, i);
+    }
+    cursor[k].left1 = cursor[k].left2 = 0;
+  }
+  if (max_runs > width) max_runs = width;
+  struct rowwriter w;
+  WriterInit(&w, BeginRow(img, MaxRowSize(width, max_runs)));
+  uint8 value;
+  uint32 length;
+  while ((length = StepNextRun(plan, cursor, root, &value)) > 0) {
+    PutRun(&w, value, length);
+  }
+  EndRowWriter(img, i, &w);
 }
 
-/// Mirror an image = flip left-right.
-/// Returns a mirrored version of the image.
-/// Ensures: The original img is not modified.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageVerticalMirror(const Image img) {
-  assert(img != NULL);
-
-  uint32 width = img->width;
-  uint32 height = img->height;
-
-  Image newImage = AllocateImageHeader(width, height);
+/// RowWeight for EvalExpr
+static uint32 ExprRowWeight(const void* args, uint32 i) {
+  const struct exprplan* plan = args;
+  uint32 weight = 0;
+  for (uint32 k = 0; k < plan->num_steps; k++) {
+    if (plan->step[k].kind == EXPR_IMAGE) weight += plan->step[k].img->row[i].size;
+  }
+  return weight;
+}
 
-  for (uint32 i = 0; i < height; i++) {
-    // descomprimir a linha
-    uint8* row = UncompressRow(width, img->row[i]);
+/// RowRepeat for EvalExpr
+static uint32 ExprRowRepeat(const void* args, uint32 i) {
+  const struct exprplan* plan = args;
+  uint32 j = i;
+  for (uint32 k = 0; k < plan->num_steps; k++) {
+    if (plan->step[k].kind != EXPR_IMAGE) continue;
+    uint32 jk = RepeatedRow(plan->step[k].img, i);
+    if (jk == i || (j != i && jk != j)) return i;
+    j = jk;
+  }
+  return j;
+}
 
-    // inversão da linha
-    for (uint32 j = 0; j < width / 2; j++) {
-      uint8 temp = row[j];
-      row[j] = row[width - 1 - j]; // copia o valor do elemento simétrico para j
-      row[width - 1 - j] = temp; // copia o valor temporário para a posição simétrica
+/// Evaluate expression e (not an image yet), turning it into an image node.
+/// The operands are released, as they are no longer needed.
+static void EvalExpr(ImageExpr e) {
+  // Shared nodes are evaluated first
+  expr_stamp++;
+  CountExprUses(e);
+  EvalSharedExprs(e, e);
+
+  Image img;
+  if (e->kind == EXPR_NEG && e->a->kind == EXPR_IMAGE) {
+    img = ImageNEG(e->a->img);  // shares the rows
+  } else if (e->kind == EXPR_OP && e->a->kind == EXPR_IMAGE &&
+             e->b->kind == EXPR_IMAGE) {
+    img = MergeImages(e->a->img, e->b->img, e->op);
+  } else {
+    struct exprplan plan;
+    plan.step = malloc(CountExprNodes(e) * sizeof(struct exprstep));
+    check(plan.step != NULL, "malloc");
+    plan.num_steps = 0;
+    AddExprSteps(&plan, e);
+
+    // Start with room for the largest input
+    size_t capacity = 0;
+    for (uint32 k = 0; k < plan.num_steps; k++) {
+      if (plan.step[k].kind != EXPR_IMAGE) continue;
+      size_t num_elems = GetNumElems(plan.step[k].img);
+      if (num_elems > capacity) capacity = num_elems;
     }
+    img = AllocateImageHeader(e->width, e->height, capacity);
+    BuildRows(img, BuildExprRow, &plan, ExprRowWeight, ExprRowRepeat, 0);
+    free(plan.step);
+    InternRows(img);
+  }
 
-    // comprimir a row
-    newImage->row[i] = CompressRow(width, row);
+  ReleaseExpr(e->a);
+  ReleaseExpr(e->b);
+  e->a = e->b = NULL;
+  e->kind = EXPR_IMAGE;
+  e->img = img;
+}
 
-    free(row);
+/// Get the image of expression e, evaluating it if needed.
+/// The image belongs to the expression: it must not be destroyed,
+/// and is valid until the expression is destroyed.
+Image ImageExprImage(ImageExpr e) {  ///
+  assert(e != NULL);
+  if (e->kind != EXPR_IMAGE) {
+    InstrBegin("ImageExprImage");
+    EvalExpr(e);
+    InstrEnd();
   }
+  return e->img;
+}
 
+/// Image streams
 
-  return newImage;
-}
+// An image stream produces the rows of an image one at a time, in order,
+// so that operations on images larger than memory can run from file to
+// file in constant memory (see ImageStreamSave).
+//
+// Streams form a DAG, like lazy expressions.  Each node holds the last
+// row it produced, as row 0 of a one-row image, and the index of that
+// row, so a node shared by several operands is computed once per row.
+// File streams read the pixels in chunks of rows, and ask the kernel to
+// read the next chunk ahead while the current one is processed, so that
+// I/O overlaps computation.
+//
+// A mirror reads the rows of its operand in reverse order, so it gets a
+// private copy of the operand nodes, with their own files and cursors
+// (see CopyStream): every node is then asked for its rows in a single
+// direction, and at most one row at a time.
+
+// Size of the buffer of a file stream (rows are read in chunks)
+#define STREAM_CHUNK (1 << 20)
+
+enum StreamKind {
+  STREAM_FILE,     // rows read from a PBM file
+  STREAM_NEG,      // NEG of stream a
+  STREAM_OP,       // op of streams a and b
+  STREAM_HMIRROR,  // rows of stream a, bottom to top
+};
 
-/// Replicate img2 at the bottom of imag1, creating a larger image
-/// Requires: the width of the two images must be the same.
-/// Returns the new larger image.
-/// Ensures: The original images are not modified.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageReplicateAtBottom(const Image img1, const Image img2) {
-  assert(img1 != NULL && img2 != NULL);
-  //assert das dimensões
-  assert(img1->width == img2->width);
+// Stream node
+struct imagestream {
+  uint32 refs;          // number of references (from clients and nodes)
+  uint8 kind;           // enum StreamKind
+  uint8 op;             // enum BoolOp, for STREAM_OP nodes
+  ImageStream a, b;     // operands
+  uint32 width;
+  uint32 height;
+  Image row;            // the last row produced, as its row 0
+  uint32 current;       // the index of that row, or UINT32_MAX if none
+  // STREAM_FILE nodes
+  char* filename;
+  FILE* f;
+  long start;           // file offset of the first row
+  int reversed;         // are rows read from bottom to top?
+  uint8* chunk;         // the rows of the current chunk
+  uint32 chunk_first;   // index of the first row in chunk
+  uint32 chunk_rows;    // number of rows in chunk
+  uint32 chunk_size;    // capacity of chunk, in rows
+  uint64* words;        // the row being decoded, as bitmap words
+};
 
-  uint32 new_width = img1->width;
-  uint32 new_height = img1->height + img2->height; //new_height é a soma das height originais de cada imagem
+/// Create a stream node, with room for its rows
+static ImageStream NewStream(uint8 kind, uint32 width, uint32 height) {
+  ImageStream s = malloc(sizeof(struct imagestream));
+  check(s != NULL, "malloc");
+  s->refs = 1;
+  s->kind = kind;
+  s->op = 0;
+  s->a = s->b = NULL;
+  s->width = width;
+  s->height = height;
+  s->row = AllocateImageHeader(width, 1, 4 * (size_t)NumWords(width) + 3);
+  s->current = UINT32_MAX;
+  s->filename = NULL;
+  s->f = NULL;
+  s->chunk = NULL;
+  s->words = NULL;
+  return s;
+}
+
+/// Open a PBM file as a stream read in the given direction
+static ImageStream OpenStream(const char* filename, int reversed) {
+  int w, h;
+  FILE* f = NULL;
+  check((f = fopen(filename, "rb")) != NULL, "Open failed");
+  ReadPBMHeader(f, &w, &h);
+
+  ImageStream s = NewStream(STREAM_FILE, w, h);
+  s->filename = strdup(filename);
+  check(s->filename != NULL, "strdup");
+  s->f = f;
+  s->start = ftell(f);
+  check(s->start >= 0, "Seeking failed");
+  s->reversed = reversed;
+  uint32 nbytes = (w + 8 - 1) / 8;
+  s->chunk_size = STREAM_CHUNK / nbytes;
+  if (s->chunk_size == 0) s->chunk_size = 1;
+  if (s->chunk_size > s->height) s->chunk_size = s->height;
+  s->chunk = malloc((size_t)s->chunk_size * nbytes);
+  check(s->chunk != NULL, "malloc");
+  s->chunk_first = s->chunk_rows = 0;
+  s->words = malloc(NumWords(w) * sizeof(uint64));
+  check(s->words != NULL, "malloc");
+  return s;
+}
 
-  Image newImage = AllocateImageHeader(new_width, new_height);
-// copiar as rows da imagem 1
-  for (uint32 i = 0; i < img1->height; i++) {
-    uint32 num_elems = GetSizeRLERowArray(img1->row[i]);
-    newImage->row[i] = AllocateRLERowArray(num_elems);
+/// Get the first row of the chunk of a file stream holding row i,
+/// in the direction the rows are read
+static uint32 ChunkFirst(const ImageStream s, uint32 i) {
+  if (!s->reversed) return i;
+  return (i + 1 > s->chunk_size) ? i + 1 - s->chunk_size : 0;
+}
 
-    memcpy(newImage->row[i], img1->row[i], num_elems * sizeof(int));
+/// Read the chunk of rows holding row i of a file stream, and ask the
+/// kernel to read the next chunk ahead
+static void ReadChunk(ImageStream s, uint32 i) {
+  size_t nbytes = (s->width + 8 - 1) / 8;
+  s->chunk_first = ChunkFirst(s, i);
+  s->chunk_rows = s->height - s->chunk_first;
+  if (s->chunk_rows > s->chunk_size) s->chunk_rows = s->chunk_size;
+  off_t offset = s->start + (off_t)s->chunk_first * nbytes;
+  size_t size = s->chunk_rows * nbytes;
+  check(pread(fileno(s->f), s->chunk, size, offset) == (ssize_t)size,
+        "Reading pixels");
+
+  uint32 next;  // the first row of the next chunk
+  if (!s->reversed && s->chunk_first + s->chunk_rows < s->height) {
+    next = s->chunk_first + s->chunk_rows;
+  } else if (s->reversed && s->chunk_first > 0) {
+    next = ChunkFirst(s, s->chunk_first - 1);
+  } else {
+    return;
   }
+  posix_fadvise(fileno(s->f), s->start + (off_t)next * nbytes,
+                (off_t)s->chunk_size * nbytes, POSIX_FADV_WILLNEED);
+}
 
-  //copiar as rows da imagem 2
-  for (uint32 i = 0; i < img2->height; i++) {
-    uint32 num_elems = GetSizeRLERowArray(img2->row[i]);
-    newImage->row[img1->height + i] = AllocateRLERowArray(num_elems);
-    memcpy(newImage->row[img1->height + i], img2->row[i], num_elems * sizeof(int));
+/// Drop a reference to a stream, freeing it if it was the last one
+static void ReleaseStream(ImageStream s) {
+  if (s == NULL || --s->refs > 0) return;
+  ReleaseStream(s->a);
+  ReleaseStream(s->b);
+  ImageDestroy(&s->row);
+  if (s->f != NULL) fclose(s->f);
+  free(s->filename);
+  free(s->chunk);
+  free(s->words);
+  free(s);
+}
+
+/// Copy the nodes of stream s, to be read in the given direction
+/// (reopening its files)
+static ImageStream CopyStream(ImageStream s, int reversed) {
+  switch (s->kind) {
+    case STREAM_FILE:
+      return OpenStream(s->filename, reversed);
+    case STREAM_NEG:
+    case STREAM_HMIRROR: {
+      ImageStream c = NewStream(s->kind, s->width, s->height);
+      c->a = CopyStream(s->a, s->kind == STREAM_HMIRROR ? !reversed : reversed);
+      return c;
+    }
+    default: {
+      ImageStream a = CopyStream(s->a, reversed);
+      ImageStream b = CopyStream(s->b, reversed);
+      ImageStream c = NewStream(STREAM_OP, s->width, s->height);
+      c->op = s->op;
+      c->a = a;
+      c->b = b;
+      return c;
+    }
   }
+}
 
-  return newImage;
+/// Open a PBM file as a stream.
+/// Only binary PBM files are accepted, and the file must be seekable.
+ImageStream ImageStreamOpen(const char* filename) {  ///
+  assert(filename != NULL);
+  return OpenStream(filename, 0);
 }
 
-/// Replicate img2 to the right of imag1, creating a larger image
-/// Requires: the height of the two images must be the same.
-/// Returns the new larger image.
-/// Ensures: The original images are not modified.
-///                
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageReplicateAtRight(const Image img1, const Image img2) {
-  assert(img1 != NULL && img2 != NULL);
-  assert(img1->height == img2->height);
+/// Build the NEG of stream a
+ImageStream ImageStreamNEG(ImageStream a) {  ///
+  assert(a != NULL);
+  ImageStream s = NewStream(STREAM_NEG, a->width, a->height);
+  s->a = a;
+  a->refs++;
+  return s;
+}
 
-  uint32 new_width = img1->width + img2->width;
-  uint32 new_height = img1->height;
+/// Build op of streams a and b
+static ImageStream NewStreamOp(enum BoolOp op, ImageStream a, ImageStream b) {
+  assert(a != NULL && b != NULL);
+  assert(a->width == b->width && a->height == b->height);
+  ImageStream s = NewStream(STREAM_OP, a->width, a->height);
+  s->op = op;
+  s->a = a;
+  s->b = b;
+  a->refs++;
+  b->refs++;
+  return s;
+}
 
-  Image newImage = AllocateImageHeader(new_width, new_height);
+ImageStream ImageStreamAND(ImageStream a, ImageStream b) {  ///
+  return NewStreamOp(OP_AND, a, b);
+}
 
-  // COMPLETE THE CODE
-  for (uint32 i = 0; i < new_height; i++) {
-    // descomprimir as rows
-    uint8* row1 = UncompressRow(img1->width, img1->row[i]);
-    uint8* row2 = UncompressRow(img2->width, img2->row[i]);
+ImageStream ImageStreamOR(ImageStream a, ImageStream b) {  ///
+  return NewStreamOp(OP_OR, a, b);
+}
 
-    // concatenação das rows
-    uint8* result_row = malloc(new_width * sizeof(uint8));
-    check(result_row != NULL, "malloc"); //confirmar malloc
+ImageStream ImageStreamXOR(ImageStream a, ImageStream b) {  ///
+  return NewStreamOp(OP_XOR, a, b);
+}
 
-    //Copia os primeiros img1-> width elementos de row1 para o inicio de result_row
-    memcpy(result_row, row1, img1->width * sizeof(uint8));
+/// Build the horizontal mirror of stream a.
+/// The nodes of a are copied, and its files reopened (see CopyStream).
+ImageStream ImageStreamHorizontalMirror(ImageStream a) {  ///
+  assert(a != NULL);
+  ImageStream s = NewStream(STREAM_HMIRROR, a->width, a->height);
+  s->a = CopyStream(a, 1);
+  return s;
+}
 
-    // Destino começa após os primeiros img1->width elementos
-    memcpy(result_row + img1->width, row2, img2->width * sizeof(uint8));
+/// Get stream width
+int ImageStreamWidth(const ImageStream s) {  ///
+  assert(s != NULL);
+  return s->width;
+}
 
-    // Ccomprimir a row resultante
-    newImage->row[i] = CompressRow(new_width, result_row);
+/// Get stream height
+int ImageStreamHeight(const ImageStream s) {  ///
+  assert(s != NULL);
+  return s->height;
+}
 
-    // free às rows
-    free(row1);
-    free(row2);
-    free(result_row);
+/// Get row i of stream s, as row 0 of the image returned.
+/// The image belongs to the stream, and its row is only valid until
+/// the next row of the stream is requested.
+static Image StreamRow(ImageStream s, uint32 i) {
+  if (s->kind == STREAM_HMIRROR) return StreamRow(s->a, s->height - 1 - i);
+  if (s->current == i) return s->row;  // a shared node
+
+  Image row = s->row;
+  WriteBuffer(row)->num_elems = 0;  // the previous row is replaced
+  switch (s->kind) {
+    case STREAM_FILE: {
+      if (i < s->chunk_first || i >= s->chunk_first + s->chunk_rows) {
+        ReadChunk(s, i);
+      }
+      uint32 nbytes = (s->width + 8 - 1) / 8;
+      uint32 nwords = NumWords(s->width);
+      uint64* words = s->words;
+      words[nwords - 1] = 0;  // the last word may be partially filled
+      memcpy(words, s->chunk + (size_t)(i - s->chunk_first) * nbytes, nbytes);
+      bytesToWords(s->width, words);
+      StoreBitsRow(row, 0, words);
+      break;
+    }
+    case STREAM_NEG: {
+      const Image src = StreamRow(s->a, i);
+      if (src->row[0].kind == ROW_BITS) {
+        uint32 nwords = NumWords(s->width);
+        uint64* words = BeginBitsRow(row, nwords);
+        memcpy(words, RowWords(src, 0), nwords * sizeof(uint64));
+        InvertBits(s->width, words);
+        EndBitsRow(row, 0, nwords);
+      } else {
+        uint32 n = src->row[0].size;
+        memcpy(BeginRow(row, n), RowArray(src, 0), n * sizeof(uint16));
+        EndRow(row, 0, src->row[0].color ^ 1, n);
+      }
+      break;
+    }
+    default:
+      MergeRows(row, 0, StreamRow(s->a, i), 0, StreamRow(s->b, i), 0, s->op);
   }
+  s->current = i;
+  return row;
+}
 
-  return newImage;
+/// RowSource for ImageStreamSave: the rows of the stream
+static Image StreamRowSource(void* args, uint32 i, uint32* row) {
+  *row = 0;
+  return StreamRow((ImageStream)args, i);
+}
+
+/// Save the rows of stream s to PBM file, as they are produced.
+/// Memory use does not depend on the height of the images.
+/// On success, returns nonzero.
+/// On failure, returns 0, and
+/// a partial and invalid file may be left in the system.
+int ImageStreamSave(ImageStream s, const char* filename) {  ///
+  assert(s != NULL);
+  InstrBegin("ImageStreamSave");
+  int ok = SavePBM(filename, s->width, s->height, StreamRowSource, s);
+  InstrEnd();
+  return ok;
+}
+
+/// Destroy the stream pointed to by (*sp).
+/// The nodes it shares with other streams are kept
+/// until those are destroyed too.
+/// If (*sp)==NULL, no operation is performed.
+/// Ensures: (*sp)==NULL.
+void ImageStreamDestroy(ImageStream* sp) {  ///
+  assert(sp != NULL);
+  ReleaseStream(*sp);
+  *sp = NULL;
 }
@@ -14,11 +14,13 @@
 #define IMAGEBW_H
 
 #include <inttypes.h>
+#include <stddef.h>
 
 // Types for non-negative integer values
 typedef uint8_t uint8;
 typedef uint16_t uint16;
 typedef uint32_t uint32;
+typedef uint64_t uint64;
 
 // Type Image is a pointer to image objects
 typedef struct image* Image;
@@ -31,6 +33,49 @@ typedef struct image* Image;
 /// Currently, simply calibrate instrumentation and set names of counters.
 void ImageInit(void);
 
+/// Set the number of threads used by image operations.
+/// Operations split the rows of their result among n threads
+/// (1, the default, runs everything in the calling thread).
+/// Results are identical for any number of threads.
+/// Must not be called while another image operation is running.
+/// The image functions themselves must be called from one thread at a
+/// time: they update global operation counters and measurement scopes
+/// (see instrumentation.h), and some cache data in their operands.
+void ImageSetThreads(int n);
+
+/// Enable (nonzero) or disable (0) row interning.
+/// While enabled, the rows of every new image are looked up in a global
+/// table of rows: equal rows of all live images share a single copy.
+/// Rows of native files mapped by ImageLoad are not interned: they stay
+/// in the mapping, so that loading them copies nothing.
+/// Disabled by default.  Does not change any result.
+void ImageSetInterning(int enabled);
+
+/// Print statistics on row interning (rows deduplicated, bytes saved).
+void ImageInternPrint(void);
+
+/// A memory allocator for images.
+/// alloc returns a block of size bytes (aligned for any type), or NULL;
+/// realloc resizes block ptr of old_size bytes to size bytes, or returns
+/// NULL leaving it untouched; free releases block ptr of size bytes.
+/// ctx is passed to all of them.  They must be thread-safe, since
+/// operations build rows in several threads (see ImageSetThreads).
+typedef struct {
+  void* (*alloc)(size_t size, void* ctx);
+  void* (*realloc)(void* ptr, size_t old_size, size_t size, void* ctx);
+  void (*free)(void* ptr, size_t size, void* ctx);
+  void* ctx;
+} ImageAllocator;
+
+/// Allocate the memory of images (headers, row tables, run buffers, the
+/// intern table and the scratch space of operations) with allocator, or
+/// with malloc, realloc and free if allocator is NULL.
+/// The allocator is copied.  Requires: no image (nor expression or
+/// stream) exists, since their memory is released with the allocator
+/// that allocated it.  (The intern table is freed with the last interned
+/// row, so it does not outlive the images.)
+void ImageSetAllocator(const ImageAllocator* allocator);
+
 /// Image management functions
 
 /// Create a new BW image, either BLACK or WHITE.
@@ -76,7 +121,7 @@ void ImageRLEPrint(const Image img);
 
 /// PBM BW image file operations
 
-/// Load a PBM BW image file.
+/// Load a PBM BW image file, or a native file (see ImageSaveNative).
 /// Only binary PBM files are accepted.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
@@ -88,6 +133,30 @@ Image ImageLoad(const char* filename);
 /// a partial and invalid file may be left in the system.
 int ImageSave(const Image img, const char* filename);
 
+/// Native image file and buffer operations
+/// The native format stores the RLE rows as they are in memory.
+/// ImageLoad maps native files instead of reading them, so loading copies
+/// no run data.  Native files and buffers are checked when loaded: every
+/// row must be in the canonical form that ImageSaveNative writes, or the
+/// program exits with an error, as for invalid PBM files.
+
+/// Save image to a native file (by convention, with extension .rle).
+/// On success, returns nonzero.
+/// On failure, returns 0, and
+/// a partial and invalid file may be left in the system.
+int ImageSaveNative(const Image img, const char* filename);
+
+/// Encode image in the native format into buf, if size is enough.
+/// Returns the size of the encoding in bytes
+/// (if larger than size, nothing was written: ImageEncode(img, NULL, 0)
+/// gets the size of the buffer needed).
+size_t ImageEncode(const Image img, void* buf, size_t size);
+
+/// Decode an image encoded by ImageEncode in buf (size bytes).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageDecode(const void* buf, size_t size);
+
 /// Information queries
 
 /// Get image width
@@ -96,10 +165,39 @@ int ImageWidth(const Image img);
 /// Get image height
 int ImageHeight(const Image img);
 
+/// Get the color of pixel (x, y) of img.
+/// Requires: 0 <= x < width, 0 <= y < height.
+/// RLE rows are searched in O(log runs) with an index of the positions of
+/// their runs, built for each row on its first query and cached in img
+/// even though it is const (with atomic operations, so threads may build
+/// it at once).
+uint8 ImageGetPixel(const Image img, uint32 x, uint32 y);
+
+/// A pixel position
+typedef struct {
+  uint32 x, y;
+} ImagePoint;
+
+/// Get the colors of n pixels of img: colors[k] is the color of
+/// points[k].  Requires: all points are inside img.
+/// As ImageGetPixel, but each query searches on from the previous one
+/// when it is further along the same row, so queries sorted along rows
+/// take amortized O(1) time each.
+void ImageGetPixels(const Image img, const ImagePoint points[], uint32 n,
+                    uint8 colors[]);
+
 /// Image comparison
 
+/// Compare two images: nonzero iff they have the same size and pixels.
 int ImageIsEqual(const Image img1, const Image img2);
 
+/// Get a hash of the contents of img.
+/// Equal images have equal hashes.
+/// The hash is computed on first use, in O(runs), and then cached.
+/// The row hashes are cached in img even though it is const (they are
+/// published with a compare-and-swap, so threads may build them at once).
+uint64 ImageHash(const Image img);
+
 int ImageIsDifferent(const Image img1, const Image img2);
 
 /// Boolean Operations on image pixels
@@ -120,6 +218,19 @@ Image ImageOR(const Image img1, const Image img2);
 
 Image ImageXOR(const Image img1, const Image img2);
 
+// Operations for ImageReduce
+#define REDUCE_AND 0
+#define REDUCE_OR 1
+#define REDUCE_XOR 2
+
+/// Combine n images (n > 0) with AND, OR or XOR (op = REDUCE_AND, ...),
+/// in a single pass that merges the runs of all images at once.
+Image ImageReduce(int op, const Image imgs[], uint32 n);
+
+/// Combine n images (n > 0): a pixel is BLACK iff it is BLACK
+/// in at least k of the images (e.g., k = n/2+1 for a majority vote).
+Image ImageAtLeast(const Image imgs[], uint32 n, uint32 k);
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -162,4 +273,163 @@ Image ImageReplicateAtBottom(const Image img1, const Image img2);
 /// (The caller is responsible for destroying the returned image!)
 Image ImageReplicateAtRight(const Image img1, const Image img2);
 
+/// Morphology
+
+/// These functions filter img with a rectangular structuring element of
+/// w x h pixels (w, h > 0), whose origin is its pixel (w/2, h/2).
+/// Erosion keeps BLACK only the pixels (x, y) where the element, placed
+/// with its origin there, covers only BLACK pixels: those of columns
+/// x-w/2..x+(w-1-w/2) and rows y-h/2..y+(h-1-h/2).
+/// Dilation (the Minkowski sum with the element) makes BLACK the pixels
+/// (x, y) where the element reflected about its origin covers some BLACK
+/// pixel: those of columns x-(w-1-w/2)..x+w/2 and rows
+/// y-(h-1-h/2)..y+h/2.  For odd w and h, both are the element centered
+/// on (x, y); for even ones, dilation grows a BLACK pixel at column x to
+/// columns x-w/2..x+(w-1-w/2), e.g., to x-1..x for w = 2.
+/// Pixels outside img count as WHITE for dilation and as BLACK for
+/// erosion.
+/// Opening is an erosion followed by a dilation (removing BLACK details
+/// smaller than the element); closing is a dilation followed by an
+/// erosion (filling WHITE details smaller than the element).  So the
+/// opening of img is inside img, img is inside its closing, and opening
+/// (or closing) twice gives the same image as once.
+/// They work on runs: the time grows with the number of runs of img,
+/// and hardly with the size of the element.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+
+Image ImageDilate(const Image img, uint32 w, uint32 h);
+
+Image ImageErode(const Image img, uint32 w, uint32 h);
+
+Image ImageOpen(const Image img, uint32 w, uint32 h);
+
+Image ImageClose(const Image img, uint32 w, uint32 h);
+
+/// Connected components
+
+/// A run of BLACK pixels: pixels x0..x1 of row y
+typedef struct {
+  uint32 y, x0, x1;
+} ImageRun;
+
+/// A connected component of BLACK pixels
+typedef struct {
+  uint64 area;            // number of pixels
+  uint32 x0, y0, x1, y1;  // bounding box: pixels x0..x1 of rows y0..y1
+  uint32 first_run;       // its runs: runs[first_run..first_run+num_runs-1]
+  uint32 num_runs;
+} ImageComponent;
+
+/// The connected components of an image (see ImageLabelComponents)
+typedef struct {
+  uint32 num_components;
+  ImageComponent* components;  // in the order of their first pixel
+  uint32 num_runs;
+  ImageRun* runs;              // the runs of each component, in row order
+} ImageLabels;
+
+/// Label the connected components of the BLACK pixels of img.
+///   connectivity : 4, if pixels only touch their left, right, top and
+///   bottom neighbors, or 8, if they also touch their diagonal neighbors.
+/// Works on the runs of the rows, joining the runs of adjacent rows that
+/// touch with union-find, in time nearly proportional to the number of
+/// runs (not of pixels).
+/// Components are ordered by their first pixel (top to bottom, then left
+/// to right).
+///
+/// On success, the new labels are returned.
+/// (The caller is responsible for destroying the returned labels!)
+ImageLabels* ImageLabelComponents(const Image img, int connectivity);
+
+/// Destroy the labels pointed to by (*lp).
+/// If (*lp)==NULL, no operation is performed.
+/// Ensures: (*lp)==NULL.
+void ImageLabelsDestroy(ImageLabels** lp);
+
+/// Lazy image expressions
+
+/// An ImageExpr is a DAG of boolean operations over images that is
+/// only evaluated when its image is requested (see ImageExprImage).
+/// Chains of operations are then computed in a single pass over the
+/// input images, without creating intermediate images.
+///
+/// Building an expression takes a new reference to its operands, so the
+/// caller may destroy its own references to them at any time.
+/// (The caller is responsible for destroying the returned expressions!)
+/// Expressions must only be used by one thread at a time.
+
+// Type ImageExpr is a pointer to expression objects
+typedef struct imageexpr* ImageExpr;
+
+/// Wrap an image in an expression.
+/// The expression takes ownership of img.
+ImageExpr ImageExprLeaf(Image img);
+
+ImageExpr ImageExprNEG(ImageExpr a);
+
+ImageExpr ImageExprAND(ImageExpr a, ImageExpr b);
+
+ImageExpr ImageExprOR(ImageExpr a, ImageExpr b);
+
+ImageExpr ImageExprXOR(ImageExpr a, ImageExpr b);
+
+/// Get the image of expression e, evaluating it if needed.
+/// The image belongs to the expression: it must not be destroyed,
+/// and is valid until the expression is destroyed.
+Image ImageExprImage(ImageExpr e);
+
+/// Destroy the expression pointed to by (*ep).
+/// If (*ep)==NULL, no operation is performed.
+/// Ensures: (*ep)==NULL.
+void ImageExprDestroy(ImageExpr* ep);
+
+/// Image streams
+
+/// An ImageStream produces the rows of an image one at a time, from top
+/// to bottom, reading its input files as needed.  Operations on streams
+/// only build a DAG of nodes: the rows are computed as they are saved
+/// (see ImageStreamSave), so memory use is constant, whatever the height
+/// of the images.
+///
+/// Building a stream takes a new reference to its operands, so the
+/// caller may destroy its own references to them at any time.
+/// (The caller is responsible for destroying the returned streams!)
+/// Streams must only be used by one thread at a time.
+
+// Type ImageStream is a pointer to stream objects
+typedef struct imagestream* ImageStream;
+
+/// Open a PBM BW image file as a stream.
+/// Only binary PBM files are accepted, and they must be seekable.
+ImageStream ImageStreamOpen(const char* filename);
+
+ImageStream ImageStreamNEG(ImageStream a);
+
+ImageStream ImageStreamAND(ImageStream a, ImageStream b);
+
+ImageStream ImageStreamOR(ImageStream a, ImageStream b);
+
+ImageStream ImageStreamXOR(ImageStream a, ImageStream b);
+
+/// Build the horizontal mirror of stream a (flip top-bottom).
+/// The files of a are reopened and read from the bottom up.
+ImageStream ImageStreamHorizontalMirror(ImageStream a);
+
+int ImageStreamWidth(const ImageStream s);
+
+int ImageStreamHeight(const ImageStream s);
+
+/// Save the rows of stream s to PBM BW image file, as they are produced.
+/// On success, returns nonzero.
+/// On failure, returns 0, and
+/// a partial and invalid file may be left in the system.
+int ImageStreamSave(ImageStream s, const char* filename);
+
+/// Destroy the stream pointed to by (*sp).
+/// If (*sp)==NULL, no operation is performed.
+/// Ensures: (*sp)==NULL.
+void ImageStreamDestroy(ImageStream* sp);
+
 #endif
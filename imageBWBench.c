@@ -0,0 +1,465 @@
+// imageBWBench - Benchmarks of the imageBW module.
+//
+// This program is an example use of the imageBW module,
+// a programming project for the course AED, DETI / UA.PT
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+//
+// The AED Team <jmadeira@ua.pt, jmr@ua.pt, ...>
+// 2024
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "imageBW.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageBWBench [-o FILE] [-s SIZES] [-t THREADS] [-r REPS] [-w WARMUPS] [-q]\n"
+    "  Time every image operation on square images of each size and pattern,\n"
+    "  with each number of threads, and write one CSV line per case.\n"
+    "\n"
+    "  -o FILE     Write the results to FILE (default: stdout).\n"
+    "  -s SIZES    Comma-separated image sizes (default: 500,2000).\n"
+    "  -t THREADS  Comma-separated thread counts (default: 1,4).\n"
+    "  -r REPS     Timed repetitions of each case (default: 7).\n"
+    "  -w WARMUPS  Untimed repetitions before those (default: 1).\n"
+    "  -q          Quick run: -s 500 -t 1 -r 3 -w 1.\n"
+    "\n"
+    "PATTERNS: blank, text (a few short runs per row, in text lines),\n"
+    "  chess1, chess4, chess20, chess100 (chessboards with those edges),\n"
+    "  random (each pixel BLACK with probability 1/2).\n"
+    "\n"
+    "CSV COLUMNS: op, pattern, size, threads, reps, median and p95 wall\n"
+    "  time (s), pixels/s and runs/s of the operands at the median time.\n"
+    "  (ImageGetPixels queries 100000 random pixels, cached index built.)\n"
+    "  (ImageIsEqual compares a with an equal image, loaded again, and with\n"
+    "  its negative, their hashes cached.)\n"
+    ;
+
+// Most values in a comma-separated list
+#define MAXLIST 16
+
+// Number of images used by ImageReduce and ImageAtLeast
+#define NREDUCE 4
+
+// Number of pixels queried by ImageGetPixels
+#define NPOINTS 100000
+
+static const char* PATTERNS[] = {
+  "blank", "text", "chess1", "chess4", "chess20", "chess100", "random", NULL,
+};
+
+// The inputs of a benchmark case: images of one pattern and size
+struct bench {
+  const char* pattern;
+  uint32 size;
+  uint32 edge;           // chessboard edge, or 0 if not a chessboard
+  Image a, b;            // two images of the pattern
+  Image same, neg;       // an equal image loaded apart from a, and NEG a
+  Image imgs[NREDUCE];   // images for reductions (a, b, and others)
+  ImageExpr ea, enb;     // expressions a and NEG b
+  ImagePoint* points;    // random pixels of a
+  ImagePoint* sorted;    // the same, sorted by row and column
+  uint8* colors;         // their colors
+  unsigned long runs;    // runs in a
+  char pbm[64];          // a saved as PBM
+  char rle[64];          // a saved in the native format
+  char out[64];          // for the files saved by the operations
+};
+
+// A benchmark operation: returns the image it made, to be destroyed
+// outside of the timed region (or NULL)
+typedef Image BenchOp(const struct bench* b);
+
+// Fill row y of a pattern image, as PBM bytes, with a simple generator
+// (the same seed gives the same image).  Returns the number of runs.
+static unsigned long PatternRow(const struct bench* b, uint32 y,
+                                unsigned* seed, uint8* bytes) {
+  uint32 w = b->size;
+  uint32 nbytes = (w + 7) / 8;
+  memset(bytes, 0, nbytes);
+  if (b->edge > 0) {
+    for (uint32 x = 0; x < w; x++) {
+      if (((x / b->edge) + (y / b->edge)) % 2 == 1) {
+        bytes[x / 8] |= 0x80 >> (x % 8);
+      }
+    }
+  } else if (strcmp(b->pattern, "random") == 0) {
+    for (uint32 k = 0; k < nbytes; k++) bytes[k] = rand_r(seed) & 0xFF;
+    if (w % 8 != 0) bytes[nbytes - 1] &= 0xFF << (8 - w % 8);
+  } else if (strcmp(b->pattern, "text") == 0 && y % 16 < 10) {
+    // Text lines 10 pixels high, with words of glyph strokes
+    for (uint32 x = rand_r(seed) % 8; x < w; x += 2 + rand_r(seed) % 6) {
+      if (rand_r(seed) % 8 == 0) x += 6;  // space between words
+      uint32 len = 1 + rand_r(seed) % 3;
+      for (uint32 k = x; k < x + len && k < w; k++) {
+        bytes[k / 8] |= 0x80 >> (k % 8);
+      }
+      x += len;
+    }
+  }
+  // Count the runs
+  unsigned long runs = 1;
+  for (uint32 x = 1; x < w; x++) {
+    uint8 p0 = (bytes[(x - 1) / 8] >> (7 - (x - 1) % 8)) & 1;
+    uint8 p1 = (bytes[x / 8] >> (7 - x % 8)) & 1;
+    runs += p0 != p1;
+  }
+  return runs;
+}
+
+// Write a pattern image to PBM file filename.  Returns its runs.
+static unsigned long WritePattern(const struct bench* b, unsigned seed,
+                                  const char* filename) {
+  FILE* f = fopen(filename, "wb");
+  if (f == NULL) { perror(filename); exit(2); }
+  fprintf(f, "P4\n%u %u\n", b->size, b->size);
+  uint32 nbytes = (b->size + 7) / 8;
+  uint8* bytes = malloc(nbytes);
+  assert(bytes != NULL);
+  unsigned long runs = 0;
+  for (uint32 y = 0; y < b->size; y++) {
+    runs += PatternRow(b, y, &seed, bytes);
+    fwrite(bytes, 1, nbytes, f);
+  }
+  free(bytes);
+  if (fclose(f) != 0) { perror(filename); exit(2); }
+  return runs;
+}
+
+// Copy of an image (for lazy expressions, which own their leaves)
+static Image Copy(const Image img) {
+  Image neg = ImageNEG(img);
+  Image copy = ImageNEG(neg);
+  ImageDestroy(&neg);
+  return copy;
+}
+
+static int ComparePoints(const void* p, const void* q) {
+  const ImagePoint* a = p;
+  const ImagePoint* b = q;
+  if (a->y != b->y) return (a->y > b->y) - (a->y < b->y);
+  return (a->x > b->x) - (a->x < b->x);
+}
+
+// Make the input images and files of a case
+static void SetupBench(struct bench* b, const char* pattern, uint32 size) {
+  b->pattern = pattern;
+  b->size = size;
+  b->edge = 0;
+  if (strncmp(pattern, "chess", 5) == 0) b->edge = atoi(pattern + 5);
+  int pid = (int)getpid();
+  snprintf(b->pbm, sizeof(b->pbm), "/tmp/imageBWBench-%d.pbm", pid);
+  snprintf(b->rle, sizeof(b->rle), "/tmp/imageBWBench-%d.rle", pid);
+  snprintf(b->out, sizeof(b->out), "/tmp/imageBWBench-%d-out", pid);
+
+  for (int k = NREDUCE - 1; k >= 0; k--) {
+    b->runs = WritePattern(b, 1 + k, b->pbm);  // leaves a in the file
+    b->imgs[k] = ImageLoad(b->pbm);
+  }
+  b->a = b->imgs[0];
+  b->b = ImageVerticalMirror(b->imgs[1]);  // differs from a, even if regular
+  b->same = ImageLoad(b->pbm);  // its own rows, so they are all compared
+  b->neg = ImageNEG(b->a);
+  ImageHash(b->a);  // cached, as in repeated comparisons
+  ImageHash(b->same);
+  ImageHash(b->neg);
+  ImageSaveNative(b->a, b->rle);
+  b->ea = ImageExprLeaf(Copy(b->a));
+  ImageExpr eb = ImageExprLeaf(Copy(b->b));
+  b->enb = ImageExprNEG(eb);
+  ImageExprDestroy(&eb);
+
+  b->points = malloc(NPOINTS * sizeof(ImagePoint));
+  b->sorted = malloc(NPOINTS * sizeof(ImagePoint));
+  b->colors = malloc(NPOINTS);
+  assert(b->points != NULL && b->sorted != NULL && b->colors != NULL);
+  unsigned seed = size;
+  for (int k = 0; k < NPOINTS; k++) {
+    b->points[k].x = rand_r(&seed) % size;
+    b->points[k].y = rand_r(&seed) % size;
+  }
+  memcpy(b->sorted, b->points, NPOINTS * sizeof(ImagePoint));
+  qsort(b->sorted, NPOINTS, sizeof(ImagePoint), ComparePoints);
+}
+
+static void CleanupBench(struct bench* b) {
+  for (int k = 0; k < NREDUCE; k++) ImageDestroy(&b->imgs[k]);
+  ImageDestroy(&b->b);
+  ImageDestroy(&b->same);
+  ImageDestroy(&b->neg);
+  ImageExprDestroy(&b->ea);
+  ImageExprDestroy(&b->enb);
+  free(b->points);
+  free(b->sorted);
+  free(b->colors);
+  remove(b->pbm);
+  remove(b->rle);
+  remove(b->out);
+}
+
+static Image OpCreate(const struct bench* b) {
+  return ImageCreate(b->size, b->size, BLACK);
+}
+static Image OpChessboard(const struct bench* b) {
+  return ImageCreateChessboard(b->size, b->size, b->edge, BLACK);
+}
+static Image OpLoad(const struct bench* b) { return ImageLoad(b->pbm); }
+static Image OpLoadNative(const struct bench* b) { return ImageLoad(b->rle); }
+static Image OpSave(const struct bench* b) {
+  ImageSave(b->a, b->out);
+  return NULL;
+}
+static Image OpSaveNative(const struct bench* b) {
+  ImageSaveNative(b->a, b->out);
+  return NULL;
+}
+static Image OpEncodeDecode(const struct bench* b) {
+  size_t size = ImageEncode(b->a, NULL, 0);
+  void* buf = malloc(size);
+  assert(buf != NULL);
+  ImageEncode(b->a, buf, size);
+  Image img = ImageDecode(buf, size);
+  free(buf);
+  return img;
+}
+static Image OpHash(const struct bench* b) {
+  // The hash is cached in the image, so a fresh copy is hashed
+  Image img = ImageHorizontalMirror(b->a);
+  volatile uint64 hash = ImageHash(img);
+  (void)hash;
+  return img;
+}
+static Image OpIsEqual(const struct bench* b) {
+  volatile int equal = ImageIsEqual(b->a, b->same);
+  (void)equal;
+  return NULL;
+}
+static Image OpIsEqualDiffer(const struct bench* b) {
+  volatile int equal = ImageIsEqual(b->a, b->neg);
+  (void)equal;
+  return NULL;
+}
+static Image OpGetPixels(const struct bench* b) {
+  ImageGetPixels(b->a, b->points, NPOINTS, b->colors);
+  return NULL;
+}
+static Image OpGetPixelsSorted(const struct bench* b) {
+  ImageGetPixels(b->a, b->sorted, NPOINTS, b->colors);
+  return NULL;
+}
+static Image OpLabel4(const struct bench* b) {
+  ImageLabels* labels = ImageLabelComponents(b->a, 4);
+  ImageLabelsDestroy(&labels);
+  return NULL;
+}
+static Image OpLabel8(const struct bench* b) {
+  ImageLabels* labels = ImageLabelComponents(b->a, 8);
+  ImageLabelsDestroy(&labels);
+  return NULL;
+}
+static Image OpNEG(const struct bench* b) { return ImageNEG(b->a); }
+static Image OpAND(const struct bench* b) { return ImageAND(b->a, b->b); }
+static Image OpOR(const struct bench* b) { return ImageOR(b->a, b->b); }
+static Image OpXOR(const struct bench* b) { return ImageXOR(b->a, b->b); }
+static Image OpReduce(const struct bench* b) {
+  return ImageReduce(REDUCE_XOR, b->imgs, NREDUCE);
+}
+static Image OpAtLeast(const struct bench* b) {
+  return ImageAtLeast(b->imgs, NREDUCE, NREDUCE / 2);
+}
+static Image OpHMirror(const struct bench* b) {
+  return ImageHorizontalMirror(b->a);
+}
+static Image OpVMirror(const struct bench* b) {
+  return ImageVerticalMirror(b->a);
+}
+static Image OpRepB(const struct bench* b) {
+  return ImageReplicateAtBottom(b->a, b->b);
+}
+static Image OpRepR(const struct bench* b) {
+  return ImageReplicateAtRight(b->a, b->b);
+}
+static Image OpDilate(const struct bench* b) {
+  return ImageDilate(b->a, 5, 5);
+}
+static Image OpDilateLarge(const struct bench* b) {
+  return ImageDilate(b->a, 51, 51);
+}
+static Image OpErode(const struct bench* b) { return ImageErode(b->a, 5, 5); }
+static Image OpOpen(const struct bench* b) { return ImageOpen(b->a, 5, 5); }
+static Image OpClose(const struct bench* b) { return ImageClose(b->a, 5, 5); }
+static Image OpExpr(const struct bench* b) {
+  // (a AND NEG b) XOR a, in a single pass (the image belongs to e)
+  ImageExpr t = ImageExprAND(b->ea, b->enb);
+  ImageExpr e = ImageExprXOR(t, b->ea);
+  ImageExprImage(e);
+  ImageExprDestroy(&t);
+  ImageExprDestroy(&e);
+  return NULL;
+}
+static Image OpStream(const struct bench* b) {
+  // NEG a, from file to file
+  ImageStream a = ImageStreamOpen(b->pbm);
+  ImageStream neg = ImageStreamNEG(a);
+  ImageStreamSave(neg, b->out);
+  ImageStreamDestroy(&a);
+  ImageStreamDestroy(&neg);
+  return NULL;
+}
+
+// The operations, with the number of pattern images they read
+// (the creation operations make images of their own pattern)
+static const struct {
+  const char* name;
+  BenchOp* op;
+  int inputs;
+} OPS[] = {
+  {"ImageCreate", OpCreate, 0},
+  {"ImageCreateChessboard", OpChessboard, 0},
+  {"ImageLoad", OpLoad, 1},
+  {"ImageLoad(native)", OpLoadNative, 1},
+  {"ImageSave", OpSave, 1},
+  {"ImageSaveNative", OpSaveNative, 1},
+  {"ImageEncode+Decode", OpEncodeDecode, 1},
+  {"ImageHash", OpHash, 1},
+  {"ImageIsEqual", OpIsEqual, 2},
+  {"ImageIsEqual(differ)", OpIsEqualDiffer, 2},
+  {"ImageGetPixels", OpGetPixels, 1},
+  {"ImageGetPixels(sorted)", OpGetPixelsSorted, 1},
+  {"ImageLabelComponents(4)", OpLabel4, 1},
+  {"ImageLabelComponents(8)", OpLabel8, 1},
+  {"ImageNEG", OpNEG, 1},
+  {"ImageAND", OpAND, 2},
+  {"ImageOR", OpOR, 2},
+  {"ImageXOR", OpXOR, 2},
+  {"ImageReduce", OpReduce, NREDUCE},
+  {"ImageAtLeast", OpAtLeast, NREDUCE},
+  {"ImageHorizontalMirror", OpHMirror, 1},
+  {"ImageVerticalMirror", OpVMirror, 1},
+  {"ImageReplicateAtBottom", OpRepB, 2},
+  {"ImageReplicateAtRight", OpRepR, 2},
+  {"ImageDilate(5x5)", OpDilate, 1},
+  {"ImageDilate(51x51)", OpDilateLarge, 1},
+  {"ImageErode(5x5)", OpErode, 1},
+  {"ImageOpen(5x5)", OpOpen, 1},
+  {"ImageClose(5x5)", OpClose, 1},
+  {"ImageExprImage", OpExpr, 2},
+  {"ImageStreamSave", OpStream, 1},
+  {NULL, NULL, 0},
+};
+
+// Parse a comma-separated list of positive numbers into list.
+// Returns the number of values, or 0 if invalid.
+static int ParseList(const char* s, uint32* list) {
+  int n = 0;
+  while (n < MAXLIST) {
+    char* end;
+    long v = strtol(s, &end, 10);
+    if (end == s || v <= 0) return 0;
+    list[n++] = (uint32)v;
+    if (*end == '\0') return n;
+    if (*end != ',') return 0;
+    s = end + 1;
+  }
+  return 0;
+}
+
+static int CompareDoubles(const void* p, const void* q) {
+  double x = *(const double*)p;
+  double y = *(const double*)q;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char* argv[]) {
+  uint32 sizes[MAXLIST] = {500, 2000};
+  int num_sizes = 2;
+  uint32 threads[MAXLIST] = {1, 4};
+  int num_threads = 2;
+  int reps = 7;
+  int warmups = 1;
+  const char* output = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "o:s:t:r:w:q")) != -1) {
+    switch (opt) {
+      case 'o': output = optarg; break;
+      case 's': num_sizes = ParseList(optarg, sizes); break;
+      case 't': num_threads = ParseList(optarg, threads); break;
+      case 'r': reps = atoi(optarg); break;
+      case 'w': warmups = atoi(optarg); break;
+      case 'q':
+        sizes[0] = 500; num_sizes = 1;
+        threads[0] = 1; num_threads = 1;
+        reps = 3; warmups = 1;
+        break;
+      default: num_sizes = 0;
+    }
+  }
+  if (optind < argc || num_sizes == 0 || num_threads == 0 || reps < 1 ||
+      warmups < 0) {
+    fprintf(stderr, "\n%s", USAGE);
+    return 1;
+  }
+
+  FILE* csv = stdout;
+  if (output != NULL && (csv = fopen(output, "w")) == NULL) {
+    perror(output);
+    return 2;
+  }
+
+  ImageInit();
+
+  fprintf(csv, "op,pattern,size,threads,reps,median_s,p95_s,"
+          "pixels_per_s,runs_per_s\n");
+  double* times = malloc(reps * sizeof(double));
+  assert(times != NULL);
+  for (int s = 0; s < num_sizes; s++) {
+    for (int p = 0; PATTERNS[p] != NULL; p++) {
+      const char* pattern = PATTERNS[p];
+      if (strncmp(pattern, "chess", 5) == 0 &&
+          sizes[s] % atoi(pattern + 5) != 0) {
+        continue;  // not a size of that chessboard
+      }
+      struct bench b;
+      SetupBench(&b, pattern, sizes[s]);
+      for (int t = 0; t < num_threads; t++) {
+        ImageSetThreads((int)threads[t]);
+        for (int o = 0; OPS[o].name != NULL; o++) {
+          // The creation operations only run for their own pattern
+          if (OPS[o].op == OpCreate && strcmp(b.pattern, "blank") != 0) continue;
+          if (OPS[o].op == OpChessboard && b.edge == 0) continue;
+
+          for (int r = -warmups; r < reps; r++) {
+            double start = wall_time();
+            Image img = OPS[o].op(&b);
+            double time = wall_time() - start;
+            ImageDestroy(&img);
+            if (r >= 0) times[r] = time;
+          }
+          qsort(times, reps, sizeof(double), CompareDoubles);
+          double median = times[reps / 2];
+          double p95 = times[(95 * reps + 99) / 100 - 1];
+          int inputs = OPS[o].inputs > 0 ? OPS[o].inputs : 1;
+          double pixels = (double)inputs * b.size * b.size;
+          double runs = (double)inputs * b.runs;
+          fprintf(csv, "%s,%s,%u,%u,%d,%.9f,%.9f,%.6g,%.6g\n", OPS[o].name,
+                  b.pattern, b.size, threads[t], reps, median, p95,
+                  pixels / median, runs / median);
+          fflush(csv);
+        }
+      }
+      CleanupBench(&b);
+    }
+  }
+  free(times);
+  ImageSetThreads(1);
+  if (csv != stdout) fclose(csv);
+  return 0;
+}
@@ -11,13 +11,1250 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "imageBW.h"
 #include "instrumentation.h"
 
+/// Checks
+
+// Each test checks the results of some operations against simple
+// pixel-by-pixel versions of them.  Images are made from pixel arrays
+// (pix[y * width + x]) through a PBM file, and read back pixel by pixel.
+
+static int failures = 0;  // checks failed
+
+/// Check a condition, reporting what failed
+#define CHECK(cond)                                                    \
+  do {                                                                 \
+    if (!(cond)) {                                                     \
+      printf("  %s:%d: falhou: %s\n", __FILE__, __LINE__, #cond);     \
+      failures++;                                                      \
+    }                                                                  \
+  } while (0)
+
+/// Run a test, and report if it passed
+static void RunTest(const char* name, void (*test)(void)) {
+  int before = failures;
+  test();
+  printf("Teste %s: %s\n", name, (failures == before) ? "Passou!" : "Fail!");
+}
+
+/// Get the name of a temporary file of this process, with extension ext
+static const char* TempFile(const char* ext) {
+  static char name[64];
+  snprintf(name, sizeof(name), "/tmp/imageBWTest-%d.%s", (int)getpid(), ext);
+  return name;
+}
+
+/// Allocate pixels for a width x height image (all WHITE)
+static uint8* NewPixels(uint32 width, uint32 height) {
+  uint8* pix = calloc((size_t)width * height, 1);
+  assert(pix != NULL);
+  return pix;
+}
+
+/// Fill pixels with a pattern: with probability density/256 each pixel,
+/// or, if blocks, each run of a random length, is BLACK.
+/// Random pixels make bitmap rows, and blocks RLE rows.
+static void FillPixels(uint8* pix, uint32 width, uint32 height,
+                       unsigned density, int blocks, unsigned* seed) {
+  for (uint32 y = 0; y < height; y++) {
+    uint8 color = WHITE;
+    uint32 left = 0;
+    for (uint32 x = 0; x < width; x++) {
+      if (!blocks) {
+        color = (unsigned)(rand_r(seed) % 256) < density;
+      } else if (left-- == 0) {
+        color = (unsigned)(rand_r(seed) % 256) < density;
+        left = rand_r(seed) % 40;
+      }
+      pix[(size_t)y * width + x] = color;
+    }
+  }
+}
+
+/// Make an image from pixels, through a PBM file
+static Image FromPixels(const uint8* pix, uint32 width, uint32 height) {
+  const char* name = TempFile("pbm");
+  FILE* f = fopen(name, "wb");
+  assert(f != NULL);
+  fprintf(f, "P4\n%u %u\n", width, height);
+  for (uint32 y = 0; y < height; y++) {
+    for (uint32 x = 0; x < width; x += 8) {
+      uint8 byte = 0;
+      for (uint32 k = 0; k < 8 && x + k < width; k++) {
+        byte |= pix[(size_t)y * width + x + k] << (7 - k);
+      }
+      fputc(byte, f);
+    }
+  }
+  fclose(f);
+  Image img = ImageLoad(name);
+  remove(name);
+  return img;
+}
+
+/// Check that img has the given size and pixels
+static int HasPixels(const Image img, const uint8* pix, uint32 width,
+                     uint32 height) {
+  if ((uint32)ImageWidth(img) != width || (uint32)ImageHeight(img) != height) {
+    return 0;
+  }
+  for (uint32 y = 0; y < height; y++) {
+    for (uint32 x = 0; x < width; x++) {
+      if (ImageGetPixel(img, x, y) != pix[(size_t)y * width + x]) return 0;
+    }
+  }
+  return 1;
+}
+
+/// Morphology
+
+/// Dilate (color BLACK) or erode (color WHITE) pixels with a w x h
+/// element, pixel by pixel: a pixel gets color if the window of its
+/// element has a pixel of that color (pixels outside do not count)
+static uint8* MorphPixels(const uint8* pix, uint32 width, uint32 height,
+                          uint32 w, uint32 h, uint8 color) {
+  // Extents of the window before the pixel (see imageBW.h)
+  int64_t left = (color == BLACK) ? w - 1 - w / 2 : w / 2;
+  int64_t above = (color == BLACK) ? h - 1 - h / 2 : h / 2;
+  uint8* out = NewPixels(width, height);
+  for (int64_t y = 0; y < height; y++) {
+    for (int64_t x = 0; x < width; x++) {
+      uint8 value = color ^ 1;
+      for (int64_t v = y - above; v < y - above + h; v++) {
+        for (int64_t u = x - left; u < x - left + w; u++) {
+          if (v >= 0 && v < height && u >= 0 && u < width &&
+              pix[v * width + u] == color) {
+            value = color;
+          }
+        }
+      }
+      out[y * width + x] = value;
+    }
+  }
+  return out;
+}
+
+static void TestMorphology(void) {
+  // A BLACK pixel grows by the element reflected about its origin
+  uint8 one[8] = {0, 0, 0, 1, 0, 0, 0, 0};
+  uint8 grown2[8] = {0, 0, 1, 1, 0, 0, 0, 0};
+  uint8 grown3[8] = {0, 0, 1, 1, 1, 0, 0, 0};
+  Image img = FromPixels(one, 8, 1);
+  Image out = ImageDilate(img, 2, 1);
+  CHECK(HasPixels(out, grown2, 8, 1));
+  ImageDestroy(&out);
+  out = ImageDilate(img, 3, 1);
+  CHECK(HasPixels(out, grown3, 8, 1));
+  ImageDestroy(&out);
+  ImageDestroy(&img);
+
+  // Borders: WHITE outside for dilation, BLACK outside for erosion
+  uint8 corner[9] = {1, 0, 0, 0, 0, 0, 0, 0, 0};
+  uint8 corner3[9] = {1, 1, 0, 1, 1, 0, 0, 0, 0};
+  img = FromPixels(corner, 3, 3);
+  out = ImageDilate(img, 3, 3);
+  CHECK(HasPixels(out, corner3, 3, 3));
+  ImageDestroy(&out);
+  ImageDestroy(&img);
+  img = ImageCreate(5, 4, BLACK);
+  out = ImageErode(img, 4, 7);
+  CHECK(ImageIsEqual(out, img));
+  ImageDestroy(&out);
+  ImageDestroy(&img);
+
+  // Even and odd elements, some larger than the image, on bitmap rows
+  // (random pixels) and RLE rows (blocks)
+  static const uint32 sizes[][2] = {{1, 1}, {2, 1}, {1, 2}, {2, 2}, {3, 3},
+                                    {4, 3}, {3, 4}, {5, 2}, {6, 6}, {70, 3},
+                                    {2, 40}, {200, 50}};
+  unsigned seed = 25;
+  for (int blocks = 0; blocks <= 1; blocks++) {
+    uint32 width = 150;
+    uint32 height = 30;
+    uint8* pix = NewPixels(width, height);
+    FillPixels(pix, width, height, blocks ? 128 : 100, blocks, &seed);
+    img = FromPixels(pix, width, height);
+    for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+      uint32 w = sizes[k][0];
+      uint32 h = sizes[k][1];
+      uint8* dilated = MorphPixels(pix, width, height, w, h, BLACK);
+      uint8* eroded = MorphPixels(pix, width, height, w, h, WHITE);
+      uint8* opened = MorphPixels(eroded, width, height, w, h, BLACK);
+      uint8* closed = MorphPixels(dilated, width, height, w, h, WHITE);
+      Image d = ImageDilate(img, w, h);
+      Image e = ImageErode(img, w, h);
+      Image o = ImageOpen(img, w, h);
+      Image c = ImageClose(img, w, h);
+      CHECK(HasPixels(d, dilated, width, height));
+      CHECK(HasPixels(e, eroded, width, height));
+      CHECK(HasPixels(o, opened, width, height));
+      CHECK(HasPixels(c, closed, width, height));
+
+      // Opening is inside img, which is inside closing
+      Image t = ImageAND(o, img);
+      CHECK(ImageIsEqual(t, o));
+      ImageDestroy(&t);
+      t = ImageOR(c, img);
+      CHECK(ImageIsEqual(t, c));
+      ImageDestroy(&t);
+      // and both are idempotent
+      t = ImageOpen(o, w, h);
+      CHECK(ImageIsEqual(t, o));
+      ImageDestroy(&t);
+      t = ImageClose(c, w, h);
+      CHECK(ImageIsEqual(t, c));
+      ImageDestroy(&t);
+
+      ImageDestroy(&d);
+      ImageDestroy(&e);
+      ImageDestroy(&o);
+      ImageDestroy(&c);
+      free(dilated);
+      free(eroded);
+      free(opened);
+      free(closed);
+    }
+    ImageDestroy(&img);
+    free(pix);
+  }
+}
+
+/// Reductions
+
+/// Fold imgs[0..n-1] pairwise with op (ImageAND, ImageOR or ImageXOR)
+static Image Fold(Image (*op)(const Image, const Image), const Image imgs[],
+                  uint32 n) {
+  Image acc = ImageOR(imgs[0], imgs[0]);  // a copy
+  for (uint32 j = 1; j < n; j++) {
+    Image next = op(acc, imgs[j]);
+    ImageDestroy(&acc);
+    acc = next;
+  }
+  return acc;
+}
+
+static void TestReduce(void) {
+  enum { N = 5, WIDTH = 130, HEIGHT = 20 };
+  uint8* pix[N];
+  Image imgs[N];
+  unsigned seed = 13;
+  for (int j = 0; j < N; j++) {
+    // Bitmap and RLE rows, in each image
+    pix[j] = NewPixels(WIDTH, HEIGHT);
+    FillPixels(pix[j], WIDTH, HEIGHT / 2, 90 + 20 * j, 0, &seed);
+    FillPixels(pix[j] + WIDTH * (HEIGHT / 2), WIDTH, HEIGHT / 2, 128, 1,
+               &seed);
+    imgs[j] = FromPixels(pix[j], WIDTH, HEIGHT);
+  }
+  Image white = ImageCreate(WIDTH, HEIGHT, WHITE);
+
+  for (uint32 n = 1; n <= N; n++) {
+    Image all = Fold(ImageAND, imgs, n);
+    Image any = Fold(ImageOR, imgs, n);
+    Image odd = Fold(ImageXOR, imgs, n);
+    Image out = ImageReduce(REDUCE_AND, imgs, n);
+    CHECK(ImageIsEqual(out, all));
+    ImageDestroy(&out);
+    out = ImageReduce(REDUCE_OR, imgs, n);
+    CHECK(ImageIsEqual(out, any));
+    ImageDestroy(&out);
+    out = ImageReduce(REDUCE_XOR, imgs, n);
+    CHECK(ImageIsEqual(out, odd));
+    ImageDestroy(&out);
+
+    // At least 1 is OR, at least n is AND, more than n is none
+    out = ImageAtLeast(imgs, n, 1);
+    CHECK(ImageIsEqual(out, any));
+    ImageDestroy(&out);
+    out = ImageAtLeast(imgs, n, n);
+    CHECK(ImageIsEqual(out, all));
+    ImageDestroy(&out);
+    out = ImageAtLeast(imgs, n, n + 1);
+    CHECK(ImageIsEqual(out, white));
+    ImageDestroy(&out);
+
+    // A majority, counted pixel by pixel
+    uint32 k = n / 2 + 1;
+    uint8* atleast = NewPixels(WIDTH, HEIGHT);
+    for (size_t p = 0; p < (size_t)WIDTH * HEIGHT; p++) {
+      uint32 count = 0;
+      for (uint32 j = 0; j < n; j++) count += pix[j][p];
+      atleast[p] = count >= k;
+    }
+    out = ImageAtLeast(imgs, n, k);
+    CHECK(HasPixels(out, atleast, WIDTH, HEIGHT));
+    ImageDestroy(&out);
+    free(atleast);
+
+    ImageDestroy(&all);
+    ImageDestroy(&any);
+    ImageDestroy(&odd);
+  }
+
+  ImageDestroy(&white);
+  for (int j = 0; j < N; j++) {
+    ImageDestroy(&imgs[j]);
+    free(pix[j]);
+  }
+}
+
+/// Native format
+
+/// Check if decoding buf (size bytes) fails: the module exits on invalid
+/// data, so it is decoded in a child process
+static int DecodeFails(const void* buf, size_t size) {
+  fflush(stdout);
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    freopen("/dev/null", "w", stderr);  // the error message
+    Image img = ImageDecode(buf, size);
+    ImageDestroy(&img);
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) && WEXITSTATUS(status) != 0;
+}
+
+/// Make the native encoding of an image of one row of width pixels, with
+/// n elements of run data (16-bit runs, or bitmap words as 4 elements
+/// each), in the given container (0 RLE, 1 bitmap) and first color, as
+/// laid out by ImageEncode.  Returns its size.
+static size_t EncodeRow(uint8* buf, uint32 width, uint8 kind, uint8 color,
+                        const void* elems, uint32 n) {
+  struct {
+    char magic[8];
+    uint32 byte_order, version, width, height;
+    uint64 num_elems;
+  } header = {"BWRLE", 0x01020304, 1, width, 1, n};
+  struct {
+    uint64 offset;
+    uint32 size;
+    uint8 color, kind;
+    uint16 reserved;
+  } row = {0, (kind == 1) ? n / 4 : n, color, kind, 0};
+  memcpy(buf, &header, sizeof(header));
+  memcpy(buf + sizeof(header), &row, sizeof(row));
+  memcpy(buf + sizeof(header) + sizeof(row), elems, n * sizeof(uint16));
+  return sizeof(header) + sizeof(row) + n * sizeof(uint16);
+}
+
+static void TestNative(void) {
+  // Bitmap rows, RLE rows and rows shared within the image
+  enum { WIDTH = 300, HEIGHT = 24 };
+  uint8* pix = NewPixels(WIDTH, HEIGHT);
+  unsigned seed = 17;
+  FillPixels(pix, WIDTH, HEIGHT / 3, 128, 0, &seed);
+  FillPixels(pix + WIDTH * (HEIGHT / 3), WIDTH, HEIGHT / 3, 128, 1, &seed);
+  Image img = FromPixels(pix, WIDTH, HEIGHT);
+  Image chess = ImageCreateChessboard(WIDTH, HEIGHT, 4, BLACK);
+  Image images[] = {img, chess};
+
+  for (int j = 0; j < 2; j++) {
+    size_t size = ImageEncode(images[j], NULL, 0);
+    uint8* buf = malloc(size + 1);
+    assert(buf != NULL);
+    // Too small a buffer is left untouched
+    memset(buf, 0xAA, size + 1);
+    CHECK(ImageEncode(images[j], buf, size - 1) == size);
+    CHECK(buf[0] == 0xAA && buf[size - 2] == 0xAA);
+    CHECK(ImageEncode(images[j], buf, size + 1) == size);
+    CHECK(buf[size] == 0xAA);
+
+    Image out = ImageDecode(buf, size);
+    CHECK(ImageIsEqual(out, images[j]));
+    ImageDestroy(&out);
+
+    // Native files are mapped by ImageLoad
+    const char* name = TempFile("rle");
+    CHECK(ImageSaveNative(images[j], name));
+    out = ImageLoad(name);
+    remove(name);
+    CHECK(ImageIsEqual(out, images[j]));
+    ImageDestroy(&out);
+
+    // Truncated and corrupted encodings are rejected
+    CHECK(DecodeFails(buf, 16));
+    CHECK(DecodeFails(buf, size - 1));
+    buf[0] ^= 1;  // the magic
+    CHECK(DecodeFails(buf, size));
+    buf[0] ^= 1;
+    CHECK(!DecodeFails(buf, size));
+    // The row index follows a 32-byte header: make row 0 point past the
+    // run data
+    memset(buf + 32, 0xFF, 8);
+    CHECK(DecodeFails(buf, size));
+    free(buf);
+  }
+
+  ImageDestroy(&img);
+  ImageDestroy(&chess);
+  free(pix);
+
+  // Run data that is not canonical is rejected (each valid row is changed
+  // in one way): RLE rows of 100000 and 200 pixels...
+  uint8 buf[256];
+  static const uint16 long_run[] = {65535, 0, 34465};
+  CHECK(!DecodeFails(buf, EncodeRow(buf, 100000, 0, WHITE, long_run, 3)));
+  static const uint16 short_sum[] = {65535, 0, 34464};
+  CHECK(DecodeFails(buf, EncodeRow(buf, 100000, 0, WHITE, short_sum, 3)));
+  static const uint16 long_sum[] = {65535, 0, 34466};
+  CHECK(DecodeFails(buf, EncodeRow(buf, 100000, 0, WHITE, long_sum, 3)));
+  static const uint16 no_rest[] = {34465, 65535, 0};
+  CHECK(DecodeFails(buf, EncodeRow(buf, 100000, 0, WHITE, no_rest, 3)));
+  static const uint16 empty_rest[] = {65535, 0, 0, 34465};
+  CHECK(DecodeFails(buf, EncodeRow(buf, 100000, 0, WHITE, empty_rest, 4)));
+  static const uint16 short_piece[] = {60000, 0, 40000};
+  CHECK(DecodeFails(buf, EncodeRow(buf, 100000, 0, WHITE, short_piece, 3)));
+  static const uint16 empty_run[] = {0, 200};
+  CHECK(DecodeFails(buf, EncodeRow(buf, 200, 0, WHITE, empty_run, 2)));
+  // ... RLE rows with as many runs as a bitmap row of 200 pixels takes
+  // (16 elements, 4 words), or more ...
+  uint16 runs[20];
+  for (int k = 0; k < 20; k++) runs[k] = 10;
+  CHECK(DecodeFails(buf, EncodeRow(buf, 200, 0, BLACK, runs, 20)));
+  for (int k = 0; k < 15; k++) runs[k] = 12;
+  runs[15] = 20;
+  CHECK(!DecodeFails(buf, EncodeRow(buf, 200, 0, BLACK, runs, 16)));
+  // ... and bitmap rows of 200 pixels (4 words, 8 pixels in the last)
+  uint64 words[4] = {0xAAAAAAAAAAAAAAAA, 0xAAAAAAAAAAAAAAAA,
+                     0xAAAAAAAAAAAAAAAA, 0xAA00000000000000};
+  CHECK(!DecodeFails(buf, EncodeRow(buf, 200, 1, BLACK, words, 16)));
+  CHECK(DecodeFails(buf, EncodeRow(buf, 200, 1, WHITE, words, 16)));
+  words[3] |= 1;  // a padding bit
+  CHECK(DecodeFails(buf, EncodeRow(buf, 200, 1, BLACK, words, 16)));
+  memset(words, 0, sizeof(words));  // a single run
+  CHECK(DecodeFails(buf, EncodeRow(buf, 200, 1, WHITE, words, 16)));
+}
+
+/// Run data
+
+/// Fill the pixels of a row with runs of the given lengths (0-terminated),
+/// alternating colors from WHITE
+static void FillRuns(uint8* row, const uint32 runs[]) {
+  uint8 color = WHITE;
+  for (int k = 0; runs[k] != 0; k++) {
+    memset(row, color, runs[k]);
+    row += runs[k];
+    color ^= 1;
+  }
+}
+
+/// Check that img has the given pixels, in canonical rows: its native
+/// encoding (see EncodeRow) has each row as the runs of its pixels, runs
+/// longer than 65535 split as 65535, 0, rest, or else as bitmap words if
+/// they would take fewer bytes (more runs than 4 per word)
+static int HasRuns(const Image img, const uint8* pix, uint32 width,
+                   uint32 height) {
+  if (!HasPixels(img, pix, width, height)) return 0;
+  size_t size = ImageEncode(img, NULL, 0);
+  uint8* buf = malloc(size);
+  uint16* elems = malloc(width * sizeof(uint16));  // enough for any row
+  assert(buf != NULL && elems != NULL);
+  ImageEncode(img, buf, size);
+  uint32 nwords = (width + 63) / 64;
+  int ok = 1;
+  for (uint32 y = 0; y < height; y++) {
+    // The expected runs
+    const uint8* row = pix + (size_t)y * width;
+    uint32 n = 0, num_runs = 0;
+    for (uint32 x = 0; x < width; num_runs++) {
+      uint32 run = 1;
+      while (x + run < width && row[x + run] == row[x]) run++;
+      x += run;
+      for (; run > 65535; run -= 65535) {
+        elems[n++] = 65535;
+        elems[n++] = 0;
+      }
+      elems[n++] = run;
+    }
+    // The row index follows a 32-byte header, 16 bytes per row
+    const uint8* index = buf + 32 + 16 * (size_t)y;
+    uint64 offset;
+    uint32 row_size;
+    memcpy(&offset, index, sizeof(offset));
+    memcpy(&row_size, index + 8, sizeof(row_size));
+    const uint16* data = (const uint16*)(buf + 32 + 16 * (size_t)height);
+    ok = ok && index[12] == row[0];
+    if (num_runs > 4 * nwords) {
+      ok = ok && index[13] == 1 && row_size == nwords;
+    } else {
+      ok = ok && index[13] == 0 && row_size == n &&
+           memcmp(data + offset, elems, n * sizeof(uint16)) == 0;
+    }
+  }
+  free(elems);
+  free(buf);
+  return ok;
+}
+
+static void TestRuns(void) {
+  // Runs around 65535 pixels, and multiples of it, in rows of 4 x 65535
+  enum { WIDTH = 4 * 65535 };
+  static const uint32 runs[][4] = {
+      {WIDTH},
+      {65535, 3 * 65535},
+      {65534, 1, 3 * 65535},
+      {65536, 65535, 2 * 65535 - 1},
+      {2 * 65535, 2 * 65535},
+      {2 * 65535 + 1, 65535, 65534},
+      {1, WIDTH - 2, 1},
+  };
+  enum { HEIGHT = sizeof(runs) / sizeof(runs[0]) };
+  uint8* pix = NewPixels(WIDTH, HEIGHT);
+  uint8* neg = NewPixels(WIDTH, HEIGHT);
+  uint8* twice = NewPixels(2 * WIDTH, HEIGHT);
+  for (uint32 y = 0; y < HEIGHT; y++) {
+    FillRuns(pix + (size_t)y * WIDTH, runs[y]);
+    for (uint32 x = 0; x < WIDTH; x++) {
+      uint8 value = pix[(size_t)y * WIDTH + x];
+      neg[(size_t)y * WIDTH + x] = value ^ 1;
+      // Runs at the ends of the rows join across the middle
+      twice[(size_t)y * 2 * WIDTH + x] = value;
+      twice[(size_t)y * 2 * WIDTH + WIDTH + x] = value;
+    }
+  }
+  Image img = FromPixels(pix, WIDTH, HEIGHT);
+  CHECK(HasRuns(img, pix, WIDTH, HEIGHT));
+  Image out = ImageNEG(img);
+  CHECK(HasRuns(out, neg, WIDTH, HEIGHT));
+  Image both = ImageOR(img, out);
+  memset(neg, BLACK, (size_t)WIDTH * HEIGHT);
+  CHECK(HasRuns(both, neg, WIDTH, HEIGHT));
+  ImageDestroy(&both);
+  ImageDestroy(&out);
+  out = ImageReplicateAtRight(img, img);
+  CHECK(HasRuns(out, twice, 2 * WIDTH, HEIGHT));
+  ImageDestroy(&out);
+  ImageDestroy(&img);
+  free(twice);
+  free(neg);
+  free(pix);
+
+  // Rows of 200 pixels (4 words, for 16 runs) with 11 to 20 runs, as
+  // built, and as the result of operations that join or split runs
+  enum { SMALL = 200, ROWS = 10 };
+  uint8* a = NewPixels(SMALL, ROWS);
+  uint8* b = NewPixels(SMALL, ROWS);
+  uint8* c = NewPixels(SMALL, ROWS);
+  for (uint32 y = 0; y < ROWS; y++) {
+    uint32 row_runs[24];
+    uint32 k = 0;
+    for (; k < 10 + y; k++) row_runs[k] = 10;
+    row_runs[k++] = SMALL - 10 * (10 + y);
+    row_runs[k] = 0;
+    FillRuns(a + y * SMALL, row_runs);
+    // b joins the first 3 runs of a, and splits its last one in 3
+    memcpy(b + y * SMALL, a + y * SMALL, SMALL);
+    memset(b + y * SMALL + 10, WHITE, 10);
+    b[y * SMALL + SMALL - 5] ^= 1;
+  }
+  Image ia = FromPixels(a, SMALL, ROWS);
+  Image ib = FromPixels(b, SMALL, ROWS);
+  CHECK(HasRuns(ia, a, SMALL, ROWS));
+  CHECK(HasRuns(ib, b, SMALL, ROWS));
+  Image (*ops[])(const Image, const Image) = {ImageAND, ImageOR, ImageXOR};
+  for (int op = 0; op < 3; op++) {
+    for (uint32 i = 0; i < SMALL * ROWS; i++) {
+      c[i] = (op == 0) ? (a[i] & b[i]) : (op == 1) ? (a[i] | b[i])
+                                                   : (a[i] ^ b[i]);
+    }
+    out = ops[op](ia, ib);
+    CHECK(HasRuns(out, c, SMALL, ROWS));
+    ImageDestroy(&out);
+  }
+  for (uint32 i = 0; i < SMALL * ROWS; i++) c[i] = a[i] ^ 1;
+  out = ImageNEG(ia);
+  CHECK(HasRuns(out, c, SMALL, ROWS));
+  ImageDestroy(&out);
+  ImageDestroy(&ia);
+  ImageDestroy(&ib);
+  free(a);
+  free(b);
+  free(c);
+}
+
+/// Pixel queries
+
+/// Compare qsort'ed points along rows
+static int ComparePoints(const void* p1, const void* p2) {
+  const ImagePoint* a = p1;
+  const ImagePoint* b = p2;
+  if (a->y != b->y) return (a->y < b->y) ? -1 : 1;
+  return (a->x > b->x) - (a->x < b->x);
+}
+
+static void TestPixels(void) {
+  // Rows of 200000 pixels, so long runs are escaped (over MAX_RUN = 65535)
+  enum { WIDTH = 200000, HEIGHT = 8, NUM = 20000 };
+  uint8* pix = NewPixels(WIDTH, HEIGHT);
+  unsigned seed = 23;
+  // Row 0 is all WHITE; row 1 has a BLACK run 65534..131071, and row 2
+  // WHITE runs 0..65535 and 65537..WIDTH-1, with escapes around them
+  for (uint32 x = 65534; x <= 131071; x++) pix[1 * WIDTH + x] = BLACK;
+  pix[2 * WIDTH + 65536] = BLACK;
+  // Rows 3..5 random blocks (RLE rows), rows 6..7 random pixels (bitmaps)
+  FillPixels(pix + 3 * WIDTH, WIDTH, 3, 128, 1, &seed);
+  FillPixels(pix + 6 * WIDTH, WIDTH, 2, 128, 0, &seed);
+  Image img = FromPixels(pix, WIDTH, HEIGHT);
+
+  // Points at the ends of the escapes, queried first (building the index)
+  static const uint32 xs[] = {0,      1,      65534,  65535,     65536,
+                              65537,  131070, 131071, 131072,    196605,
+                              196606, 196607, WIDTH - 2, WIDTH - 1};
+  for (uint32 y = 0; y < HEIGHT; y++) {
+    for (size_t k = 0; k < sizeof(xs) / sizeof(xs[0]); k++) {
+      CHECK(ImageGetPixel(img, xs[k], y) == pix[(size_t)y * WIDTH + xs[k]]);
+    }
+  }
+  CHECK(HasPixels(img, pix, WIDTH, HEIGHT));
+
+  // Batches of random points: unsorted, sorted, and sorted backwards
+  ImagePoint* points = malloc(NUM * sizeof(ImagePoint));
+  uint8* colors = malloc(NUM);
+  assert(points != NULL && colors != NULL);
+  for (uint32 k = 0; k < NUM; k++) {
+    points[k].x = rand_r(&seed) % WIDTH;
+    points[k].y = rand_r(&seed) % HEIGHT;
+  }
+  for (int order = 0; order < 3; order++) {
+    if (order == 1) qsort(points, NUM, sizeof(ImagePoint), ComparePoints);
+    if (order == 2) {
+      for (uint32 k = 0; k < NUM / 2; k++) {
+        ImagePoint p = points[k];
+        points[k] = points[NUM - 1 - k];
+        points[NUM - 1 - k] = p;
+      }
+    }
+    memset(colors, 2, NUM);
+    ImageGetPixels(img, points, NUM, colors);
+    int ok = 1;
+    for (uint32 k = 0; k < NUM; k++) {
+      ok &= colors[k] == pix[(size_t)points[k].y * WIDTH + points[k].x];
+    }
+    CHECK(ok);
+  }
+  // Consecutive points along row 1, across the start of its BLACK run
+  for (uint32 k = 0; k < NUM; k++) {
+    points[k].x = 65000 + k;
+    points[k].y = 1;
+  }
+  ImageGetPixels(img, points, NUM, colors);
+  int ok = 1;
+  for (uint32 k = 0; k < NUM; k++) ok &= colors[k] == pix[WIDTH + 65000 + k];
+  CHECK(ok);
+
+  free(points);
+  free(colors);
+  ImageDestroy(&img);
+  free(pix);
+}
+
+/// Connected components
+
+/// Label the BLACK pixels of pix by flood fill: label[p] is 1 + the index
+/// of the component of pixel p (0 for WHITE), components being numbered
+/// in the order of their first pixel.  Returns the number of components.
+static uint32 FloodLabels(const uint8* pix, uint32 width, uint32 height,
+                          int connectivity, uint32* label) {
+  size_t size = (size_t)width * height;
+  size_t* stack = malloc(size * sizeof(size_t));
+  assert(stack != NULL);
+  memset(label, 0, size * sizeof(uint32));
+  uint32 num = 0;
+  for (size_t p = 0; p < size; p++) {
+    if (pix[p] != BLACK || label[p] != 0) continue;
+    label[p] = ++num;
+    size_t top = 0;
+    stack[top++] = p;
+    while (top > 0) {
+      size_t q = stack[--top];
+      int x = (int)(q % width), y = (int)(q / width);
+      for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+          if (connectivity == 4 && dx != 0 && dy != 0) continue;
+          int nx = x + dx, ny = y + dy;
+          if (nx < 0 || ny < 0 || nx >= (int)width || ny >= (int)height) {
+            continue;
+          }
+          size_t n = (size_t)ny * width + nx;
+          if (pix[n] == BLACK && label[n] == 0) {
+            label[n] = num;
+            stack[top++] = n;
+          }
+        }
+      }
+    }
+  }
+  free(stack);
+  return num;
+}
+
+/// Check labels against FloodLabels: components (in order), their area,
+/// bounding box and runs
+static int LabelsMatch(const ImageLabels* labels, const uint8* pix,
+                       uint32 width, uint32 height, int connectivity) {
+  uint32* label = malloc((size_t)width * height * sizeof(uint32));
+  assert(label != NULL);
+  uint32 num = FloodLabels(pix, width, height, connectivity, label);
+  int ok = labels->num_components == num;
+  uint32 total_runs = 0;
+  for (uint32 c = 0; ok && c < num; c++) {
+    const ImageComponent* comp = &labels->components[c];
+    uint64 area = 0;
+    uint32 x0 = width, y0 = height, x1 = 0, y1 = 0;
+    for (size_t p = 0; p < (size_t)width * height; p++) {
+      if (label[p] != c + 1) continue;
+      uint32 x = p % width, y = p / width;
+      area++;
+      if (x < x0) x0 = x;
+      if (x > x1) x1 = x;
+      if (y < y0) y0 = y;
+      if (y > y1) y1 = y;
+    }
+    ok = comp->area == area && comp->x0 == x0 && comp->y0 == y0 &&
+         comp->x1 == x1 && comp->y1 == y1 &&
+         comp->first_run == total_runs;
+    // Its runs: maximal, in row order, covering its area
+    uint64 covered = 0;
+    for (uint32 r = 0; ok && r < comp->num_runs; r++) {
+      const ImageRun* run = &labels->runs[comp->first_run + r];
+      const uint8* row = pix + (size_t)run->y * width;
+      ok = run->x0 <= run->x1 && run->x1 < width &&
+           (run->x0 == 0 || row[run->x0 - 1] == WHITE) &&
+           (run->x1 == width - 1 || row[run->x1 + 1] == WHITE);
+      if (r > 0) {
+        const ImageRun* prev = run - 1;
+        ok &= prev->y < run->y || (prev->y == run->y && prev->x1 < run->x0);
+      }
+      for (uint32 x = run->x0; ok && x <= run->x1; x++) {
+        ok = label[(size_t)run->y * width + x] == c + 1;
+      }
+      covered += run->x1 - run->x0 + 1;
+    }
+    ok &= covered == area;
+    total_runs += comp->num_runs;
+  }
+  ok &= labels->num_runs == total_runs;
+  free(label);
+  return ok;
+}
+
+static void TestLabels(void) {
+  // Diagonals: pixels that only touch at their corners
+  enum { SIZE = 70 };
+  uint8* pix = NewPixels(SIZE, SIZE);
+  for (uint32 k = 0; k < SIZE; k++) {
+    pix[(size_t)k * SIZE + k] = BLACK;             // main diagonal
+    pix[(size_t)k * SIZE + SIZE - 1 - k] = BLACK;  // and the other one
+  }
+  Image img = FromPixels(pix, SIZE, SIZE);
+  ImageLabels* four = ImageLabelComponents(img, 4);
+  ImageLabels* eight = ImageLabelComponents(img, 8);
+  // 4-connected, every pixel is its own component, but the 4 middle ones
+  // (SIZE is even, so they make a 2x2 block)
+  CHECK(four->num_components == 2 * SIZE - 3);
+  CHECK(four->components[0].area == 1 && four->components[0].x0 == 0 &&
+        four->components[0].y0 == 0 && four->components[1].x0 == SIZE - 1);
+  // 8-connected, both diagonals are one X
+  CHECK(eight->num_components == 1);
+  CHECK(eight->components[0].area == 2 * SIZE);
+  CHECK(eight->components[0].x0 == 0 && eight->components[0].y0 == 0 &&
+        eight->components[0].x1 == SIZE - 1 &&
+        eight->components[0].y1 == SIZE - 1);
+  CHECK(LabelsMatch(four, pix, SIZE, SIZE, 4));
+  CHECK(LabelsMatch(eight, pix, SIZE, SIZE, 8));
+  ImageLabelsDestroy(&four);
+  ImageLabelsDestroy(&eight);
+  CHECK(four == NULL && eight == NULL);
+  ImageDestroy(&img);
+  free(pix);
+
+  // Random images, against flood fill: bitmap and RLE rows
+  unsigned seed = 24;
+  for (int blocks = 0; blocks <= 1; blocks++) {
+    for (unsigned density = 40; density <= 200; density += 80) {
+      uint32 width = 130 + blocks * 200, height = 90;
+      pix = NewPixels(width, height);
+      FillPixels(pix, width, height, density, blocks, &seed);
+      img = FromPixels(pix, width, height);
+      for (int connectivity = 4; connectivity <= 8; connectivity += 4) {
+        ImageLabels* labels = ImageLabelComponents(img, connectivity);
+        CHECK(LabelsMatch(labels, pix, width, height, connectivity));
+        ImageLabelsDestroy(&labels);
+      }
+      ImageDestroy(&img);
+      free(pix);
+    }
+  }
+
+  // No BLACK pixels
+  img = ImageCreate(100, 3, WHITE);
+  ImageLabels* none = ImageLabelComponents(img, 8);
+  CHECK(none->num_components == 0 && none->num_runs == 0);
+  ImageLabelsDestroy(&none);
+  ImageDestroy(&img);
+}
+
+/// Streams
+
+/// Check that stream s saves the same image as img.  Destroys s and img.
+static int StreamSaves(ImageStream s, Image img) {
+  const char* name = TempFile("out.pbm");
+  int ok = ImageStreamWidth(s) == ImageWidth(img) &&
+           ImageStreamHeight(s) == ImageHeight(img) &&
+           ImageStreamSave(s, name);
+  if (ok) {
+    Image out = ImageLoad(name);
+    ok = ImageIsEqual(out, img);
+    ImageDestroy(&out);
+  }
+  remove(name);
+  ImageStreamDestroy(&s);
+  ImageDestroy(&img);
+  return ok;
+}
+
+static void TestStreams(void) {
+  // Rows of 70000 pixels: files are read in chunks of 1 MiB, so the
+  // rows are read in a few chunks (bitmap rows first, then RLE rows)
+  enum { WIDTH = 70000, HEIGHT = 300 };
+  char names[2][64];
+  Image img[2];
+  unsigned seed = 18;
+  for (int j = 0; j < 2; j++) {
+    uint8* pix = NewPixels(WIDTH, HEIGHT);
+    FillPixels(pix, WIDTH, HEIGHT / 2, 128, 0, &seed);
+    FillPixels(pix + (size_t)WIDTH * (HEIGHT / 2), WIDTH, HEIGHT / 2, 100, 1,
+               &seed);
+    img[j] = FromPixels(pix, WIDTH, HEIGHT);
+    free(pix);
+    snprintf(names[j], sizeof(names[j]), "%s",
+             TempFile((j == 0) ? "a.pbm" : "b.pbm"));
+    CHECK(ImageSave(img[j], names[j]));
+  }
+  const char* name_a = names[0];
+  const char* name_b = names[1];
+  Image a = img[0];
+  Image b = img[1];
+
+  // Each operation, as the eager one
+  CHECK(StreamSaves(ImageStreamOpen(name_a), ImageOR(a, a)));
+  ImageStream sa = ImageStreamOpen(name_a);
+  ImageStream sb = ImageStreamOpen(name_b);
+  CHECK(StreamSaves(ImageStreamNEG(sa), ImageNEG(a)));
+  CHECK(StreamSaves(ImageStreamAND(sa, sb), ImageAND(a, b)));
+  CHECK(StreamSaves(ImageStreamOR(sa, sb), ImageOR(a, b)));
+  CHECK(StreamSaves(ImageStreamXOR(sa, sb), ImageXOR(a, b)));
+  CHECK(StreamSaves(ImageStreamHorizontalMirror(sa),
+                    ImageHorizontalMirror(a)));
+
+  // A DAG: (NEG a XOR b) mirrored, AND a (a is used twice)
+  ImageStream sn = ImageStreamNEG(sa);
+  ImageStream sx = ImageStreamXOR(sn, sb);
+  ImageStream sm = ImageStreamHorizontalMirror(sx);
+  Image na = ImageNEG(a);
+  Image nx = ImageXOR(na, b);
+  Image nm = ImageHorizontalMirror(nx);
+  CHECK(StreamSaves(ImageStreamAND(sm, sa), ImageAND(nm, a)));
+  ImageStreamDestroy(&sn);
+  ImageStreamDestroy(&sx);
+  ImageStreamDestroy(&sm);
+  ImageDestroy(&na);
+  ImageDestroy(&nx);
+  ImageDestroy(&nm);
+
+  ImageStreamDestroy(&sa);
+  ImageStreamDestroy(&sb);
+  for (int j = 0; j < 2; j++) {
+    remove(names[j]);
+    ImageDestroy(&img[j]);
+  }
+}
+
+/// Interning
+
+static void TestInterning(void) {
+  // Images with a few rows picked from a set of shared rows, and many
+  // rows of their own, which leave the table when they are destroyed
+  // (bitmap rows of random pixels, and RLE rows of blocks)
+  enum { WIDTH = 200, HEIGHT = 100, NUM_ROWS = 40, NUM = 10 };
+  unsigned seed = 16;
+  uint8* rows = NewPixels(WIDTH, NUM_ROWS);
+  FillPixels(rows, WIDTH, NUM_ROWS / 2, 128, 0, &seed);
+  FillPixels(rows + WIDTH * (NUM_ROWS / 2), WIDTH, NUM_ROWS / 2, 100, 1,
+             &seed);
+  uint8* pix[NUM];
+  Image img[NUM];
+  ImageSetInterning(1);
+  for (int k = 0; k < NUM; k++) {
+    pix[k] = NewPixels(WIDTH, HEIGHT);
+    for (uint32 y = 0; y < HEIGHT; y++) {
+      uint8* row = pix[k] + y * WIDTH;
+      if (rand_r(&seed) % 4 == 0) {
+        memcpy(row, rows + (rand_r(&seed) % NUM_ROWS) * WIDTH, WIDTH);
+      } else {
+        FillPixels(row, WIDTH, 1, 128, y & 1, &seed);
+      }
+    }
+    img[k] = FromPixels(pix[k], WIDTH, HEIGHT);
+  }
+
+  // A copy of an image takes no new rows: loading it allocates less than
+  // loading its negative, whose rows are all new (InstrCount[1] counts
+  // the bytes allocated)
+  uint8* neg = NewPixels(WIDTH, HEIGHT);
+  for (size_t p = 0; p < (size_t)WIDTH * HEIGHT; p++) neg[p] = !pix[0][p];
+  unsigned long bytes = InstrCount[1];
+  Image copy = FromPixels(pix[0], WIDTH, HEIGHT);
+  unsigned long copy_bytes = InstrCount[1] - bytes;
+  bytes = InstrCount[1];
+  Image fresh = FromPixels(neg, WIDTH, HEIGHT);
+  CHECK(copy_bytes < InstrCount[1] - bytes);
+  CHECK(ImageIsEqual(copy, img[0]));
+  ImageDestroy(&fresh);
+  free(neg);
+
+  // A mapped native image keeps its rows in the mapping, and operations
+  // on it share the interned rows of equal results
+  const char* name = TempFile("rle");
+  CHECK(ImageSaveNative(img[1], name));
+  Image mapped = ImageLoad(name);
+  remove(name);
+  Image or = ImageOR(mapped, mapped);
+  CHECK(ImageIsEqual(mapped, img[1]) && ImageIsEqual(or, img[1]));
+
+  // Destroying images in mixed order removes their rows from the table
+  // (moving back the entries after them): the rows of the other images
+  // must still be found (a copy shares all its rows, so a second copy
+  // takes as many bytes as the first), and stay intact
+  static const int order[NUM] = {3, 0, 6, 9, 1, 7, 2, 8, 5, 4};
+  for (int d = 0; d < NUM; d++) {
+    ImageDestroy(&img[order[d]]);
+    if (d == 1) ImageDestroy(&copy);
+    if (d == 3) ImageDestroy(&mapped);
+    for (int k = 0; k < NUM; k++) {
+      if (img[k] == NULL) continue;
+      bytes = InstrCount[1];
+      Image again = FromPixels(pix[k], WIDTH, HEIGHT);
+      copy_bytes = InstrCount[1] - bytes;
+      bytes = InstrCount[1];
+      Image twice = FromPixels(pix[k], WIDTH, HEIGHT);
+      CHECK(InstrCount[1] - bytes == copy_bytes);
+      CHECK(ImageIsEqual(again, img[k]) && ImageIsEqual(twice, img[k]));
+      CHECK(HasPixels(again, pix[k], WIDTH, HEIGHT));
+      CHECK(HasPixels(img[k], pix[k], WIDTH, HEIGHT));
+      ImageDestroy(&again);
+      ImageDestroy(&twice);
+    }
+    CHECK(HasPixels(or, pix[1], WIDTH, HEIGHT));
+  }
+  ImageDestroy(&or);
+  ImageSetInterning(0);
+
+  for (int k = 0; k < NUM; k++) free(pix[k]);
+  free(rows);
+}
+
+/// Expressions
+
+/// Check that expression e evaluates to img.  Destroys img.
+static int ExprIs(ImageExpr e, Image img) {
+  int ok = ImageIsEqual(ImageExprImage(e), img);
+  ImageDestroy(&img);
+  return ok;
+}
+
+static void TestExpressions(void) {
+  // Narrow and wide rows (the widest do not fit the stack scratch of
+  // the evaluator), bitmap rows on top and RLE rows below
+  static const uint32 widths[] = {300, 70000};
+  enum { HEIGHT = 40 };
+  unsigned seed = 12;
+  for (int threads = 1; threads <= 4; threads += 3) {
+    ImageSetThreads(threads);
+    for (int w = 0; w < 2; w++) {
+      uint32 width = widths[w];
+      Image img[3];
+      ImageExpr leaf[3];
+      for (int j = 0; j < 3; j++) {
+        uint8* pix = NewPixels(width, HEIGHT);
+        FillPixels(pix, width, HEIGHT / 2, 128, 0, &seed);
+        FillPixels(pix + (size_t)width * (HEIGHT / 2), width, HEIGHT / 2, 100,
+                   1, &seed);
+        img[j] = FromPixels(pix, width, HEIGHT);
+        leaf[j] = ImageExprLeaf(FromPixels(pix, width, HEIGHT));
+        free(pix);
+      }
+      Image a = img[0], b = img[1], c = img[2];
+
+      // A DAG where x (and through it, n and the leaves) is shared:
+      // root = ((NEG a XOR b) AND c) OR (NEG a XOR b) OR NEG NEG a
+      ImageExpr n = ImageExprNEG(leaf[0]);
+      ImageExpr x = ImageExprXOR(n, leaf[1]);
+      ImageExpr y = ImageExprAND(x, leaf[2]);
+      ImageExpr nn = ImageExprNEG(n);
+      ImageExpr z = ImageExprOR(y, x);
+      ImageExpr root = ImageExprOR(z, nn);
+      // The operands are referenced by the nodes using them
+      for (int j = 0; j < 3; j++) ImageExprDestroy(&leaf[j]);
+
+      Image na = ImageNEG(a);
+      Image xa = ImageXOR(na, b);
+      Image ya = ImageAND(xa, c);
+      Image za = ImageOR(ya, xa);
+      CHECK(ExprIs(root, ImageOR(za, a)));
+      // Inner nodes, evaluated after the root and before their parents
+      CHECK(ExprIs(x, ImageXOR(na, b)));
+      CHECK(ExprIs(nn, ImageOR(a, a)));
+      CHECK(ExprIs(z, ImageOR(ya, xa)));
+      ImageExpr again = ImageExprAND(root, x);
+      CHECK(ExprIs(again, ImageAND(za, xa)));
+      CHECK(ExprIs(n, ImageNEG(a)));
+
+      ImageExprDestroy(&again);
+      ImageExprDestroy(&root);
+      ImageExprDestroy(&z);
+      ImageExprDestroy(&nn);
+      ImageExprDestroy(&y);
+      ImageExprDestroy(&x);
+      ImageExprDestroy(&n);
+      CHECK(n == NULL && root == NULL);
+      ImageDestroy(&na);
+      ImageDestroy(&xa);
+      ImageDestroy(&ya);
+      ImageDestroy(&za);
+      for (int j = 0; j < 3; j++) ImageDestroy(&img[j]);
+    }
+  }
+  ImageSetThreads(1);
+}
+
+/// Threads
+
+enum { NUM_OPS = 12 };
+
+/// Compute some operations on img1 and img2 (of the same size) into out
+static void ComputeOps(const Image img1, const Image img2, Image out[]) {
+  Image imgs[3] = {img1, img2, img1};
+  out[0] = ImageAND(img1, img2);
+  out[1] = ImageOR(img1, img2);
+  out[2] = ImageXOR(img1, img2);
+  out[3] = ImageNEG(img1);
+  out[4] = ImageHorizontalMirror(img2);
+  out[5] = ImageVerticalMirror(img1);
+  out[6] = ImageReduce(REDUCE_XOR, imgs, 3);
+  out[7] = ImageAtLeast(imgs, 3, 2);
+  out[8] = ImageDilate(img1, 5, 4);
+  out[9] = ImageErode(img2, 4, 5);
+  out[10] = ImageOpen(img1, 3, 6);
+  out[11] = ImageClose(img2, 6, 3);
+}
+
+// The pixel queries of a client thread (see QueryPixels)
+struct queries {
+  Image img;
+  const uint8* pix;
+  uint32 width, height;
+  uint64 hash;  // ImageHash(img)
+  int ok;       // does img have pixels pix?
+};
+
+/// Thread of TestThreads: query the hash and all pixels of an image
+static void* QueryPixels(void* arg) {
+  struct queries* q = arg;
+  q->hash = ImageHash(q->img);
+  q->ok = HasPixels(q->img, q->pix, q->width, q->height);
+  return NULL;
+}
+
+static void TestThreads(void) {
+  // Tall enough for a few work units per thread, with bitmap rows
+  // (random pixels) in the top half and RLE rows (blocks) below
+  enum { WIDTH = 500, HEIGHT = 400, THREADS = 5 };
+  unsigned seed = 7;
+  uint8* pix[2];
+  Image img[2];
+  for (int j = 0; j < 2; j++) {
+    pix[j] = NewPixels(WIDTH, HEIGHT);
+    FillPixels(pix[j], WIDTH, HEIGHT / 2, 128, 0, &seed);
+    FillPixels(pix[j] + WIDTH * (HEIGHT / 2), WIDTH, HEIGHT / 2, 60, 1,
+               &seed);
+    img[j] = FromPixels(pix[j], WIDTH, HEIGHT);
+  }
+
+  // The rows built by the pool are the same as the serial ones
+  Image serial[NUM_OPS], parallel[NUM_OPS];
+  ComputeOps(img[0], img[1], serial);
+  ImageSetThreads(THREADS);
+  ComputeOps(img[0], img[1], parallel);
+  Image loaded = FromPixels(pix[0], WIDTH, HEIGHT);  // decoded in parallel
+  ImageSetThreads(1);
+  for (int k = 0; k < NUM_OPS; k++) {
+    CHECK(ImageIsEqual(parallel[k], serial[k]));
+    ImageDestroy(&serial[k]);
+    ImageDestroy(&parallel[k]);
+  }
+  CHECK(ImageIsEqual(loaded, img[0]));
+  ImageDestroy(&loaded);
+
+  // Client threads querying a new image at once all build its cached
+  // hashes and pixel position index (see ImageHash, ImageGetPixel)
+  loaded = FromPixels(pix[0], WIDTH, HEIGHT);
+  pthread_t threads[THREADS];
+  struct queries q[THREADS];
+  for (int t = 0; t < THREADS; t++) {
+    q[t] = (struct queries){loaded, pix[0], WIDTH, HEIGHT, 0, 0};
+    CHECK(pthread_create(&threads[t], NULL, QueryPixels, &q[t]) == 0);
+  }
+  for (int t = 0; t < THREADS; t++) {
+    pthread_join(threads[t], NULL);
+    CHECK(q[t].ok && q[t].hash == ImageHash(img[0]));
+  }
+  ImageDestroy(&loaded);
+
+  for (int j = 0; j < 2; j++) {
+    ImageDestroy(&img[j]);
+    free(pix[j]);
+  }
+}
+
+/// Allocator
+
+// The blocks of a counting allocator (see TestAllocator): each one starts
+// with a header holding its size
+static struct {
+  pthread_mutex_t lock;
+  long allocs;  // blocks allocated
+  long live;    // blocks not freed yet
+  long bad;     // blocks resized or freed with the wrong size
+} counts = {PTHREAD_MUTEX_INITIALIZER, 0, 0, 0};
+
+#define HEADER 16  // keeps blocks aligned for any type
+
+static void Count(long allocs, long live, long bad) {
+  pthread_mutex_lock(&counts.lock);
+  counts.allocs += allocs;
+  counts.live += live;
+  counts.bad += bad;
+  pthread_mutex_unlock(&counts.lock);
+}
+
+static void* CountingAlloc(size_t size, void* ctx) {
+  (void)ctx;
+  uint8* p = malloc(HEADER + size);
+  if (p == NULL) return NULL;
+  memcpy(p, &size, sizeof(size));
+  Count(1, 1, 0);
+  return p + HEADER;
+}
+
+static void* CountingRealloc(void* ptr, size_t old_size, size_t size,
+                             void* ctx) {
+  (void)ctx;
+  uint8* p = (uint8*)ptr - HEADER;
+  size_t block_size;
+  memcpy(&block_size, p, sizeof(block_size));
+  p = realloc(p, HEADER + size);
+  if (p == NULL) return NULL;
+  memcpy(p, &size, sizeof(size));
+  Count(0, 0, block_size != old_size);
+  return p + HEADER;
+}
+
+static void CountingFree(void* ptr, size_t size, void* ctx) {
+  (void)ctx;
+  uint8* p = (uint8*)ptr - HEADER;
+  size_t block_size;
+  memcpy(&block_size, p, sizeof(block_size));
+  free(p);
+  Count(0, -1, block_size != size);
+}
+
+static void TestAllocator(void) {
+  // All the memory of images goes through the allocator, and is given
+  // back once they are all destroyed, with or without threads and
+  // interning (whose table is freed with the last interned row)
+  enum { WIDTH = 300, HEIGHT = 120 };
+  unsigned seed = 21;
+  uint8* pix = NewPixels(WIDTH, HEIGHT);
+  FillPixels(pix, WIDTH, HEIGHT / 2, 128, 0, &seed);
+  FillPixels(pix + WIDTH * (HEIGHT / 2), WIDTH, HEIGHT / 2, 80, 1, &seed);
+  const ImageAllocator counting = {CountingAlloc, CountingRealloc,
+                                   CountingFree, NULL};
+  ImageSetAllocator(&counting);
+  for (int mode = 0; mode < 4; mode++) {
+    ImageSetThreads((mode & 1) ? 4 : 1);
+    ImageSetInterning(mode >> 1);
+    Image img = FromPixels(pix, WIDTH, HEIGHT);
+    Image mirror = ImageHorizontalMirror(img);
+    Image out[NUM_OPS];
+    ComputeOps(img, mirror, out);
+
+    // Native files (mapped) and buffers
+    const char* name = TempFile("rle");
+    CHECK(ImageSaveNative(out[0], name));
+    Image mapped = ImageLoad(name);
+    remove(name);
+    size_t size = ImageEncode(out[1], NULL, 0);
+    uint8* buf = malloc(size);
+    assert(buf != NULL);
+    ImageEncode(out[1], buf, size);
+    Image decoded = ImageDecode(buf, size);
+    free(buf);
+    CHECK(ImageIsEqual(mapped, out[0]) && ImageIsEqual(decoded, out[1]));
+
+    // Cached hashes and pixel position indexes, and labels
+    CHECK(ImageHash(out[2]) != ImageHash(out[3]));
+    CHECK(HasPixels(img, pix, WIDTH, HEIGHT));
+    ImageLabels* labels = ImageLabelComponents(out[8], 8);
+    ImageLabelsDestroy(&labels);
+
+    // Expressions and streams
+    ImageExpr leaf = ImageExprLeaf(ImageNEG(mapped));
+    ImageExpr neg = ImageExprNEG(leaf);
+    ImageExpr e = ImageExprXOR(leaf, neg);
+    ImageExprDestroy(&leaf);
+    ImageExprDestroy(&neg);
+    ImageExpr x = ImageExprAND(e, e);
+    ImageExprDestroy(&e);
+    CHECK(ImageWidth(ImageExprImage(x)) == WIDTH);
+    ImageExprDestroy(&x);
+    char input[64];
+    snprintf(input, sizeof(input), "%s", TempFile("pbm"));
+    CHECK(ImageSave(img, input));
+    ImageStream s = ImageStreamOpen(input);
+    ImageStream n = ImageStreamNEG(s);
+    ImageStreamDestroy(&s);
+    name = TempFile("neg.pbm");
+    CHECK(ImageStreamSave(n, name));
+    ImageStreamDestroy(&n);
+    remove(name);
+    remove(input);
+
+    for (int k = 0; k < NUM_OPS; k++) ImageDestroy(&out[k]);
+    ImageDestroy(&decoded);
+    ImageDestroy(&mapped);
+    ImageDestroy(&mirror);
+    ImageDestroy(&img);
+    CHECK(counts.allocs > 0 && counts.live == 0 && counts.bad == 0);
+    counts.allocs = 0;
+  }
+  ImageSetInterning(0);
+  ImageSetThreads(1);
+  ImageSetAllocator(NULL);
+  free(pix);
+}
+
 int main(int argc, char* argv[]) {
   if (argc != 1) {
     fprintf(stderr, "Usage: %s  # no arguments required (for now)\n", argv[0]);
@@ -123,6 +1360,32 @@ int main(int argc, char* argv[]) {
   ImageDestroy(&image_11);
 
   ***/
+  ImageDestroy(&white_image);
+  ImageDestroy(&black_image);
 
+  // Checking the operations
+  RunTest("ImageEncode/ImageDecode/ImageSaveNative", TestNative);
+  RunTest("ImageLoad/ImageNEG/ImageAND/ImageOR/ImageXOR (run data)",
+          TestRuns);
+  RunTest("ImageReduce/ImageAtLeast", TestReduce);
+  RunTest("ImageGetPixel/ImageGetPixels", TestPixels);
+  RunTest("ImageLabelComponents", TestLabels);
+  RunTest("ImageExpr*", TestExpressions);
+  RunTest("ImageStream*", TestStreams);
+  RunTest("ImageDilate/ImageErode/ImageOpen/ImageClose", TestMorphology);
+  // Again, with the rows split among threads
+  ImageSetThreads(4);
+  RunTest("ImageReduce/ImageAtLeast (4 threads)", TestReduce);
+  RunTest("ImageDilate/ImageErode/ImageOpen/ImageClose (4 threads)",
+          TestMorphology);
+  ImageSetThreads(1);
+  RunTest("ImageSetThreads", TestThreads);
+  RunTest("ImageSetAllocator", TestAllocator);  // no intern table yet
+  RunTest("ImageSetInterning", TestInterning);
+
+  if (failures > 0) {
+    printf("%d verificações falharam\n", failures);
+    return 1;
+  }
   return 0;
 }
@@ -34,11 +34,24 @@ static const char* USAGE =
     "  Input file names must be distinct from operation names.\n"
     "\n"
     "OPERATIONS:\n"
-    "  FILE            Load image from PBM file named FILE.\n"
-    "  save FILE       Save CURR to PBM file named FILE.\n"
+    "  FILE            Load image from PBM or native file named FILE.\n"
+    "  save FILE       Save CURR to file named FILE (native if FILE ends\n"
+    "                  in .rle, else PBM).\n"
     "  info            Show information on CURR (size).\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
+    "  export FILE     Save the times and counters of each operation since tic\n"
+    "                  to FILE (JSON if FILE ends in .json, else CSV).\n"
+    "  perf            Also measure hardware events (cycles, instructions,\n"
+    "                  branch and cache misses) where the system permits it.\n"
+    "  threads N       Use N threads in the following operations.\n"
+    "  intern          Intern the rows of the following images.\n"
+    "  internstats     Show row interning statistics.\n"
+    "  lazy            Build the following neg/and/or/xor as expressions,\n"
+    "                  evaluated in a single pass when their image is needed.\n"
+    "  stream          Open the following PBM files as streams: neg/and/or/xor/\n"
+    "                  hmirror build streams, and save writes them row by row\n"
+    "                  in constant memory (other operations are not available).\n"
     "\n"              
     "  create W,H,C    Create new image with WxH pixels, color C.\n"
     "  chess W,H,E,C   Create new chessboard image with WxH pixels,"
@@ -48,20 +61,31 @@ static const char* USAGE =
     "  rle             Print RLE representation of CURR.\n"
     "\n"              
     "  equal           PREV == CURR?\n"
+    "  pixel X,Y       Color of pixel (X,Y) of CURR.\n"
+    "  label K         Count the connected components of CURR, with\n"
+    "                  K-connectivity (K = 4|8).\n"
     "\n"              
     "  neg             Neg CURR.\n"
     "  and             PREV and CURR.\n"
     "  or              PREV or CURR.\n"
     "  xor             PREV xor CURR.\n"
+    "  reduce OP       and/or/xor of all images in the buffer (OP = and|or|xor).\n"
+    "  atleast K       Pixels BLACK in at least K images in the buffer.\n"
     "\n"              
     "  hmirror         Horizontal mirror CURR (flip top-bottom).\n"
     "  vmirror         Vertical mirror CURR (flip left-right).\n"
     "  repb            Replicate CURR at the bottom of PREV.\n"
     "  repr            Replicate CURR at the right of PREV.\n"
+    "\n"
+    "  dilate W,H      Dilate CURR with a WxH rectangle.\n"
+    "  erode W,H       Erode CURR with a WxH rectangle.\n"
+    "  open W,H        Open CURR with a WxH rectangle (erode, then dilate).\n"
+    "  close W,H       Close CURR with a WxH rectangle (dilate, then erode).\n"
     "\n"              
     "OPERANDS:\n"
     "  FILE            A filename\n"
     "  W,H             Width and height of image or rectangular region.\n"
+    "  X,Y             Pixel position (column, row).\n"
     "  C               Color (0 = WHITE, 1 = BLACK).\n"
     "  E               Edge length.\n"
     "\n"
@@ -73,9 +97,44 @@ static char* errors[] = {
   "Insufficient images",
   "Insufficient space in buffer",
   "Invalid operand",
+  "Operation not available on streams",
+};
+
+// Operations not available in stream mode
+static const char* IMAGE_OPS[] = {
+  "create", "chess", "raw", "rle", "equal", "pixel", "label", "reduce",
+  "atleast", "vmirror", "repb", "repr", "dilate", "erode", "open", "close",
+  NULL,
 };
 
 
+// In lazy mode, an image in the buffer may be an expression not yet
+// evaluated: img[k] is NULL until it is needed.  Images used as operands
+// of expressions are wrapped in expr[k] and owned by it.
+
+// In stream mode, the images in the buffer are streams (stream[k]),
+// and img[k] is NULL.
+
+// Is av an operation not available on streams?
+static int IsImageOp(const char* av) {
+  for (int j = 0; IMAGE_OPS[j] != NULL; j++) {
+    if (strcmp(av, IMAGE_OPS[j]) == 0) return 1;
+  }
+  return 0;
+}
+
+// Get image k of the buffer, evaluating its expression if needed.
+static Image GetImage(Image img[], ImageExpr expr[], int k) {
+  if (img[k] == NULL) img[k] = ImageExprImage(expr[k]);
+  return img[k];
+}
+
+// Get image k of the buffer as an expression.
+static ImageExpr GetExpr(Image img[], ImageExpr expr[], int k) {
+  if (expr[k] == NULL) expr[k] = ImageExprLeaf(img[k]);
+  return expr[k];
+}
+
 // This program strives for correctness and robustness.
 // You may want to temporarily comment out operand validation, namely
 // precondition checks, so that you can force precondition violations,
@@ -100,20 +159,67 @@ int main(int ac, char* av[]) {
   // The image buffer
   const int N = 10;   // buffer capacity
   Image img[N];       // the images
+  ImageExpr expr[N];  // their expressions (lazy mode), or NULL
+  ImageStream stream[N];  // their streams (stream mode), or NULL
   int n = 0;          // number of images created
+  int lazy = 0;       // lazy mode?
+  int streaming = 0;  // stream mode?
+
+  for (int j = 0; j < N; j++) {
+    expr[j] = NULL;
+    stream[j] = NULL;
+  }
 
   int k = 1;
   while (k < ac) {
+    if (streaming && IsImageOp(av[k])) { err = 5; break; }
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }  // enough input images?
       fprintf(log, "Info on I%d\n", n-1);
-      w = ImageWidth(img[n-1]);
-      h = ImageHeight(img[n-1]);
+      if (streaming) {
+        if (stream[n-1] == NULL) { err = 5; break; }
+        w = ImageStreamWidth(stream[n-1]);
+        h = ImageStreamHeight(stream[n-1]);
+      } else {
+        w = ImageWidth(GetImage(img, expr, n-1));
+        h = ImageHeight(GetImage(img, expr, n-1));
+      }
       fprintf(log, "# Size: %ux%u\n", w, h);
     } else if (strcmp(av[k], "tic") == 0) {
       InstrReset();
     } else if (strcmp(av[k], "toc") == 0) {
       InstrPrint();
+    } else if (strcmp(av[k], "export") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      FILE* f = fopen(av[k], "w");
+      if (f == NULL) { perror(av[k]); err = 4; break; }
+      size_t len = strlen(av[k]);
+      if (len >= 5 && strcmp(av[k] + len - 5, ".json") == 0) {
+        fprintf(log, "InstrExportJSON(\"%s\")\n", av[k]);
+        InstrExportJSON(f);
+      } else {
+        fprintf(log, "InstrExportCSV(\"%s\")\n", av[k]);
+        InstrExportCSV(f);
+      }
+      fclose(f);
+    } else if (strcmp(av[k], "perf") == 0) {
+      fprintf(log, "InstrPerfOpen() -> %d events\n", InstrPerfOpen());
+    } else if (strcmp(av[k], "threads") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      uint t;  // number of threads
+      if (sscanf(av[k], "%u", &t) != 1) { err = 4; break; }
+      if (t < 1) { err = 4; break; }   // precondition check!
+      fprintf(log, "ImageSetThreads(%u)\n", t);
+      ImageSetThreads((int)t);
+    } else if (strcmp(av[k], "intern") == 0) {
+      fprintf(log, "ImageSetInterning(1)\n");
+      ImageSetInterning(1);
+    } else if (strcmp(av[k], "internstats") == 0) {
+      ImageInternPrint();
+    } else if (strcmp(av[k], "lazy") == 0) {
+      lazy = 1;
+    } else if (strcmp(av[k], "stream") == 0) {
+      streaming = 1;
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }  // enough arguments?
       if (n >= N) { err = 3; break; } // enough space for output?
@@ -137,73 +243,211 @@ int main(int ac, char* av[]) {
     } else if (strcmp(av[k], "raw") == 0) {
       if (n < 1) { err = 2; break; }  // enough input images?
       fprintf(log, "ImageRAWPrint(I%d)\n", n-1);
-      ImageRAWPrint(img[n-1]);
+      ImageRAWPrint(GetImage(img, expr, n-1));
     } else if (strcmp(av[k], "rle") == 0) {
       if (n < 1) { err = 2; break; }  // enough input images?
       fprintf(log, "ImageRLEPrint(I%d)\n", n-1);
-      ImageRLEPrint(img[n-1]);
+      ImageRLEPrint(GetImage(img, expr, n-1));
     } else if (strcmp(av[k], "equal") == 0) {
       if (n < 2) { err = 2; break; }  // enough input images?
       fprintf(log, "ImageIsEqual(I%d, I%d) -> ", n-2, n-1);
-      int eq = ImageIsEqual(img[n-2], img[n-1]);
+      int eq = ImageIsEqual(GetImage(img, expr, n-2), GetImage(img, expr, n-1));
       fprintf(log, "%d\n", eq);
+    } else if (strcmp(av[k], "pixel") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (n < 1) { err = 2; break; }  // enough input images?
+      uint x, y;  // pixel position
+      if (sscanf(av[k], "%u,%u", &x, &y) != 2) { err = 4; break; }
+      Image cur = GetImage(img, expr, n-1);
+      if (x >= (uint)ImageWidth(cur) || y >= (uint)ImageHeight(cur)) {
+        err = 4; break;   // precondition check!
+      }
+      fprintf(log, "ImageGetPixel(I%d, %u, %u) -> %u\n", n-1, x, y,
+              ImageGetPixel(cur, x, y));
+    } else if (strcmp(av[k], "label") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (n < 1) { err = 2; break; }  // enough input images?
+      uint conn;  // connectivity
+      if (sscanf(av[k], "%u", &conn) != 1) { err = 4; break; }
+      if (conn != 4 && conn != 8) { err = 4; break; }   // precondition check!
+      fprintf(log, "ImageLabelComponents(I%d, %u) -> ", n-1, conn);
+      ImageLabels* labels = ImageLabelComponents(GetImage(img, expr, n-1),
+                                                 (int)conn);
+      fprintf(log, "%u components, %u runs\n", labels->num_components,
+              labels->num_runs);
+      ImageLabelsDestroy(&labels);
     } else if (strcmp(av[k], "neg") == 0) {
       if (n < 1) { err = 2; break; }  // enough input images?
       if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageNEG(I%d) -> I%d\n", n-1, n);
-      img[n] = ImageNEG(img[n-1]);
+      if (streaming) {
+        if (stream[n-1] == NULL) { err = 5; break; }
+        fprintf(log, "ImageStreamNEG(I%d) -> I%d\n", n-1, n);
+        stream[n] = ImageStreamNEG(stream[n-1]);
+        img[n] = NULL;
+      } else if (lazy) {
+        fprintf(log, "ImageExprNEG(I%d) -> I%d\n", n-1, n);
+        expr[n] = ImageExprNEG(GetExpr(img, expr, n-1));
+        img[n] = NULL;
+      } else {
+        fprintf(log, "ImageNEG(I%d) -> I%d\n", n-1, n);
+        img[n] = ImageNEG(GetImage(img, expr, n-1));
+      }
       n++;
     } else if (strcmp(av[k], "and") == 0) {
       if (n < 2) { err = 2; break; }  // enough input images?
       if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageAND(I%d, I%d) -> I%d\n", n-2, n-1, n);
-      img[n] = ImageAND(img[n-2], img[n-1]);
+      if (streaming) {
+        if (stream[n-2] == NULL || stream[n-1] == NULL) { err = 5; break; }
+        fprintf(log, "ImageStreamAND(I%d, I%d) -> I%d\n", n-2, n-1, n);
+        stream[n] = ImageStreamAND(stream[n-2], stream[n-1]);
+        img[n] = NULL;
+      } else if (lazy) {
+        fprintf(log, "ImageExprAND(I%d, I%d) -> I%d\n", n-2, n-1, n);
+        expr[n] = ImageExprAND(GetExpr(img, expr, n-2), GetExpr(img, expr, n-1));
+        img[n] = NULL;
+      } else {
+        fprintf(log, "ImageAND(I%d, I%d) -> I%d\n", n-2, n-1, n);
+        img[n] = ImageAND(GetImage(img, expr, n-2), GetImage(img, expr, n-1));
+      }
       n++;
     } else if (strcmp(av[k], "or") == 0) {
       if (n < 2) { err = 2; break; }  // enough input images?
       if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageOR(I%d, I%d) -> I%d\n", n-2, n-1, n);
-      img[n] = ImageOR(img[n-2], img[n-1]);
+      if (streaming) {
+        if (stream[n-2] == NULL || stream[n-1] == NULL) { err = 5; break; }
+        fprintf(log, "ImageStreamOR(I%d, I%d) -> I%d\n", n-2, n-1, n);
+        stream[n] = ImageStreamOR(stream[n-2], stream[n-1]);
+        img[n] = NULL;
+      } else if (lazy) {
+        fprintf(log, "ImageExprOR(I%d, I%d) -> I%d\n", n-2, n-1, n);
+        expr[n] = ImageExprOR(GetExpr(img, expr, n-2), GetExpr(img, expr, n-1));
+        img[n] = NULL;
+      } else {
+        fprintf(log, "ImageOR(I%d, I%d) -> I%d\n", n-2, n-1, n);
+        img[n] = ImageOR(GetImage(img, expr, n-2), GetImage(img, expr, n-1));
+      }
       n++;
     } else if (strcmp(av[k], "xor") == 0) {
       if (n < 2) { err = 2; break; }  // enough input images?
       if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageXOR(I%d, I%d) -> I%d\n", n-2, n-1, n);
-      img[n] = ImageXOR(img[n-2], img[n-1]);
+      if (streaming) {
+        if (stream[n-2] == NULL || stream[n-1] == NULL) { err = 5; break; }
+        fprintf(log, "ImageStreamXOR(I%d, I%d) -> I%d\n", n-2, n-1, n);
+        stream[n] = ImageStreamXOR(stream[n-2], stream[n-1]);
+        img[n] = NULL;
+      } else if (lazy) {
+        fprintf(log, "ImageExprXOR(I%d, I%d) -> I%d\n", n-2, n-1, n);
+        expr[n] = ImageExprXOR(GetExpr(img, expr, n-2), GetExpr(img, expr, n-1));
+        img[n] = NULL;
+      } else {
+        fprintf(log, "ImageXOR(I%d, I%d) -> I%d\n", n-2, n-1, n);
+        img[n] = ImageXOR(GetImage(img, expr, n-2), GetImage(img, expr, n-1));
+      }
+      n++;
+    } else if (strcmp(av[k], "reduce") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (n < 1) { err = 2; break; }  // enough input images?
+      if (n >= N) { err = 3; break; } // enough space for output?
+      int op;
+      if (strcmp(av[k], "and") == 0) op = REDUCE_AND;
+      else if (strcmp(av[k], "or") == 0) op = REDUCE_OR;
+      else if (strcmp(av[k], "xor") == 0) op = REDUCE_XOR;
+      else { err = 4; break; }
+      for (int j = 0; j < n; j++) GetImage(img, expr, j);
+      fprintf(log, "ImageReduce(%s, I0..I%d) -> I%d\n", av[k], n-1, n);
+      img[n] = ImageReduce(op, img, n);
+      n++;
+    } else if (strcmp(av[k], "atleast") == 0) {
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (n < 1) { err = 2; break; }  // enough input images?
+      if (n >= N) { err = 3; break; } // enough space for output?
+      uint32 votes;
+      if (sscanf(av[k], "%u", &votes) != 1) { err = 4; break; }
+      for (int j = 0; j < n; j++) GetImage(img, expr, j);
+      fprintf(log, "ImageAtLeast(I0..I%d, %u) -> I%d\n", n-1, votes, n);
+      img[n] = ImageAtLeast(img, n, votes);
       n++;
     } else if (strcmp(av[k], "hmirror") == 0) {
       if (n < 1) { err = 2; break; }  // enough input images?
       if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageHorizontalMirror(I%d) -> I%d\n", n-1, n);
-      img[n] = ImageHorizontalMirror(img[n-1]);
+      if (streaming) {
+        if (stream[n-1] == NULL) { err = 5; break; }
+        fprintf(log, "ImageStreamHorizontalMirror(I%d) -> I%d\n", n-1, n);
+        stream[n] = ImageStreamHorizontalMirror(stream[n-1]);
+        img[n] = NULL;
+      } else {
+        fprintf(log, "ImageHorizontalMirror(I%d) -> I%d\n", n-1, n);
+        img[n] = ImageHorizontalMirror(GetImage(img, expr, n-1));
+      }
       n++;
     } else if (strcmp(av[k], "vmirror") == 0) {
       if (n < 1) { err = 2; break; }  // enough input images?
       if (n >= N) { err = 3; break; } // enough space for output?
-      fprintf(log, "ImageHorizontalMirror(I%d) -> I%d\n", n-1, n);
-      img[n] = ImageHorizontalMirror(img[n-1]);
+      fprintf(log, "ImageVerticalMirror(I%d) -> I%d\n", n-1, n);
+      img[n] = ImageVerticalMirror(GetImage(img, expr, n-1));
+      n++;
+    } else if (strcmp(av[k], "dilate") == 0 || strcmp(av[k], "erode") == 0 ||
+               strcmp(av[k], "open") == 0 || strcmp(av[k], "close") == 0) {
+      const char* op = av[k];
+      if (++k >= ac) { err = 1; break; }  // enough arguments?
+      if (n < 1) { err = 2; break; }  // enough input images?
+      if (n >= N) { err = 3; break; } // enough space for output?
+      if (sscanf(av[k], "%u,%u", &w, &h) != 2) { err = 4; break; }
+      if (w < 1 || h < 1) { err = 4; break; }   // precondition check!
+      Image cur = GetImage(img, expr, n-1);
+      if (strcmp(op, "dilate") == 0) {
+        fprintf(log, "ImageDilate(I%d, %u, %u) -> I%d\n", n-1, w, h, n);
+        img[n] = ImageDilate(cur, w, h);
+      } else if (strcmp(op, "erode") == 0) {
+        fprintf(log, "ImageErode(I%d, %u, %u) -> I%d\n", n-1, w, h, n);
+        img[n] = ImageErode(cur, w, h);
+      } else if (strcmp(op, "open") == 0) {
+        fprintf(log, "ImageOpen(I%d, %u, %u) -> I%d\n", n-1, w, h, n);
+        img[n] = ImageOpen(cur, w, h);
+      } else {
+        fprintf(log, "ImageClose(I%d, %u, %u) -> I%d\n", n-1, w, h, n);
+        img[n] = ImageClose(cur, w, h);
+      }
       n++;
     } else if (strcmp(av[k], "repb") == 0) {
       if (n < 2) { err = 2; break; }  // enough input images?
       if (n >= N) { err = 3; break; } // enough space for output?
       fprintf(log, "ImageReplicateAtBottom(I%d, I%d) -> I%d\n", n-2, n-1, n);
-      img[n] = ImageReplicateAtBottom(img[n-2], img[n-1]);
+      img[n] = ImageReplicateAtBottom(GetImage(img, expr, n-2),
+                                      GetImage(img, expr, n-1));
       n++;
     } else if (strcmp(av[k], "repr") == 0) {
       if (n < 2) { err = 2; break; }  // enough input images?
       if (n >= N) { err = 3; break; } // enough space for output?
       fprintf(log, "ImageReplicateAtRight(I%d, I%d) -> I%d\n", n-2, n-1, n);
-      img[n] = ImageReplicateAtRight(img[n-2], img[n-1]);
+      img[n] = ImageReplicateAtRight(GetImage(img, expr, n-2),
+                                     GetImage(img, expr, n-1));
       n++;
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }  // enough input images?
-      fprintf(log, "ImageSave(I%d, \"%s\")\n", n-1, av[k]);
-      ImageSave(img[n-1], av[k]);
+      size_t len = strlen(av[k]);
+      if (streaming) {
+        if (stream[n-1] == NULL) { err = 5; break; }
+        fprintf(log, "ImageStreamSave(I%d, \"%s\")\n", n-1, av[k]);
+        ImageStreamSave(stream[n-1], av[k]);
+      } else if (len >= 4 && strcmp(av[k] + len - 4, ".rle") == 0) {
+        fprintf(log, "ImageSaveNative(I%d, \"%s\")\n", n-1, av[k]);
+        ImageSaveNative(GetImage(img, expr, n-1), av[k]);
+      } else {
+        fprintf(log, "ImageSave(I%d, \"%s\")\n", n-1, av[k]);
+        ImageSave(GetImage(img, expr, n-1), av[k]);
+      }
     } else {  // image file
       if (n >= N) { err = 3; break; }
-      fprintf(log, "ImageLoad(\"%s\") -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
+      if (streaming) {
+        fprintf(log, "ImageStreamOpen(\"%s\") -> I%d\n", av[k], n);
+        stream[n] = ImageStreamOpen(av[k]);
+        img[n] = NULL;
+      } else {
+        fprintf(log, "ImageLoad(\"%s\") -> I%d\n", av[k], n);
+        img[n] = ImageLoad(av[k]);
+      }
       //x if (img[n] == NULL) { err = 999; break; }
       n++;
     }
@@ -213,7 +457,14 @@ int main(int ac, char* av[]) {
   // Destroy remaining images
   while (n > 0) {
     fprintf(log, "ImageDestroy(I%d)\n", n-1);
-    ImageDestroy(&img[--n]);
+    n--;
+    if (stream[n] != NULL) {
+      ImageStreamDestroy(&stream[n]);
+    } else if (expr[n] != NULL) {
+      ImageExprDestroy(&expr[n]);  // also destroys its image
+    } else {
+      ImageDestroy(&img[n]);
+    }
   }
 
   if (err > 0) {
@@ -18,15 +18,33 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time, calibrated time and counters
+///
+/// Measurement scopes collect the same values per operation:
+///
+/// InstrBegin("sort");  // enter a named scope (nested in the current one)
+/// ...
+/// InstrEnd();  // leave it
+/// InstrExportCSV(stdout);  // or InstrExportJSON, to show all scopes
+///
+/// On Linux, hardware events (cycles, cache misses, ...) are measured too,
+/// after InstrPerfOpen() succeeds:
+///
+/// InstrPerfOpen();  // Call once; where not permitted, only times are shown
 
 #include "instrumentation.h"
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Wall time in seconds, from a monotonic clock
+double wall_time(void) ; ///
+
 #if defined(__linux__) || defined(__APPLE__)
 
 //
@@ -43,6 +61,14 @@ double cpu_time(void) {
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+double wall_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &current_time) != 0)
+    return -1.0; // clock_gettime() failed!!!
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
 #endif
 
 
@@ -67,8 +93,115 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+double wall_time(void) {
+  return cpu_time();  // already a wall clock
+}
+
 #endif
 
+/// Array of names of the hardware events measured (NULL if not measured):
+char* InstrPerfName[NUMPERF] = {NULL};  ///extern
+
+// A reading of the hardware events: their raw counts, and how long the
+// group was enabled and actually counting (less when it was multiplexed
+// with other events)
+typedef struct {
+  uint64_t enabled, running;
+  uint64_t value[NUMPERF];
+} PerfSample;
+
+// Read the hardware events measured into sample (0 for the others)
+static void PerfRead(PerfSample* sample) ;
+
+#if defined(__linux__)
+
+//
+// GNU/Linux code to measure hardware events
+//
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// The events, in the order of InstrPerfName
+static const struct {
+  char* name;
+  uint32_t type;
+  uint64_t config;
+} PerfEvents[NUMPERF] = {
+  {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+  {"l1d-misses", PERF_TYPE_HW_CACHE,
+   PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+  {"llc-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+};
+
+// The events are opened as one group, read at once with the group leader
+static int perf_leader = -1;   // file descriptor of the leader, or -1
+static int perf_slot[NUMPERF];  // position of each event in the group
+static int perf_num = 0;       // number of events in the group
+
+/// Start measuring hardware events (see instrumentation.h)
+int InstrPerfOpen(void) { ///
+  if (perf_leader >= 0) return perf_num;
+  for (int e = 0; e < NUMPERF; e++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PerfEvents[e].type;
+    attr.config = PerfEvents[e].config;
+    attr.exclude_kernel = 1;  // allowed with perf_event_paranoid <= 2
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, perf_leader, 0);
+    if (fd < 0) continue;  // not permitted or not supported: not measured
+    if (perf_leader < 0) perf_leader = fd;
+    perf_slot[e] = perf_num++;
+    InstrPerfName[e] = PerfEvents[e].name;
+  }
+  return perf_num;
+}
+
+static void PerfRead(PerfSample* sample) {
+  memset(sample, 0, sizeof(*sample));
+  if (perf_leader < 0) return;
+  uint64_t data[3 + NUMPERF];  // nr, time enabled, time running, values
+  if (read(perf_leader, data, sizeof(data)) < (ssize_t)(3 * sizeof(uint64_t)))
+    return;
+  sample->enabled = data[1];
+  sample->running = data[2];
+  for (int e = 0; e < NUMPERF; e++)
+    if (InstrPerfName[e] != NULL)
+      sample->value[e] = data[3 + perf_slot[e]];
+}
+
+#else
+
+int InstrPerfOpen(void) { ///
+  return 0;  // hardware events are only measured on Linux
+}
+
+static void PerfRead(PerfSample* sample) {
+  memset(sample, 0, sizeof(*sample));
+}
+
+#endif
+
+// Get the count of event e between readings start and end.
+// If the group was multiplexed, the raw counts only cover the time it was
+// running, so their difference is scaled by the time it was enabled over
+// the time it was running, between the two readings.
+static unsigned long PerfDelta(const PerfSample* start, const PerfSample* end,
+                               int e) {
+  uint64_t running = end->running - start->running;
+  if (running == 0 || end->value[e] < start->value[e]) return 0;
+  double scale = (double)(end->enabled - start->enabled) / (double)running;
+  return (unsigned long)((double)(end->value[e] - start->value[e]) * scale);
+}
+
 /// Array of operation counters:
 unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
@@ -80,20 +213,75 @@ char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
 /// Cpu_time read on previous reset (~seconds)
 double InstrTime;  ///extern
 
+// Hardware events read on previous reset
+static PerfSample perf_start;
+
 /// Calibrated Time Unit (in seconds, initially 1s)
 double InstrCTU = 1.0;  ///extern
 
+/// Array of scopes, in the order they were first entered:
+InstrScope InstrScopes[NUMSCOPES];  ///extern
+
+/// Number of scopes in InstrScopes:
+int InstrNumScopes = 0;  ///extern
+
+// Deepest nesting of scopes measured
+#define MAXDEPTH 32
+
+// The scopes entered and not left yet, innermost last
+static struct {
+  int scope;      // index in InstrScopes, or -1 if the table was full
+  double wall;    // wall_time when entered
+  double cpu;     // cpu_time when entered
+  unsigned long count[NUMCOUNTERS];  // counters when entered
+  PerfSample perf;                   // hardware events when entered
+} active[MAXDEPTH];
+static int depth = 0;
+
+// Get the file where the CTU is cached, or NULL if none:
+// $INSTRCTU_CACHE (none if empty), else $XDG_CACHE_HOME/instrctu,
+// else $HOME/.cache/instrctu (creating the cache directory if needed).
+static const char* CacheFile(char* buf, size_t size) {
+  const char* path = getenv("INSTRCTU_CACHE");
+  if (path != NULL) return (path[0] != '\0') ? path : NULL;
+  const char* dir = getenv("XDG_CACHE_HOME");
+  if (dir != NULL && dir[0] != '\0') {
+    snprintf(buf, size, "%s", dir);
+  } else {
+    const char* home = getenv("HOME");
+    if (home == NULL || home[0] == '\0') return NULL;
+    snprintf(buf, size, "%s/.cache", home);
+  }
+  mkdir(buf, 0700);  // fails harmlessly if it exists
+  size_t len = strlen(buf);
+  if (len + sizeof("/instrctu") > size) return NULL;
+  snprintf(buf + len, size - len, "/instrctu");
+  return buf;
+}
+
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
 /// If environment variable INSTRCTU is defined, get CTU from there
 /// and bypass the calibration loop entirely.
+/// Otherwise, the CTU measured is cached in file $INSTRCTU_CACHE, or by
+/// default $XDG_CACHE_HOME/instrctu (or $HOME/.cache/instrctu), and read
+/// from there in later runs, so the loop only runs once per machine.
+/// Setting INSTRCTU_CACHE to an empty string disables the cache.
 void InstrCalibrate(void) { ///
   char *val = getenv("INSTRCTU");
+  char buf[4096];
+  const char* cache = (val == NULL) ? CacheFile(buf, sizeof(buf)) : NULL;
+  FILE* f;
+  int cached = 0;
   if (val != NULL) {
     InstrCTU = atof(val);
   }
-  else {
+  else if (cache != NULL && (f = fopen(cache, "r")) != NULL) {
+    cached = fscanf(f, "%lf", &InstrCTU) == 1 && InstrCTU > 0.0;
+    fclose(f);
+  }
+  if (val == NULL && !cached) {
     const int size = 4*1024;     // 2^12!
     const int mask = size - 1;
     int array[size];  // alloc array in stack, not initialized on purpose
@@ -107,21 +295,45 @@ void InstrCalibrate(void) { ///
       //printf("%d %d %d\n", i, j, k);  // debug
     }
     InstrCTU = cpu_time() - time;
+    // Failing to write the cache is harmless: it is just not used
+    if (cache != NULL && (f = fopen(cache, "w")) != NULL) {
+      fprintf(f, "%.6f\n", InstrCTU);
+      fclose(f);
+    }
   }
   printf("# export INSTRCTU=%.3f  # (To bypass calibration)\n", InstrCTU);
 }
 
-/// Reset counters to zero and store cpu_time.
+/// Reset counters and scopes to zero and store cpu_time.
+/// Scopes being measured restart from now.
 void InstrReset(void) { ///
   for (int i = 0; i < NUMCOUNTERS; i++)
     InstrCount[i] = 0ul;
+  PerfRead(&perf_start);
   InstrTime = cpu_time();
+
+  for (int s = 0; s < InstrNumScopes; s++) {
+    InstrScope* scope = &InstrScopes[s];
+    scope->calls = 0;
+    scope->wall = scope->cpu = 0.0;
+    memset(scope->count, 0, sizeof(scope->count));
+    memset(scope->perf, 0, sizeof(scope->perf));
+  }
+  double wall = wall_time();
+  for (int d = 0; d < depth && d < MAXDEPTH; d++) {
+    active[d].wall = wall;
+    active[d].cpu = InstrTime;
+    memset(active[d].count, 0, sizeof(active[d].count));
+    active[d].perf = perf_start;
+  }
 }
 
-// Print times and all named counter values
+// Print times, all named counter values and the hardware events measured
 void InstrPrint(void) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
+  PerfSample perf;
+  PerfRead(&perf);
   // compute time in calibrated time units:
   double caltime = time / InstrCTU;
 
@@ -129,23 +341,134 @@ void InstrPrint(void) { ///
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
       printf("\t%15.15s", InstrName[i]);
+  for (int i = 0; i < NUMPERF; i++)
+    if (InstrPerfName[i] != NULL)
+      printf("\t%15.15s", InstrPerfName[i]);
   puts("");
   printf("%15.6f\t%15.6f", time, caltime);
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
       printf("\t%15lu", InstrCount[i]);  
+  for (int i = 0; i < NUMPERF; i++)
+    if (InstrPerfName[i] != NULL)
+      printf("\t%15lu", PerfDelta(&perf_start, &perf, i));
   puts("");
 }
 
-//função acrescentada
-//criada para facilitar a criação de ficheiros csv ou txt para importação excel da função de experimentação ImageAnd_Tests.c
-//o cabeçalho deverá estar nos ficheiros de teste
-void printAND(uint32_t size) { ///
-  // elapsed time since last reset:
-  double time = cpu_time() - InstrTime;
-  // compute time in calibrated time units:
-  double caltime = time / InstrCTU;
+/// Enter the scope named name, nested in the current scope.
+void InstrBegin(const char* name) { ///
+  assert(name != NULL);
+  if (depth >= MAXDEPTH) {  // too deep: not measured
+    depth++;
+    return;
+  }
+  int parent = (depth > 0) ? active[depth - 1].scope : -1;
+  int s = 0;
+  while (s < InstrNumScopes && (InstrScopes[s].parent != parent ||
+                                strcmp(InstrScopes[s].name, name) != 0))
+    s++;
+  if (s == InstrNumScopes) {
+    if (s < NUMSCOPES) {
+      InstrScopes[s] = (InstrScope){.name = name, .parent = parent};
+      InstrNumScopes++;
+    } else {
+      s = -1;  // the table is full: not recorded
+    }
+  }
+  active[depth].scope = s;
+  memcpy(active[depth].count, InstrCount, sizeof(InstrCount));
+  PerfRead(&active[depth].perf);
+  active[depth].cpu = cpu_time();
+  active[depth].wall = wall_time();
+  depth++;
+}
+
+/// Leave the current scope, adding what was measured to its totals.
+void InstrEnd(void) { ///
+  double wall = wall_time();
+  double cpu = cpu_time();
+  PerfSample perf;
+  PerfRead(&perf);
+  assert(depth > 0);
+  depth--;
+  if (depth >= MAXDEPTH || active[depth].scope < 0) return;
+  InstrScope* scope = &InstrScopes[active[depth].scope];
+  scope->calls++;
+  scope->wall += wall - active[depth].wall;
+  scope->cpu += cpu - active[depth].cpu;
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    scope->count[i] += InstrCount[i] - active[depth].count[i];
+  for (int i = 0; i < NUMPERF; i++)
+    scope->perf[i] += PerfDelta(&active[depth].perf, &perf, i);
+}
+
+/// Find the index of the first scope named name, or -1 if none.
+int InstrFind(const char* name) { ///
+  for (int s = 0; s < InstrNumScopes; s++)
+    if (strcmp(InstrScopes[s].name, name) == 0)
+      return s;
+  return -1;
+}
 
-  //printf(",%d,%.6f,%llu \n", size, caltime, InstrCount[0]);
-  printf("%d,%.6f,%lu \n", size, caltime, InstrCount[0]);
+// Write the path of scope s to f
+static void ExportPath(FILE* f, int s) {
+  if (InstrScopes[s].parent >= 0) {
+    ExportPath(f, InstrScopes[s].parent);
+    fputc('/', f);
+  }
+  fputs(InstrScopes[s].name, f);
+}
+
+/// Write all scopes to f as CSV, one line per scope.
+/// Columns: scope path, calls, wall and cpu times (s), calibrated time,
+/// named counters and the hardware events measured.  Scopes not entered since the last reset are
+/// omitted.
+void InstrExportCSV(FILE* f) { ///
+  fprintf(f, "scope,calls,wall,cpu,caltime");
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    if (InstrName[i] != NULL)
+      fprintf(f, ",%s", InstrName[i]);
+  for (int i = 0; i < NUMPERF; i++)
+    if (InstrPerfName[i] != NULL)
+      fprintf(f, ",%s", InstrPerfName[i]);
+  fputc('\n', f);
+  for (int s = 0; s < InstrNumScopes; s++) {
+    const InstrScope* scope = &InstrScopes[s];
+    if (scope->calls == 0) continue;
+    ExportPath(f, s);
+    fprintf(f, ",%lu,%.6f,%.6f,%.6f", scope->calls, scope->wall,
+            scope->cpu, scope->cpu / InstrCTU);
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      if (InstrName[i] != NULL)
+        fprintf(f, ",%lu", scope->count[i]);
+    for (int i = 0; i < NUMPERF; i++)
+      if (InstrPerfName[i] != NULL)
+        fprintf(f, ",%lu", scope->perf[i]);
+    fputc('\n', f);
+  }
+}
+
+/// Write all scopes to f as a JSON array, one object per scope,
+/// with the same fields as InstrExportCSV.
+void InstrExportJSON(FILE* f) { ///
+  fputc('[', f);
+  int first = 1;
+  for (int s = 0; s < InstrNumScopes; s++) {
+    const InstrScope* scope = &InstrScopes[s];
+    if (scope->calls == 0) continue;
+    fprintf(f, "%s\n  {\"scope\": \"", first ? "" : ",");
+    first = 0;
+    ExportPath(f, s);
+    fprintf(f, "\", \"calls\": %lu, \"wall\": %.6f, \"cpu\": %.6f, "
+            "\"caltime\": %.6f", scope->calls, scope->wall, scope->cpu,
+            scope->cpu / InstrCTU);
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      if (InstrName[i] != NULL)
+        fprintf(f, ", \"%s\": %lu", InstrName[i], scope->count[i]);
+    for (int i = 0; i < NUMPERF; i++)
+      if (InstrPerfName[i] != NULL)
+        fprintf(f, ", \"%s\": %lu", InstrPerfName[i], scope->perf[i]);
+    fputc('}', f);
+  }
+  fprintf(f, "\n]\n");
 }
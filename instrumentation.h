@@ -21,10 +21,27 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time, calibrated time and counters
+///
+/// Measurement scopes collect the same values per operation:
+///
+/// InstrBegin("sort");  // enter a named scope (nested in the current one)
+/// ...
+/// InstrEnd();  // leave it
+/// InstrExportCSV(stdout);  // or InstrExportJSON, to show all scopes
+///
+/// On Linux, hardware events (cycles, cache misses, ...) are measured too,
+/// after InstrPerfOpen() succeeds:
+///
+/// InstrPerfOpen();  // Call once; where not permitted, only times are shown
+
+#include <stdio.h>
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Wall time in seconds, from a monotonic clock
+double wall_time(void) ; ///
+
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
@@ -40,17 +57,76 @@ extern double InstrTime;  ///extern
 /// Calibrated Time Unit (in seconds, initially 1s)
 extern double InstrCTU;  ///extern
 
+/// At most this many hardware events are measured
+#define NUMPERF 5
+
+/// Array of names of the hardware events measured (NULL if not measured):
+extern char* InstrPerfName[NUMPERF];  ///extern
+
+/// Start measuring hardware events with Linux perf events: cycles,
+/// instructions, branch misses, L1 data cache and last level cache misses.
+/// Only the events of the calling thread are counted, so call it from the
+/// thread that measures scopes (work done by other threads is not seen).
+/// Events that cannot be opened (no permission, see
+/// /proc/sys/kernel/perf_event_paranoid, or no such hardware counter)
+/// are just not measured.
+/// Returns the number of events measured (0 if none, or not on Linux).
+int InstrPerfOpen(void) ;
+
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
 /// If environment variable INSTRCTU is defined, get CTU from there
 /// and bypass the calibration loop entirely.
+/// Otherwise, the CTU measured is cached in file $INSTRCTU_CACHE, or by
+/// default $XDG_CACHE_HOME/instrctu (or $HOME/.cache/instrctu), and read
+/// from there in later runs.  Set INSTRCTU_CACHE="" to disable the cache.
 void InstrCalibrate(void) ;
 
-/// Reset counters to zero and store cpu_time.
+/// Reset counters and scopes to zero and store cpu_time.
 void InstrReset(void) ;
 
 void InstrPrint(void) ;
 
+/// At most this many scopes are recorded
+#define NUMSCOPES 64
+
+/// A measurement scope: the totals of all the times it was entered
+/// from the same enclosing scope.
+typedef struct {
+  const char* name;
+  int parent;           // index of the enclosing scope, or -1
+  unsigned long calls;  // times entered
+  double wall;          // wall time spent in the scope (s)
+  double cpu;           // cpu time spent in the scope (s)
+  unsigned long count[NUMCOUNTERS];  // counter increments in the scope
+  unsigned long perf[NUMPERF];       // hardware events in the scope
+} InstrScope;
+
+/// Array of scopes, in the order they were first entered:
+extern InstrScope InstrScopes[NUMSCOPES];  ///extern
+
+/// Number of scopes in InstrScopes:
+extern int InstrNumScopes;  ///extern
+
+/// Enter the scope named name (a string that must outlive the scope),
+/// nested in the current scope.
+/// Scopes must be entered and left by a single thread.
+void InstrBegin(const char* name) ;
+
+/// Leave the current scope.
+void InstrEnd(void) ;
+
+/// Find the index of the first scope named name, or -1 if none.
+int InstrFind(const char* name) ;
+
+/// Write all scopes to f as CSV, one line per scope.
+/// Scope paths are their names and those of their enclosing scopes,
+/// separated by '/'.
+void InstrExportCSV(FILE* f) ;
+
+/// Write all scopes to f as a JSON array, one object per scope.
+void InstrExportJSON(FILE* f) ;
+
 #endif
 